@@ -1,25 +1,65 @@
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "basic.h"
 #include "dancing.h"
+#include "dancing_file.h"
+#include "dancing_reduce.h"
+#include "dancing_stream.h"
+#include "dancing_symmetry.h"
 #include "dancing_threads.h"
 
 
 static void print_help() {
     fprintf(stderr, "Options:\n"
         "    -j N          Number of workers (default: no multithreading)\n"
-        "    -d N          Depth at which to fork if multithreading (default: 3)\n"
+        "    -d N          Depth down to which workers share the search (default: by branch size)\n"
         "    -n N          Problem size (problem-specific)\n"
         "    -p            Print matrix (default: no)\n"
         "    -z            Print statistics (default: no)\n"
         "    -s            Print solutions (default: no)\n"
-        "    -f FILENAME   Initial problem file (default: no initial problem)\n");
+        "    -f FILENAME   File of problems to solve, one per line, or - for stdin (default: none)\n"
+        "    -m DIRECTORY  Cache generated matrices in DIRECTORY (default: no cache)\n"
+        "    -o FILENAME   Write solutions to FILENAME as a binary stream, or - for stdout (default: none)\n"
+        "    -k            Compress each solution in the stream against the one before (default: no)\n"
+        "    -y            Find only one of each set of symmetric solutions (default: no)\n"
+        "    -r            Reduce the matrix before searching (default: no)\n"
+        "    -R            Reduce it, also removing dominated rows (which loses some solutions,\n"
+        "                  so it can't be used with -s, -o or counting)\n"
+        "    -l            Renumber the nodes to keep each column's rows together (default: no)\n"
+        "    -e ENGINE     Search engine: auto, recursive, iterative, count, cells, bits (default: auto)\n"
+        "    -c            Count solutions only (same as -e count; can't be used with -o)\n");
     exit(1);
 }
 
 
+static char *ENGINE_NAMES[] = {
+    [ENGINE_AUTO] = "auto",
+    [ENGINE_RECURSIVE] = "recursive",
+    [ENGINE_ITERATIVE] = "iterative",
+    [ENGINE_COUNT] = "count",
+    [ENGINE_CELLS] = "cells",
+    [ENGINE_BITS] = "bits"
+};
+
+
+static SearchEngine parse_engine(char *name) {
+    int i;
+    for (i = 0; i < sizeof(ENGINE_NAMES) / sizeof(ENGINE_NAMES[0]); i++) {
+        if (strcmp(name, ENGINE_NAMES[i]) == 0)
+            return i;
+    }
+
+    fprintf(stderr, "Unknown engine %s\n", name);
+    print_help();
+    return ENGINE_AUTO;
+}
+
+
 static void parse_command_line(int argc, char *argv[], Options *options) {
     int i;
     for (i = 1; i < argc; i++) {
@@ -57,6 +97,43 @@ static void parse_command_line(int argc, char *argv[], Options *options) {
                 options->input_filename = argv[++i];
             } break;
 
+            case 'm': {
+                options->cache_dir = argv[++i];
+            } break;
+
+            case 'o': {
+                options->output_filename = argv[++i];
+            } break;
+
+            case 'k': {
+                options->compress_output = 1;
+            } break;
+
+            case 'y': {
+                options->break_symmetry = 1;
+            } break;
+
+            case 'r': {
+                options->reduce = 1;
+            } break;
+
+            case 'R': {
+                options->reduce = 1;
+                options->reduce_flags = REDUCE_DOMINATED;
+            } break;
+
+            case 'l': {
+                options->renumber = 1;
+            } break;
+
+            case 'e': {
+                options->engine = parse_engine(argv[++i]);
+            } break;
+
+            case 'c': {
+                options->engine = ENGINE_COUNT;
+            } break;
+
             case 'h': {
                 print_help();
             } break;
@@ -70,6 +147,53 @@ static void parse_command_line(int argc, char *argv[], Options *options) {
 }
 
 
+static int cache_path(Options *options, char *path, size_t length, char *fmt, va_list args) {
+    if (!options->cache_dir)
+        return 0;
+
+    char key[1024];
+    vsnprintf(key, sizeof(key), fmt, args);
+    snprintf(path, length, "%s/%s.dlxm", options->cache_dir, key);
+    return 1;
+}
+
+
+/**
+ * Load a matrix saved by save_cached_matrix under the same key (formatted like a column name,
+ * and including every option the matrix depends on), if there is a cache directory (-m).
+ * Returns NULL if the matrix has to be generated.
+ */
+Matrix *load_cached_matrix(Options *options, char *fmt, ...) {
+    char path[2048];
+    va_list args;
+    va_start(args, fmt);
+    int cached = cache_path(options, path, sizeof(path), fmt, args);
+    va_end(args);
+
+    return cached ? load_matrix(path) : NULL;
+}
+
+
+/* Save a generated matrix for load_cached_matrix, if there is a cache directory. */
+void save_cached_matrix(Options *options, Matrix *matrix, char *fmt, ...) {
+    char path[2048];
+    va_list args;
+    va_start(args, fmt);
+    int cached = cache_path(options, path, sizeof(path), fmt, args);
+    va_end(args);
+    if (!cached)
+        return;
+
+    /* Write to a temporary file first, so a concurrent run never maps a half-written one. */
+    char temp_path[2100];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int) getpid());
+    if (!save_matrix(matrix, temp_path) || rename(temp_path, path) != 0) {
+        fprintf(stderr, "Warning, could not save matrix to %s\n", path);
+        unlink(temp_path);
+    }
+}
+
+
 static int quiet_callback(Matrix *matrix, void *baton) {
     return 0;
 }
@@ -79,36 +203,162 @@ int basic_main(int argc, char *argv[], CreateProblem create_problem, DestroyProb
     Options options;
 
     options.num_threads = 0;
-    options.thread_depth = 3;
+    options.thread_depth = ADAPTIVE_DEPTH;
     options.problem_size = 1;
     options.print_matrix = 0;
     options.print_stats = 0;
     options.print_solution = 0;
     options.input_filename = NULL;
+    options.cache_dir = NULL;
+    options.output_filename = NULL;
+    options.compress_output = 0;
+    options.break_symmetry = 0;
+    options.reduce = 0;
+    options.reduce_flags = 0;
+    options.renumber = 0;
+    options.engine = ENGINE_AUTO;
 
     parse_command_line(argc, argv, &options);
 
+    struct timespec build_start_time;
+    clock_gettime(CLOCK_MONOTONIC, &build_start_time);
+
     Problem *problem = create_problem(&options);
 
+    struct timespec build_stop_time;
+    clock_gettime(CLOCK_MONOTONIC, &build_stop_time);
+
+    double renumber_time = 0;
+    if (options.renumber) {
+        if (options.output_filename) {
+            fprintf(stderr, "Solutions can't be streamed from renumbered nodes, whose rows are numbered differently\n");
+            exit(1);
+        }
+#if INDEX_NODES
+        NodeId *remap = renumber_nodes(problem->matrix);
+        if (!remap) {
+            fprintf(stderr, "Nodes can't be renumbered with COMPACT_NODES\n");
+            exit(1);
+        }
+        if (problem->renumber)
+            problem->renumber(problem, remap);
+        free(remap);
+#else
+        fprintf(stderr, "Nodes can only be renumbered with INDEX_NODES\n");
+        exit(1);
+#endif
+        struct timespec renumber_stop_time;
+        clock_gettime(CLOCK_MONOTONIC, &renumber_stop_time);
+        renumber_time = renumber_stop_time.tv_sec + renumber_stop_time.tv_nsec/1E+9
+                      - build_stop_time.tv_sec - build_stop_time.tv_nsec/1E+9;
+    }
+    problem->matrix->engine = options.engine;
+
     if (options.print_matrix) {
         print_matrix(problem->matrix);    
         exit(1);
     }
 
+    /* Symmetries are broken after reducing, so any symmetric copy of a solution is still found. */
+    ReduceStats reduce_stats;
+    int solvable = 1;
+    double reduce_time = 0;
+    if (options.reduce) {
+        if ((options.reduce_flags & REDUCE_DOMINATED)
+                && (options.print_solution || options.output_filename || options.engine == ENGINE_COUNT)) {
+            fprintf(stderr, "Dominated rows can't be removed when the solutions are printed, streamed or counted, since some are lost\n");
+            exit(1);
+        }
+        struct timespec reduce_start_time, reduce_stop_time;
+        clock_gettime(CLOCK_MONOTONIC, &reduce_start_time);
+        solvable = reduce_matrix(problem->matrix, options.reduce_flags, &reduce_stats);
+        clock_gettime(CLOCK_MONOTONIC, &reduce_stop_time);
+        reduce_time = reduce_stop_time.tv_sec + reduce_stop_time.tv_nsec/1E+9
+                    - reduce_start_time.tv_sec - reduce_start_time.tv_nsec/1E+9;
+    }
+
+    /* The problem declares its symmetries (when asked to with -y) as it creates the matrix. */
+    int group_size = 0;
+    if (options.break_symmetry) {
+        if (options.input_filename || options.engine == ENGINE_COUNT) {
+            fprintf(stderr, "Symmetries can't be broken for a file of problems or when only counting\n");
+            exit(1);
+        }
+        if (problem->matrix->symmetry)
+            group_size = break_symmetry(problem->matrix, 0);
+        if (group_size == 0)
+            fprintf(stderr, "Warning, no symmetries were broken\n");
+    }
+
     /* If we're not printing the solution, just replace the callback with a quiet one. */
-    if (!options.print_solution) {
+    if (!options.print_solution || options.engine == ENGINE_COUNT) {
         problem->matrix->solution_callback = quiet_callback;
     }
 
+    /* Streaming the solutions takes the place of the problem's own printing. */
+    FILE *output_file = NULL;
+    SolutionWriter *writer = NULL;
+    if (options.output_filename) {
+        if (options.input_filename) {
+            fprintf(stderr, "Solutions to a file of problems can't be streamed\n");
+            exit(1);
+        }
+        if (options.engine == ENGINE_COUNT) {
+            fprintf(stderr, "Solutions can't be streamed when only counting\n");
+            exit(1);
+        }
+        output_file = strcmp(options.output_filename, "-") == 0 ? stdout : fopen(options.output_filename, "wb");
+        if (!output_file) {
+            perror(options.output_filename);
+            exit(1);
+        }
+        writer = create_solution_writer(problem->matrix, output_file, options.compress_output ? STREAM_COMPRESSED : STREAM_PLAIN);
+        if (!writer) {
+            fprintf(stderr, "Solutions can only be streamed with INDEX_NODES\n");
+            exit(1);
+        }
+        problem->matrix->solution_callback = (Callback) write_solution;
+        problem->matrix->solution_baton = writer;
+    }
+
+    FILE *input_file = NULL;
+    if (options.input_filename) {
+        if (!problem->solve_file) {
+            fprintf(stderr, "This problem can't be read from a file\n");
+            exit(1);
+        }
+        input_file = strcmp(options.input_filename, "-") == 0 ? stdin : fopen(options.input_filename, "r");
+        if (!input_file) {
+            perror(options.input_filename);
+            exit(1);
+        }
+    }
+
     struct timespec start_time;
     clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start_time);
     
-    if (options.num_threads > 0) {
+    if (input_file) {
+        if (solvable)
+            problem->solve_file(problem, &options, input_file);
+        if (input_file != stdin)
+            fclose(input_file);
+    } else if (!solvable) {
+        /* The reduction found a column that can't be covered. */
+    } else if (options.num_threads > 0) {
         search_with_threads(problem->matrix, options.thread_depth, options.num_threads);
     } else {
         search_matrix(problem->matrix, 0);
     }
 
+    long int stream_size = 0;
+    if (writer) {
+        stream_size = writer->bytes_written + writer->buffer_used;
+        if (!destroy_solution_writer(writer))
+            fprintf(stderr, "Warning, could not write all the solutions to %s\n", options.output_filename);
+        if (output_file != stdout)
+            fclose(output_file);
+    }
+
     struct timespec stop_time;
     clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &stop_time);
 
@@ -117,12 +367,60 @@ int basic_main(int argc, char *argv[], CreateProblem create_problem, DestroyProb
 
     if (options.print_stats) {
         fprintf(stderr, "Matrix size: %d columns, %d rows, %d nodes\n", problem->matrix->num_columns, problem->matrix->num_rows, problem->matrix->num_nodes);
+        fprintf(stderr, "Build time: %0.3f seconds\n", build_stop_time.tv_sec + build_stop_time.tv_nsec/1E+9
+                - build_start_time.tv_sec - build_start_time.tv_nsec/1E+9);
+        if (options.renumber)
+            fprintf(stderr, "Renumber time: %0.3f seconds\n", renumber_time);
+        if (options.reduce) {
+            fprintf(stderr, "Reduction: %d passes in %0.3f seconds%s\n", reduce_stats.num_passes, reduce_time,
+                    solvable ? "" : ", no solution");
+            fprintf(stderr, "Rows forced: %ld, removed: %ld clashing, %ld dominated, %ld without primary columns\n",
+                    reduce_stats.forced_rows, reduce_stats.clashing_rows, reduce_stats.dominated_rows,
+                    reduce_stats.secondary_rows);
+        }
         fprintf(stderr, "Search calls: %ld\n", problem->matrix->search_calls);
         fprintf(stderr, "Solutions found: %ld\n", problem->matrix->num_solutions);
+        if (group_size > 0) {
+            Matrix *matrix = problem->matrix;
+            Symmetry *symmetry = matrix->symmetry;
+            fprintf(stderr, "Symmetries: %d\n", group_size);
+            if (symmetry->breaker) {
+                char *name = HEADER(symmetry->breaker).name;
+                fprintf(stderr, "Symmetry broken in column %s: %d of %d rows kept\n", name ? name : "?",
+                        symmetry->kept_rows, symmetry->breaker_rows);
+            }
+            fprintf(stderr, "Solutions including symmetric copies: %ld\n", problem->matrix->num_symmetric_solutions);
+        }
         fprintf(stderr, "Search time: %0.3f seconds\n", search_time);
+        if (options.output_filename && problem->matrix->num_solutions > 0) {
+            fprintf(stderr, "Stream size: %ld bytes (%0.1f per solution)\n", stream_size,
+                    (double) stream_size / problem->matrix->num_solutions);
+        }
+        if (input_file) {
+            fprintf(stderr, "Problems: %ld (%ld solved)\n", problem->num_problems, problem->num_solved);
+            if (search_time > 0)
+                fprintf(stderr, "Problems per second: %0.0f\n", problem->num_problems / search_time);
+        }
         if (options.num_threads > 0) {
-            fprintf(stderr, "Messages: %ld\n", problem->matrix->num_messages);
-            fprintf(stderr, "Subsearches: %ld\n", problem->matrix->num_subsearches);
+            fprintf(stderr, "Requests for work: %ld\n", problem->matrix->num_messages);
+            fprintf(stderr, "Tasks: %ld\n", problem->matrix->num_subsearches);
+            fprintf(stderr, "Solution batches: %ld\n", problem->matrix->num_batches);
+            fprintf(stderr, "Clone time: %0.3f seconds (with compiling for the engine)\n", problem->matrix->clone_time);
+            if (problem->matrix->num_subsearches > 0) {
+                fprintf(stderr, "Task time: %0.3f seconds (%0.1f us per task)\n", problem->matrix->subsearch_time,
+                        problem->matrix->subsearch_time * 1E+6 / problem->matrix->num_subsearches);
+            }
+            if (options.thread_depth == ADAPTIVE_DEPTH) {
+                fprintf(stderr, "Branches shared: %ld\n", problem->matrix->num_shared_branches);
+                fprintf(stderr, "Probe time: %0.3f seconds\n", problem->matrix->probe_time);
+            }
+            fprintf(stderr, "Branches searched whole: %ld\n", problem->matrix->num_whole_branches);
+            static const char *bin_names[NUM_BRANCH_TIMES] = {
+                "under 10 us", "10-100 us", "0.1-1 ms", "1-10 ms", "10-100 ms", "0.1-1 s", "1 s and over"
+            };
+            int i;
+            for (i = 0; i < NUM_BRANCH_TIMES; i++)
+                fprintf(stderr, "    %-14s%ld\n", bin_names[i], problem->matrix->branch_times[i]);
         }
     }
 
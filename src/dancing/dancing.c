@@ -1,17 +1,22 @@
 #include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "dancing.h"
+#include "dancing_bits.h"
+#include "dancing_cells.h"
+#include "dancing_file.h"
+#include "dancing_symmetry.h"
 
 
-static void insert_horizontally(Matrix *matrix, NodeId node, NodeId after) {
-    NODE(node).left = after;
-    NODE(node).right = NODE(after).right;
-    NODE(after).right = node;
-    NODE(NODE(node).right).left = node;
+static void insert_horizontally(Matrix *matrix, NodeId column, NodeId after) {
+    COLUMN_LEFT(column) = after;
+    COLUMN_RIGHT(column) = COLUMN_RIGHT(after);
+    COLUMN_RIGHT(after) = column;
+    COLUMN_LEFT(COLUMN_RIGHT(column)) = column;
 }
 
 
@@ -23,9 +28,9 @@ static void insert_vertically(Matrix *matrix, NodeId node, NodeId after) {
 }
 
 
-static void remove_horizontally(Matrix *matrix, NodeId node) {
-    NODE(NODE(node).left).right = NODE(node).right;
-    NODE(NODE(node).right).left = NODE(node).left;
+static void remove_horizontally(Matrix *matrix, NodeId column) {
+    COLUMN_RIGHT(COLUMN_LEFT(column)) = COLUMN_RIGHT(column);
+    COLUMN_LEFT(COLUMN_RIGHT(column)) = COLUMN_LEFT(column);
 }
 
 
@@ -35,9 +40,9 @@ static void remove_vertically(Matrix *matrix, NodeId node) {
 }
 
 
-static void restore_horizontally(Matrix *matrix, NodeId node) {
-    NODE(NODE(node).left).right = node;
-    NODE(NODE(node).right).left = node;
+static void restore_horizontally(Matrix *matrix, NodeId column) {
+    COLUMN_RIGHT(COLUMN_LEFT(column)) = column;
+    COLUMN_LEFT(COLUMN_RIGHT(column)) = column;
 }
 
 
@@ -47,68 +52,282 @@ static void restore_vertically(Matrix *matrix, NodeId node) {
 }
 
 
+#if SIZE_BUCKETS
+/*
+ * Columns join a bucket at the tail, so its head is the column that has been that size longest.
+ * The head's bucket_prev points to the tail to make that constant time.
+ */
+static void bucket_link(Matrix *matrix, NodeId column, int size) {
+    NodeId first = matrix->buckets.data[size];
+    HEADER(column).bucket_next = 0;
+    if (first) {
+        NodeId last = HEADER(first).bucket_prev;
+        HEADER(last).bucket_next = column;
+        HEADER(column).bucket_prev = last;
+        HEADER(first).bucket_prev = column;
+    } else {
+        HEADER(column).bucket_prev = column;
+        matrix->buckets.data[size] = column;
+    }
+}
+
+
+static void bucket_unlink(Matrix *matrix, NodeId column, int size) {
+    NodeId first = matrix->buckets.data[size];
+    NodeId prev = HEADER(column).bucket_prev;
+    NodeId next = HEADER(column).bucket_next;
+    if (column == first)
+        matrix->buckets.data[size] = next;
+    else
+        HEADER(prev).bucket_next = next;
+    if (next)
+        HEADER(next).bucket_prev = prev;
+    else if (column != first)
+        HEADER(first).bucket_prev = prev;
+}
+
+
+/* Make room for a bucket of the given size; only building a matrix can need a new one. */
+static void bucket_reserve(Matrix *matrix, int size) {
+    if (size >= matrix->buckets.num) {
+        EXTARRAY_ENSURE(matrix->buckets, size + 1);
+        memset(&matrix->buckets.data[matrix->buckets.num], 0, (size + 1 - matrix->buckets.num) * sizeof(NodeId));
+        matrix->buckets.num = size + 1;
+    }
+}
+
+
+static void bucket_insert(Matrix *matrix, NodeId column) {
+    int size = SIZE(column);
+    bucket_link(matrix, column, size);
+    if (size < matrix->bucket_min)
+        matrix->bucket_min = size;
+    matrix->bucket_count++;
+}
+
+
+static void bucket_remove(Matrix *matrix, NodeId column) {
+    bucket_unlink(matrix, column, SIZE(column));
+    matrix->bucket_count--;
+}
+#endif
+
+
+/* Change the size of an uncovered column, keeping it in the right bucket. */
+static inline void decrease_size(Matrix *matrix, NodeId column) {
+#if SIZE_BUCKETS
+    if (HEADER(column).primary) {
+        int size = SIZE(column);
+        bucket_unlink(matrix, column, size);
+        SIZE(column) = --size;
+        bucket_link(matrix, column, size);
+        if (size < matrix->bucket_min)
+            matrix->bucket_min = size;
+        return;
+    }
+#endif
+    SIZE(column)--;
+}
+
+
+static inline void increase_size(Matrix *matrix, NodeId column) {
+#if SIZE_BUCKETS
+    if (HEADER(column).primary) {
+        int size = SIZE(column);
+        bucket_unlink(matrix, column, size);
+        SIZE(column) = ++size;
+        bucket_link(matrix, column, size);
+        return;
+    }
+#endif
+    SIZE(column)++;
+}
+
+
 static NodeId allocate_node(Matrix *matrix) {
     #if INDEX_NODES
         NodeId id = matrix->nodes.num;
         EXTARRAY_ALLOC(matrix->nodes);
+        if (matrix->colors.data)
+            *(int *) EXTARRAY_ALLOC(matrix->colors) = 0;
         return id;
     #else
-        return SEGARRAY_ALLOC(matrix->nodes);
+        NodeId id = SEGARRAY_ALLOC(matrix->nodes);
+        NODE(id).color = 0;
+        return id;
     #endif
 }
 
 
+/*
+ * Give a new node its colour.  With INDEX_NODES the colours are allocated for the first coloured
+ * node, with every node before it uncoloured, and until then uncoloured nodes need nothing.
+ */
+static void color_node(Matrix *matrix, NodeId node, int color) {
+#if INDEX_NODES
+    if (!matrix->colors.data) {
+        if (color == 0)
+            return;
+        EXTARRAY_ENSURE(matrix->colors, matrix->nodes.num);
+        memset(matrix->colors.data, 0, sizeof(int) * matrix->nodes.num);
+        matrix->colors.num = matrix->nodes.num;
+    }
+#endif
+    SET_COLOR(node, color);
+}
+
+
 static NodeId allocate_header(Matrix *matrix) {
     #if INDEX_NODES
         if (matrix->nodes.num != matrix->headers.num) {
             fprintf(stderr, "Warning, non-header nodes already inserted!");
             matrix->headers.num = matrix->nodes.num;
+            matrix->sizes.num = matrix->nodes.num;
         }
         NodeId id = allocate_node(matrix);
         EXTARRAY_ALLOC(matrix->headers);
+        EXTARRAY_ALLOC(matrix->sizes);
+        #if COMPACT_NODES
+            EXTARRAY_ALLOC(matrix->column_links);
+        #endif
     #else
         NodeId id = SEGARRAY_ALLOC(matrix->headers);
-        if (matrix->headers.segments.num == 0 && matrix->headers.current.num == 1) {
-            matrix->root = id;
-        }
+        NODE(id).color = 0;
     #endif
 
-    if (id != ROOT) {
-        NodeId last = NODE(ROOT).left;
-        insert_horizontally(matrix, id, last);
-        HEADER(id).index = HEADER(last).index + 1;
-    } else {
-        NODE(id).left = id;
-        NODE(id).right = id;
-        HEADER(id).index = 0;
-    }
-
+    COLUMN_LEFT(id) = id;
+    COLUMN_RIGHT(id) = id;
     NODE(id).up = id;
     NODE(id).down = id;
-    HEADER(id).size = 0;
+    NODE(id).column = id;
+    HEADER(id).index = 0;
+    SIZE(id) = 0;
     return id;
 }
 
 
+/*
+ * Columns are kept in the name index as their NodeId, except with pointer nodes, where they are
+ * kept as their position in the header array so that clones (with their own headers) can share it.
+ */
+#if INDEX_NODES
+    #define INDEXED_COLUMN(column) ((long int) (column))
+    #define COLUMN_AT(position) ((NodeId) (position))
+#else
+    #define INDEXED_COLUMN(column) ((long int) HEADER(column).index + 1)
+    #define COLUMN_AT(position) column_at(matrix, position)
+
+    static NodeId column_at(Matrix *matrix, long int position) {
+        int segment = position / matrix->headers.current.max;
+        int offset = position % matrix->headers.current.max;
+        Header *headers = (segment < matrix->headers.segments.num) ? matrix->headers.segments.data[segment] : matrix->headers.current.data;
+        return (NodeId) &headers[offset];
+    }
+#endif
+
+
+/* FNV-1a, which is plenty for column names. */
+unsigned int column_name_hash(const char *name) {
+    unsigned int hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+static void index_insert(ColumnIndex *index, unsigned int hash, long int column, char *name) {
+    int mask = index->num_slots - 1;
+    int i;
+    for (i = hash & mask; index->slots[i].column != -1; i = (i + 1) & mask)
+        ;
+    index->slots[i].hash = hash;
+    index->slots[i].column = column;
+    index->slots[i].name = name;
+    index->num_columns++;
+}
+
+
+/* Add a newly created column to the name index, doubling the slots when it gets half full. */
+static void index_column(Matrix *matrix, NodeId column) {
+    ColumnIndex *index = matrix->column_index;
+    if (!index) {
+        index = matrix->column_index = malloc(sizeof(ColumnIndex));
+        index->num_slots = 0;
+        index->num_columns = 0;
+        index->slots = NULL;
+    }
+
+    if (2 * (index->num_columns + 1) > index->num_slots) {
+        ColumnIndexSlot *old_slots = index->slots;
+        int old_num_slots = index->num_slots;
+        index->num_slots = old_num_slots ? 2 * old_num_slots : 64;
+        index->num_columns = 0;
+        index->slots = malloc(sizeof(ColumnIndexSlot) * index->num_slots);
+        int i;
+        for (i = 0; i < index->num_slots; i++)
+            index->slots[i].column = -1;
+        for (i = 0; i < old_num_slots; i++) {
+            if (old_slots[i].column != -1)
+                index_insert(index, old_slots[i].hash, old_slots[i].column, old_slots[i].name);
+        }
+        free(old_slots);
+    }
+
+    index_insert(index, column_name_hash(HEADER(column).name), INDEXED_COLUMN(column), HEADER(column).name);
+}
+
+
 Matrix *create_matrix() {
     Matrix *matrix = malloc(sizeof(Matrix));
     memset(matrix, 0, sizeof(Matrix));
 
     NodeId root = allocate_header(matrix);
-    matrix->num_rows = 0;
-    NODE(root).up = root;
-    NODE(root).down = root;
-    NODE(root).left = root;
-    NODE(root).right = root;
     HEADER(root).name = "ROOT";
     HEADER(root).primary = 1;
 
+    NodeId secondary_root = allocate_header(matrix);
+    HEADER(secondary_root).name = "SECONDARY_ROOT";
+    HEADER(secondary_root).primary = 0;
+
+    #if INDEX_NODES
+    #else
+        matrix->root = root;
+        matrix->secondary_root = secondary_root;
+    #endif
+
     EXTARRAY_ENSURE(matrix->solution, 100);
 
     return matrix;
 }
 
 
+/* Add a column at the end of its ring, with a name (which the matrix takes) or none (NULL). */
+static NodeId add_column(Matrix *matrix, int primary, char *name) {
+    NodeId column = allocate_header(matrix);
+    HEADER(column).name = name;
+    HEADER(column).primary = primary;
+    HEADER(column).index = matrix->num_columns + 1;
+    HEADER(column).bound = 1;
+    HEADER(column).slack = 0;
+    if (name)
+        index_column(matrix, column);
+
+    NodeId ring = primary ? ROOT : SECONDARY_ROOT;
+    insert_horizontally(matrix, column, COLUMN_LEFT(ring));
+#if SIZE_BUCKETS
+    if (primary) {
+        bucket_reserve(matrix, 0);
+        bucket_insert(matrix, column);
+    }
+#endif
+
+    matrix->num_columns++;
+    return column;
+}
+
+
 NodeId create_column(Matrix *matrix, int primary, char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -118,187 +337,746 @@ NodeId create_column(Matrix *matrix, int primary, char *fmt, ...) {
 
     va_end(args);
 
-    NodeId column = allocate_header(matrix);
-    HEADER(column).name = strdup(buffer);
-    HEADER(column).primary = primary;
+    return add_column(matrix, primary, strdup(buffer));
+}
+
 
-    NodeId prev_column = NODE(column).left;
-    if (primary && !HEADER(prev_column).primary) {
-        fprintf(stderr, "Warning, primary column '%s' appears after non-primary '%s'!\n", HEADER(column).name, HEADER(prev_column).name);
+/**
+ * Rebuild the column name index (and the size buckets) of a matrix whose arrays were filled in
+ * directly, as by load_matrix.
+ */
+void reindex_matrix(Matrix *matrix) {
+#if INDEX_NODES
+    NodeId c;
+    for (c = SECONDARY_ROOT + 1; c < matrix->headers.num; c++) {
+        if (NODE(c).column == c && HEADER(c).name)
+            index_column(matrix, c);
+    }
+#if SIZE_BUCKETS
+    foreachcolumn(ROOT, c) {
+        bucket_reserve(matrix, SIZE(c));
+        bucket_insert(matrix, c);
     }
+#endif
+#endif
+}
 
-    matrix->num_columns++;
-    return column;
+
+/* Name a column that was built without one, such as by build_matrix_csr. */
+void name_column(Matrix *matrix, NodeId column, char *fmt, ...) {
+    if (HEADER(column).name) {
+        fprintf(stderr, "Warning, column %s already has a name!\n", HEADER(column).name);
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+
+    char buffer[2048];
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+
+    va_end(args);
+
+    HEADER(column).name = strdup(buffer);
+    index_column(matrix, column);
 }
 
 
-NodeId create_node(Matrix *matrix, NodeId after, NodeId column) {
+/* The column created i-th (from 0), which for a matrix from build_matrix_csr is column i. */
+NodeId matrix_column(Matrix *matrix, int i) {
+    return COLUMN_AT(i + 2);
+}
+
+
+#if COMPACT_NODES
+/**
+ * Add a node to the end of the node array, which always finishes with a spacer after the last row.
+ * The node either starts a new row (after that spacer), or takes over the spacer's place at the
+ * end of the last row, in which case a new spacer is put after it.  Any other row can't be added
+ * to, so 0 is returned instead.
+ */
+NodeId create_colored_node(Matrix *matrix, NodeId after, NodeId column, int color) {
+    if (after != 0 && (matrix->nodes.num == matrix->headers.num || after != matrix->nodes.num - 2)) {
+        fprintf(stderr, "Error, nodes can only be added to the end of the last row!\n");
+        return 0;
+    }
+
+    NodeId node;
+    if (matrix->nodes.num == matrix->headers.num) {
+        NodeId spacer = allocate_node(matrix);
+        NODE(spacer).column = ROOT;
+        NODE(spacer).up = 0;
+        NODE(spacer).down = 0;
+    }
+
+    NodeId spacer = matrix->nodes.num - 1;
+    NodeId first;
+    if (after == 0) {
+        node = allocate_node(matrix);
+        first = node;
+        matrix->num_rows++;
+    } else {
+        node = spacer;
+        first = NODE(spacer).up;
+    }
+
+    NodeId new_spacer = allocate_node(matrix);
+    NODE(new_spacer).column = ROOT;
+    NODE(new_spacer).up = first;
+    NODE(new_spacer).down = 0;
+    NODE(first - 1).down = node;
+
+    NODE(node).column = column;
+    color_node(matrix, node, color);
+    NodeId last = NODE(column).up;
+    insert_vertically(matrix, node, last);
+#if SIZE_BUCKETS
+    bucket_reserve(matrix, SIZE(column) + 1);
+#endif
+    increase_size(matrix, column);
+
+    matrix->num_nodes++;
+    return node;
+}
+#else
+NodeId create_colored_node(Matrix *matrix, NodeId after, NodeId column, int color) {
     NodeId node = allocate_node(matrix);
     NODE(node).column = column;
+    color_node(matrix, node, color);
     NodeId last = NODE(column).up;
     insert_vertically(matrix, node, last);
-    HEADER(column).size++;
+#if SIZE_BUCKETS
+    bucket_reserve(matrix, SIZE(column) + 1);
+#endif
+    increase_size(matrix, column);
 
     if (after == 0) {
         NODE(node).left = node;
         NODE(node).right = node;
         matrix->num_rows++;
     } else {
-        insert_horizontally(matrix, node, after);
+        NODE(node).left = after;
+        NODE(node).right = NODE(after).right;
+        NODE(after).right = node;
+        NODE(NODE(node).right).left = node;
     }
 
     matrix->num_nodes++;
     return node;
 }
+#endif
+
+
+NodeId create_node(Matrix *matrix, NodeId after, NodeId column) {
+    return create_colored_node(matrix, after, column, 0);
+}
+
+
+/**
+ * Build a matrix from its rows in compressed sparse row form: row r has the columns numbered
+ * column_indices[row_offsets[r]] up to (but not including) column_indices[row_offsets[r + 1]].
+ * Columns are numbered from 0, and the first num_primary of them are primary.  The columns have
+ * no names, but can be named afterwards with name_column (and got with matrix_column).
+ *
+ * With INDEX_NODES, the arrays are allocated at their final size and the nodes are linked in
+ * one pass over the rows, keeping the last node of each column so far.  Otherwise the nodes are
+ * just created one at a time.
+ */
+Matrix *build_matrix_csr(int num_columns, int num_primary, int num_rows, const int *row_offsets, const int *column_indices) {
+    Matrix *matrix = create_matrix();
+    int r, k;
+
+#if INDEX_NODES
+    int num_nodes = row_offsets[num_rows] - row_offsets[0];
+    int num_headers = matrix->headers.num + num_columns;
+    int total = num_headers + num_nodes;
+#if COMPACT_NODES
+    /* A spacer before each row, and one after the last. */
+    total += num_rows + 1;
+    EXTARRAY_RESERVE(matrix->column_links, num_headers);
+#endif
+    EXTARRAY_RESERVE(matrix->nodes, total);
+    EXTARRAY_RESERVE(matrix->headers, num_headers);
+    EXTARRAY_RESERVE(matrix->sizes, num_headers);
+
+    for (k = 0; k < num_columns; k++)
+        add_column(matrix, k < num_primary, NULL);
+    NodeId first_column = matrix_column(matrix, 0);
+#if SIZE_BUCKETS
+    for (k = 0; k < num_primary; k++)
+        bucket_remove(matrix, first_column + k);
+#endif
+
+    NodeId *last = malloc(sizeof(NodeId) * (num_columns + 1));
+    for (k = 0; k < num_columns; k++)
+        last[k] = first_column + k;
+
+#if COMPACT_NODES
+    NodeId spacer = matrix->nodes.num++;
+    NODE(spacer).column = ROOT;
+    NODE(spacer).up = 0;
+#endif
+    for (r = 0; r < num_rows; r++) {
+        int length = row_offsets[r + 1] - row_offsets[r];
+        if (length == 0)
+            continue;
+
+        NodeId first = matrix->nodes.num;
+        NodeId end = first + length;
+        matrix->nodes.num += length;
+        const int *columns = &column_indices[row_offsets[r]];
+        NodeId n;
+        for (n = first; n < end; n++) {
+            int j = *columns++;
+            NodeId column = first_column + j;
+            NODE(n).column = column;
+            NODE(n).up = last[j];
+            NODE(last[j]).down = n;
+            last[j] = n;
+            SIZE(column)++;
+#if !COMPACT_NODES
+            NODE(n).left = (n == first) ? end - 1 : n - 1;
+            NODE(n).right = (n == end - 1) ? first : n + 1;
+#endif
+        }
+#if COMPACT_NODES
+        NODE(spacer).down = end - 1;
+        spacer = matrix->nodes.num++;
+        NODE(spacer).column = ROOT;
+        NODE(spacer).up = first;
+#endif
+        matrix->num_rows++;
+    }
+#if COMPACT_NODES
+    NODE(spacer).down = 0;
+#endif
+
+    for (k = 0; k < num_columns; k++) {
+        NodeId column = first_column + k;
+        NODE(last[k]).down = column;
+        NODE(column).up = last[k];
+#if SIZE_BUCKETS
+        if (k < num_primary) {
+            bucket_reserve(matrix, SIZE(column));
+            bucket_insert(matrix, column);
+        }
+#endif
+    }
+    free(last);
+    matrix->num_nodes = num_nodes;
+#else
+    NodeId *columns = malloc(sizeof(NodeId) * (num_columns + 1));
+    for (k = 0; k < num_columns; k++)
+        columns[k] = add_column(matrix, k < num_primary, NULL);
+
+    for (r = 0; r < num_rows; r++) {
+        NodeId node = 0;
+        for (k = row_offsets[r]; k < row_offsets[r + 1]; k++)
+            node = create_node(matrix, node, columns[column_indices[k]]);
+    }
+    free(columns);
+#endif
+
+    return matrix;
+}
+
+
+/**
+ * Allow a primary column to be covered between lower and upper times (inclusive) rather than
+ * exactly once.  Searches on the matrix then branch on multiplicities as in Knuth's Algorithm M,
+ * whichever engine is selected.
+ */
+void set_column_bounds(Matrix *matrix, NodeId column, int lower, int upper) {
+    HEADER(column).bound = upper;
+    HEADER(column).slack = upper - lower;
+    if (lower != 1 || upper != 1)
+        matrix->multiplicities = 1;
+}
+
+
+static void destroy_row_index(RowIndex *index);
 
 
 void destroy_matrix(Matrix *matrix) {
-    NodeId n;
-    foreachlink(ROOT, right, n) {
-        free(HEADER(n).name);
+    /* Every column is in the name index, even if it is covered.  Mapped names aren't freed. */
+    ColumnIndex *index = matrix->column_index;
+    if (!matrix->shared_names && index) {
+        char *mapping = matrix->mapping;
+        int i;
+        for (i = 0; i < index->num_slots; i++) {
+            if (index->slots[i].column == -1)
+                continue;
+            char *name = index->slots[i].name;
+            if (!mapping || name < mapping || name >= mapping + matrix->mapping_size)
+                free(name);
+        }
+        free(index->slots);
+        free(index);
     }
+    if (matrix->row_index)
+        destroy_row_index(matrix->row_index);
+    if (!matrix->shared_names && matrix->symmetry)
+        destroy_symmetry(matrix->symmetry);
 #if INDEX_NODES
-    EXTARRAY_FREE(matrix->nodes);
-    EXTARRAY_FREE(matrix->headers);
+    if (matrix->mapping) {
+        unmap_matrix(matrix);
+    } else {
+        EXTARRAY_FREE(matrix->nodes);
+        EXTARRAY_FREE(matrix->headers);
+        EXTARRAY_FREE(matrix->sizes);
+        EXTARRAY_FREE(matrix->colors);
+#if COMPACT_NODES
+        EXTARRAY_FREE(matrix->column_links);
+#endif
+    }
 #else
     SEGARRAY_FREE(matrix->nodes);
     SEGARRAY_FREE(matrix->headers);
 #endif
     EXTARRAY_FREE(matrix->solution);
+#if SIZE_BUCKETS
+    EXTARRAY_FREE(matrix->buckets);
+#endif
     free(matrix);
 }
 
 
-#define FIXUP(ptr, old_array, new_array) (ptr = (ptr) - (void *) (old_array) + (void *) (new_array));
+#if INDEX_NODES
+#else
+typedef struct {
+    char *old_start;
+    char *old_end;
+    char *new_start;
+} Relocation;
+
+
+static int compare_relocations(const void *a, const void *b) {
+    const Relocation *r1 = a;
+    const Relocation *r2 = b;
+    return (r1->old_start > r2->old_start) - (r1->old_start < r2->old_start);
+}
+
+
+static void add_relocation(Relocation *relocations, int *num_relocations, void *old_data, void *new_data, size_t length) {
+    Relocation *r = &relocations[(*num_relocations)++];
+    r->old_start = old_data;
+    r->old_end = (char *) old_data + length;
+    r->new_start = new_data;
+}
+
+
+static NodeId relocate(Relocation *relocations, int num_relocations, NodeId ptr) {
+    char *p = (char *) ptr;
+    int lo = 0, hi = num_relocations - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (relocations[mid].old_start <= p)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return (NodeId) (p - relocations[lo].old_start + relocations[lo].new_start);
+}
+
+
+/**
+ * Copy every segment of a segmented array, recording where each one moved to.
+ */
+static void copy_segments(SegArray *dest, SegArray *src, size_t size, Relocation *relocations, int *num_relocations) {
+    int i;
+    dest->segments.num = src->segments.num;
+    dest->segments.max = src->segments.num;
+    dest->segments.data = malloc(src->segments.num * sizeof(void *));
+    for (i = 0; i < src->segments.num; i++) {
+        /* Every retired segment has the same capacity as the current one. */
+        size_t length = src->current.max * size;
+        dest->segments.data[i] = malloc(length);
+        memcpy(dest->segments.data[i], src->segments.data[i], length);
+        add_relocation(relocations, num_relocations, src->segments.data[i], dest->segments.data[i], length);
+    }
+
+    dest->current.num = src->current.num;
+    dest->current.max = src->current.max;
+    dest->current.data = malloc(src->current.max * size);
+    memcpy(dest->current.data, src->current.data, src->current.num * size);
+    add_relocation(relocations, num_relocations, src->current.data, dest->current.data, src->current.max * size);
+}
+#endif
 
 
+/**
+ * Make an independent copy of a matrix, in its current state of covering, for a subsearch.
+ * The node arrays and solution are copied in bulk; column names are shared with the original,
+ * which must therefore outlive the clone.  Statistics in the clone start at zero.
+ */
 Matrix *clone_matrix(Matrix *matrix) {
-#if 0
-    Matrix *new_matrix = create_matrix();
-    EXTARRAY_COPY(new_matrix->nodes, matrix->nodes);
-    EXTARRAY_COPY(new_matrix->headers, matrix->headers);
-    EXTARRAY_COPY(new_matrix->solution, matrix->solution);
-    
-    /* Make sure column names aren't shared with original. */
-    NodeId n;
-    foreachlink(ROOT, right, n) {
-        HEADER(n).name = strdup(HEADER(n).name);
+    Matrix *new_matrix = malloc(sizeof(Matrix));
+    *new_matrix = *matrix;
+    new_matrix->shared_names = 1;
+    new_matrix->row_index = NULL;
+    new_matrix->mapping = NULL;
+
+    new_matrix->num_solutions = 0;
+    new_matrix->num_symmetric_solutions = 0;
+    new_matrix->search_calls = 0;
+    new_matrix->num_messages = 0;
+    new_matrix->num_subsearches = 0;
+    new_matrix->clone_time = 0;
+    new_matrix->subsearch_time = 0;
+
+#if INDEX_NODES
+    new_matrix->nodes.data = malloc(matrix->nodes.num * sizeof(Node));
+    memcpy(new_matrix->nodes.data, matrix->nodes.data, matrix->nodes.num * sizeof(Node));
+    new_matrix->nodes.max = matrix->nodes.num;
+
+    new_matrix->headers.data = malloc(matrix->headers.num * sizeof(Header));
+    memcpy(new_matrix->headers.data, matrix->headers.data, matrix->headers.num * sizeof(Header));
+    new_matrix->headers.max = matrix->headers.num;
+
+    new_matrix->sizes.data = malloc(matrix->sizes.num * sizeof(int));
+    memcpy(new_matrix->sizes.data, matrix->sizes.data, matrix->sizes.num * sizeof(int));
+    new_matrix->sizes.max = matrix->sizes.num;
+
+    if (matrix->colors.data) {
+        new_matrix->colors.data = malloc(matrix->colors.num * sizeof(int));
+        memcpy(new_matrix->colors.data, matrix->colors.data, matrix->colors.num * sizeof(int));
+        new_matrix->colors.max = matrix->colors.num;
     }
-    
+
+#if COMPACT_NODES
+    new_matrix->column_links.data = malloc(matrix->column_links.num * sizeof(ColumnLinks));
+    memcpy(new_matrix->column_links.data, matrix->column_links.data, matrix->column_links.num * sizeof(ColumnLinks));
+    new_matrix->column_links.max = matrix->column_links.num;
+#endif
+#else
+    int max_relocations = matrix->nodes.segments.num + matrix->headers.segments.num + 2;
+    Relocation *relocations = malloc(max_relocations * sizeof(Relocation));
+    int num_relocations = 0;
+    memset(&new_matrix->nodes, 0, sizeof(new_matrix->nodes));
+    memset(&new_matrix->headers, 0, sizeof(new_matrix->headers));
+    copy_segments((SegArray *) &new_matrix->nodes, (SegArray *) &matrix->nodes, sizeof(Node), relocations, &num_relocations);
+    copy_segments((SegArray *) &new_matrix->headers, (SegArray *) &matrix->headers, sizeof(Header), relocations, &num_relocations);
+    qsort(relocations, num_relocations, sizeof(Relocation), compare_relocations);
+
+    #define RELOCATE(ptr) (ptr = relocate(relocations, num_relocations, ptr))
+
+    /* Fix up node pointers, in both the plain nodes and the nodes embedded in headers. */
+    int i, j;
+    for (i = 0; i <= new_matrix->nodes.segments.num; i++) {
+        Node *nodes = (i < new_matrix->nodes.segments.num) ? new_matrix->nodes.segments.data[i] : new_matrix->nodes.current.data;
+        int num = (i < new_matrix->nodes.segments.num) ? new_matrix->nodes.current.max : new_matrix->nodes.current.num;
+        for (j = 0; j < num; j++) {
+            RELOCATE(nodes[j].up);
+            RELOCATE(nodes[j].down);
+            RELOCATE(nodes[j].left);
+            RELOCATE(nodes[j].right);
+            RELOCATE(nodes[j].column);
+        }
+    }
+    for (i = 0; i <= new_matrix->headers.segments.num; i++) {
+        Header *headers = (i < new_matrix->headers.segments.num) ? new_matrix->headers.segments.data[i] : new_matrix->headers.current.data;
+        int num = (i < new_matrix->headers.segments.num) ? new_matrix->headers.current.max : new_matrix->headers.current.num;
+        for (j = 0; j < num; j++) {
+            RELOCATE(headers[j].node.up);
+            RELOCATE(headers[j].node.down);
+            RELOCATE(headers[j].node.left);
+            RELOCATE(headers[j].node.right);
+            RELOCATE(headers[j].node.column);
+#if SIZE_BUCKETS
+            if (headers[j].bucket_prev)
+                RELOCATE(headers[j].bucket_prev);
+            if (headers[j].bucket_next)
+                RELOCATE(headers[j].bucket_next);
+#endif
+        }
+    }
+    RELOCATE(new_matrix->root);
+    RELOCATE(new_matrix->secondary_root);
+#endif
+
+#if SIZE_BUCKETS
+    new_matrix->buckets.data = malloc(matrix->buckets.max * sizeof(NodeId));
+    memcpy(new_matrix->buckets.data, matrix->buckets.data, matrix->buckets.num * sizeof(NodeId));
 #if INDEX_NODES
 #else
-    /* Fix up node pointers. */
-    int i;
-    for (i = 0; i < new_matrix->nodes.num; i++) {
-	Node *node = &new_matrix->nodes.data[i];
-	FIXUP(node->left, matrix->nodes.data, new_matrix->nodes.data);
-	FIXUP(node->right, matrix->nodes.data, new_matrix->nodes.data);
-	FIXUP(node->up, matrix->nodes.data, new_matrix->nodes.data);
-	FIXUP(node->down, matrix->nodes.data, new_matrix->nodes.data);
-	FIXUP(node->column, matrix->nodes.data, new_matrix->nodes.data);
+    for (i = 0; i < new_matrix->buckets.num; i++) {
+        if (new_matrix->buckets.data[i])
+            RELOCATE(new_matrix->buckets.data[i]);
     }
 #endif
-    
+#endif
+
+    /* The solution needs the same capacity, since the search writes into it without checking. */
+    new_matrix->solution.data = malloc(matrix->solution.max * sizeof(NodeId));
+    memcpy(new_matrix->solution.data, matrix->solution.data, matrix->solution.num * sizeof(NodeId));
+
+#if INDEX_NODES
+#else
+    for (i = 0; i < new_matrix->solution.num; i++) {
+        RELOCATE(new_matrix->solution.data[i]);
+    }
+    #undef RELOCATE
+    free(relocations);
+#endif
+
     return new_matrix;
+}
+
+
+#if !INDEX_NODES
+struct NodeMap {
+    Relocation *relocations;
+    int num_relocations;
+};
 #endif
+
+
+/**
+ * Make a map from the nodes of a clone to those of the matrix it was cloned from (which mustn't
+ * have had nodes added since), for passing on what was found in the clone.  Nodes have the same
+ * ids in both with INDEX_NODES, so the map is NULL, and map_nodes leaves them as they are.
+ */
+NodeMap *create_node_map(Matrix *clone, Matrix *original) {
+#if INDEX_NODES
     return NULL;
+#else
+    NodeMap *map = malloc(sizeof(NodeMap));
+    map->relocations = malloc((clone->nodes.segments.num + 1) * sizeof(Relocation));
+    map->num_relocations = 0;
+    size_t length = clone->nodes.current.max * sizeof(Node);
+    int i;
+    for (i = 0; i < clone->nodes.segments.num; i++)
+        add_relocation(map->relocations, &map->num_relocations, clone->nodes.segments.data[i], original->nodes.segments.data[i], length);
+    add_relocation(map->relocations, &map->num_relocations, clone->nodes.current.data, original->nodes.current.data, length);
+    qsort(map->relocations, map->num_relocations, sizeof(Relocation), compare_relocations);
+    return map;
+#endif
+}
+
+
+/* Replace each of a clone's nodes with the original's, in place. */
+void map_nodes(NodeMap *map, NodeId *ids, int num_ids) {
+#if !INDEX_NODES
+    int i;
+    for (i = 0; i < num_ids; i++)
+        ids[i] = relocate(map->relocations, map->num_relocations, ids[i]);
+#endif
+}
+
+
+void destroy_node_map(NodeMap *map) {
+#if !INDEX_NODES
+    free(map->relocations);
+    free(map);
+#endif
+}
+
+
+/* Print a column's name, or its index if it has none. */
+static void print_column_name(Matrix *matrix, NodeId column) {
+    if (HEADER(column).name)
+        printf("%s", HEADER(column).name);
+    else
+        printf("#%d", HEADER(column).index);
 }
 
 
 void print_matrix(Matrix *matrix) {
+    NodeId rings[2] = { ROOT, SECONDARY_ROOT };
+    int i;
     NodeId n;
     printf("ROOT");
     int col = 1;
-    foreachlink(ROOT, right, n) {
-        while (col++ < HEADER(n).index)
+    for (i = 0; i < 2; i++) {
+        foreachcolumn(rings[i], n) {
+            while (col++ < HEADER(n).index)
+                printf("\t");
             printf("\t");
-        printf("\t%s (%d)", HEADER(n).name, HEADER(n).size);
+            print_column_name(matrix, n);
+            printf(" (%d)", SIZE(n));
+        }
     }
     printf("\n");
 
-    foreachlink(ROOT, right, n) {
-        NodeId n2;
-        foreachlink(n, down, n2) {
-            NodeId p = NODE(n2).left;
-            if (HEADER(NODE(p).column).index < HEADER(n).index)
-                continue;
-            col = 1;
-            while (col++ < HEADER(n).index)
-                printf("\t");
-            printf("\t*");
-            NodeId n3;
-            foreachlink(n2, right, n3) {
-                while (col++ < HEADER(NODE(n3).column).index)
+    for (i = 0; i < 2; i++) {
+        foreachcolumn(rings[i], n) {
+            NodeId n2;
+            foreachlink(n, down, n2) {
+                NodeId p = LEFT(n2);
+                if (HEADER(NODE(p).column).index < HEADER(n).index)
+                    continue;
+                col = 1;
+                while (col++ < HEADER(n).index)
                     printf("\t");
                 printf("\t*");
+                NodeId n3;
+                foreachlink(n2, right, n3) {
+                    while (col++ < HEADER(NODE(n3).column).index)
+                        printf("\t");
+                    printf("\t*");
+                }
+                while (col++ < SIZE(ROOT))
+                    printf("\t");
+                printf("\n");
             }
-            while (col++ < HEADER(ROOT).size)
-                printf("\t");
-            printf("\n");
         }
     }
 }
 
 
 static NodeId choose_column(Matrix *matrix) {
+#if SIZE_BUCKETS
+    if (matrix->bucket_count == 0)
+        return 0;
+    while (!matrix->buckets.data[matrix->bucket_min])
+        matrix->bucket_min++;
+
+    /* Any column of the smallest size will do, so take the head of its bucket. */
+    NodeId best_column = matrix->buckets.data[matrix->bucket_min];
+#else
     int best_size = INT_MAX;
     NodeId best_column = 0;
     NodeId n;
-    foreachlink(ROOT, right, n) {
-        if (!HEADER(n).primary)
-            break;
-        if (HEADER(n).size < best_size) {
+    foreachcolumn(ROOT, n) {
+        if (SIZE(n) < best_size) {
             best_column = n;
-            best_size = HEADER(n).size;
+            best_size = SIZE(n);
         if (best_size <= 1)
             break;
         }
-        // if (HEADER(n).size < 1)
+        // if (SIZE(n) < 1)
         //     continue;
         // printf("select %s\n", HEADER(n).name);
         // return n;
     }
+#endif
 
     return best_column;
 }
 
 
-static void cover_column(Matrix *matrix, NodeId column) {
-    //printf("cover %s\n", HEADER(column).name);
-    remove_horizontally(matrix, column);
+/* Remove every other node in a row from its column, except in columns purified to its colour. */
+static inline void hide_row(Matrix *matrix, NodeId row) {
     NodeId n;
-    foreachlink(column, down, n) {
-        NodeId n2;
-        foreachlink(n, right, n2) {
-            //printf("Hiding value in column %s\n", n2->column->name);
-            remove_vertically(matrix, n2);
-            HEADER(NODE(n2).column).size--;
+    foreachlink(row, right, n) {
+        if (COLOR(n) >= 0) {
+            remove_vertically(matrix, n);
+            decrease_size(matrix, NODE(n).column);
         }
     }
-    //matrix->root.size--;
 }
 
 
-static void uncover_column(Matrix *matrix, NodeId column) {
-    //printf("uncover %s\n", HEADER(column).name);
-    restore_horizontally(matrix, column);
+static inline void unhide_row(Matrix *matrix, NodeId row) {
     NodeId n;
-    foreachlink(column, up, n) {
-        NodeId n2;
-        foreachlink(n, left, n2) {
-            HEADER(NODE(n2).column).size++;
-            restore_vertically(matrix, n2);
+    foreachlink(row, left, n) {
+        if (COLOR(n) >= 0) {
+            increase_size(matrix, NODE(n).column);
+            restore_vertically(matrix, n);
         }
     }
+}
+
+
+static void cover_column(Matrix *matrix, NodeId column) {
+    //printf("cover %s\n", HEADER(column).name);
+    remove_horizontally(matrix, column);
+#if SIZE_BUCKETS
+    if (HEADER(column).primary)
+        bucket_remove(matrix, column);
+#endif
+    NodeId n;
+    foreachlink(column, down, n) {
+        hide_row(matrix, n);
+    }
+    //matrix->root.size--;
+}
+
+
+static void uncover_column(Matrix *matrix, NodeId column) {
+    //printf("uncover %s\n", HEADER(column).name);
+    restore_horizontally(matrix, column);
+    NodeId n;
+    foreachlink(column, up, n) {
+        unhide_row(matrix, n);
+    }
+#if SIZE_BUCKETS
+    if (HEADER(column).primary)
+        bucket_insert(matrix, column);
+#endif
     //matrix->root.size++;
 }
 
 
+/**
+ * Commit a secondary column to the colour of node (as in Knuth's Algorithm C).  Rows of another
+ * colour are hidden, and the nodes of rows with the same colour are marked with -1 so that they
+ * are left in place when their rows are hidden later on.  The column stays where it is, and its
+ * header node remembers the colour.
+ */
+static void purify_column(Matrix *matrix, NodeId node) {
+    NodeId column = NODE(node).column;
+    int color = COLOR(node);
+    SET_COLOR(column, color);
+    NodeId n;
+    foreachlink(column, down, n) {
+        if (COLOR(n) == color)
+            SET_COLOR(n, -1);
+        else
+            hide_row(matrix, n);
+    }
+}
+
+
+static void unpurify_column(Matrix *matrix, NodeId node) {
+    NodeId column = NODE(node).column;
+    int color = COLOR(node);
+    NodeId n;
+    foreachlink(column, up, n) {
+        if (COLOR(n) < 0)
+            SET_COLOR(n, color);
+        else
+            unhide_row(matrix, n);
+    }
+    SET_COLOR(column, 0);
+}
+
+
+/* Take a node of a chosen row into the solution, covering or purifying its column. */
+static inline void commit_node(Matrix *matrix, NodeId node) {
+    int color = COLOR(node);
+    if (color == 0)
+        cover_column(matrix, NODE(node).column);
+    else if (color > 0)
+        purify_column(matrix, node);
+}
+
+
+static inline void uncommit_node(Matrix *matrix, NodeId node) {
+    int color = COLOR(node);
+    if (color == 0)
+        uncover_column(matrix, NODE(node).column);
+    else if (color > 0)
+        unpurify_column(matrix, node);
+}
+
+
+static void print_node(Matrix *matrix, NodeId node) {
+    print_column_name(matrix, NODE(node).column);
+    int color = COLOR(node);
+    if (color < 0)
+        color = COLOR(NODE(node).column);
+    if (color)
+        printf(":%d", color);
+}
+
+
 void print_row(Matrix *matrix, NodeId row) {
-    printf("%s", HEADER(NODE(row).column).name);
+    print_node(matrix, row);
     NodeId n;
     foreachlink(row, right, n) {
-        printf(", %s", HEADER(NODE(n).column).name);
+        printf(", ");
+        print_node(matrix, n);
     }
 }
 
@@ -327,11 +1105,8 @@ int search_matrix_internal(Matrix *matrix, int depth, int max_depth) {
     }	
     
     NodeId column = choose_column(matrix);
-    if (column == 0) {
-        int result = matrix->solution_callback(matrix, matrix->solution_baton);
-        matrix->num_solutions++;
-        return result;
-    }
+    if (column == 0)
+        return report_solution(matrix);
     //printf("Chose %s of size %d\n", column->name, column->size);
 
     cover_column(matrix, column);
@@ -348,13 +1123,13 @@ int search_matrix_internal(Matrix *matrix, int depth, int max_depth) {
 
         NodeId col;
         foreachlink(row, right, col) {
-            cover_column(matrix, NODE(col).column);
+            commit_node(matrix, col);
         }
 
         result = search_matrix_internal(matrix, depth + 1, max_depth);
 
         foreachlink(row, left, col) {
-            uncover_column(matrix, NODE(col).column);
+            uncommit_node(matrix, col);
         }
 
         if (result)
@@ -369,6 +1144,565 @@ int search_matrix_internal(Matrix *matrix, int depth, int max_depth) {
 }
 
 
+/**
+ * Count solutions below this point without maintaining the solution vector or calling any
+ * callbacks.  The number of primary columns still to be covered is passed down.  Near the bottom
+ * of the tree, when no row could cover more than that, a row covering all of the remaining ones
+ * is counted as a solution without covering and recursing for it; and when one primary column
+ * remains, every row in it is a solution so its size is counted directly.
+ */
+static long int count_solutions_internal(Matrix *matrix, int num_primary, int max_row_primary) {
+    matrix->search_calls++;
+
+    if (num_primary == 0)
+        return 1;
+
+    NodeId column = choose_column(matrix);
+    if (num_primary == 1)
+        return SIZE(column);
+
+    long int count = 0;
+    cover_column(matrix, column);
+
+    NodeId row;
+    foreachlink(column, down, row) {
+        NodeId col;
+        int row_primary = 1;
+        if (num_primary <= max_row_primary) {
+            foreachlink(row, right, col) {
+                row_primary += HEADER(NODE(col).column).primary;
+            }
+            if (row_primary == num_primary) {
+                count++;
+                continue;
+            }
+        }
+
+        row_primary = 1;
+        foreachlink(row, right, col) {
+            row_primary += HEADER(NODE(col).column).primary;
+            commit_node(matrix, col);
+        }
+
+        count += count_solutions_internal(matrix, num_primary - row_primary, max_row_primary);
+
+        foreachlink(row, left, col) {
+            uncommit_node(matrix, col);
+        }
+    }
+
+    uncover_column(matrix, column);
+
+    return count;
+}
+
+
+static long int count_solutions_from_here(Matrix *matrix) {
+    int num_primary = 0;
+    int max_row_primary = 0;
+    NodeId n;
+    foreachcolumn(ROOT, n) {
+        num_primary++;
+
+        NodeId row;
+        foreachlink(n, down, row) {
+            int row_primary = 1;
+            NodeId col;
+            foreachlink(row, right, col) {
+                row_primary += HEADER(NODE(col).column).primary;
+            }
+            if (row_primary > max_row_primary)
+                max_row_primary = row_primary;
+        }
+    }
+
+    return count_solutions_internal(matrix, num_primary, max_row_primary);
+}
+
+
+/*
+ * Choose the primary column with the fewest ways to continue: each row that leaves enough rows
+ * after it to reach the column's lower bound, plus not using the column any more if the lower
+ * bound has been reached.  For a column needed exactly once this is just its size.  Returns 0 if
+ * some column can no longer reach its lower bound.
+ */
+static NodeId choose_column_multiplicities(Matrix *matrix) {
+    int best_branches = INT_MAX;
+    NodeId best_column = 0;
+    NodeId n;
+    foreachcolumn(ROOT, n) {
+        int lower = HEADER(n).bound - HEADER(n).slack;
+        int branches = SIZE(n) + 1 - (lower > 0 ? lower : 0);
+        if (branches < best_branches) {
+            best_column = n;
+            best_branches = branches;
+            if (best_branches <= 1)
+                break;
+        }
+    }
+
+    return best_branches > 0 ? best_column : 0;
+}
+
+
+/* Choose a node's row as another use of its column. */
+static inline void commit_node_multiplicities(Matrix *matrix, NodeId node) {
+    NodeId column = NODE(node).column;
+    if (!HEADER(column).primary)
+        commit_node(matrix, node);
+    else if (--HEADER(column).bound == 0)
+        cover_column(matrix, column);
+}
+
+
+static inline void uncommit_node_multiplicities(Matrix *matrix, NodeId node) {
+    NodeId column = NODE(node).column;
+    if (!HEADER(column).primary)
+        uncommit_node(matrix, node);
+    else if (HEADER(column).bound++ == 0)
+        uncover_column(matrix, column);
+}
+
+
+/**
+ * Remove a row that has just been tried from its column, so that deeper levels only choose rows
+ * after it and each combination of rows is only found once.  Unless the column has been covered
+ * (which has hidden it already), the row is also hidden from its other columns.
+ */
+static void tweak_row(Matrix *matrix, NodeId column, NodeId row, int hide) {
+    if (hide)
+        hide_row(matrix, row);
+    NODE(column).down = NODE(row).down;
+    NODE(NODE(row).down).up = column;
+    if (hide)
+        decrease_size(matrix, column);
+    else
+        SIZE(column)--;
+}
+
+
+/*
+ * Put back every row tweaked from a column since first, which was at the top of it.  The rows
+ * still link down to each other, so they can be relinked and unhidden in the order they left.
+ */
+static void untweak_rows(Matrix *matrix, NodeId column, NodeId first, int hide) {
+    NodeId last = NODE(column).down;
+    NodeId prev = column;
+    NodeId row;
+    NODE(column).down = first;
+    for (row = first; row != last; row = NODE(row).down) {
+        NODE(row).up = prev;
+        if (hide) {
+            unhide_row(matrix, row);
+            increase_size(matrix, column);
+        } else {
+            SIZE(column)++;
+        }
+        prev = row;
+    }
+    NODE(last).up = prev;
+}
+
+
+static int search_rows_multiplicities(Matrix *matrix, NodeId row, int depth, int max_depth);
+
+
+/**
+ * Search a matrix where some columns can be covered more than once (Knuth's Algorithm M).  At each
+ * level one use of the chosen column is decided: either one of its rows, or that the column is
+ * finished with (when its lower bound has been reached).  Rows are tried in order and tweaked out
+ * of the column as they go, so deeper levels never pick a set of rows in another order.  A column
+ * is covered when its last use is taken.
+ */
+static int search_matrix_multiplicities(Matrix *matrix, int depth, int max_depth) {
+    matrix->search_calls++;
+
+    if (depth >= max_depth)
+        return matrix->depth_callback(matrix, matrix->depth_baton);
+
+    if (COLUMN_RIGHT(ROOT) == ROOT)
+        return report_solution(matrix);
+
+    NodeId column = choose_column_multiplicities(matrix);
+    if (column == 0)
+        return 0;
+
+    int result = 0;
+    int bound = --HEADER(column).bound;
+    int slack = HEADER(column).slack;
+    if (bound == 0)
+        cover_column(matrix, column);
+
+    NodeId row;
+    if (bound == 0 && slack == 0) {
+        /* The last use of a column with no slack, which is just like exact cover. */
+        foreachlink(column, down, row) {
+            result = search_rows_multiplicities(matrix, row, depth, max_depth);
+            if (result)
+                break;
+        }
+    } else {
+        NodeId first = NODE(column).down;
+        while (SIZE(column) > bound - slack) {
+            row = NODE(column).down;
+            if (row == column) {
+                /* Use the column no more. */
+                if (bound)
+                    remove_horizontally(matrix, column);
+                result = search_matrix_multiplicities(matrix, depth + 1, max_depth);
+                if (bound)
+                    restore_horizontally(matrix, column);
+                break;
+            }
+
+            tweak_row(matrix, column, row, bound != 0);
+            result = search_rows_multiplicities(matrix, row, depth, max_depth);
+            if (result)
+                break;
+        }
+        untweak_rows(matrix, column, first, bound != 0);
+    }
+
+    if (bound == 0)
+        uncover_column(matrix, column);
+    HEADER(column).bound++;
+
+    return result;
+}
+
+
+/* Try one row at the current level, with its column already dealt with. */
+static int search_rows_multiplicities(Matrix *matrix, NodeId row, int depth, int max_depth) {
+    matrix->solution.data[matrix->solution.num++] = row;
+
+    NodeId col;
+    foreachlink(row, right, col) {
+        commit_node_multiplicities(matrix, col);
+    }
+
+    int result = search_matrix_multiplicities(matrix, depth + 1, max_depth);
+
+    foreachlink(row, left, col) {
+        uncommit_node_multiplicities(matrix, col);
+    }
+
+    matrix->solution.num--;
+    return result;
+}
+
+
+static void init_cursor(SearchCursor *cursor, Matrix *matrix, int max_depth) {
+    cursor->matrix = matrix;
+    /* Every level covers at least one primary column, so this is as deep as we can go. */
+    cursor->frames = malloc((matrix->num_columns + 1) * sizeof(SearchFrame));
+    cursor->base = matrix->solution.num;
+    cursor->depth = 0;
+    cursor->max_depth = max_depth;
+    cursor->state = CURSOR_ENTER;
+    cursor->interrupt = NULL;
+    cursor->descend = 0;
+}
+
+
+/**
+ * Run the search without recursion, keeping the chosen column and current row of each level in
+ * the cursor's explicit stack of frames.  Visits the same tree in the same order as
+ * search_matrix_internal.  Returns when a solution is found (CURSOR_SOLUTION), the depth
+ * cutoff is reached (CURSOR_CUTOFF) or the search is interrupted (CURSOR_INTERRUPTED), leaving the
+ * cursor ready to carry on from that point, or when the search is exhausted (CURSOR_DONE).
+ */
+static CursorState advance_search(SearchCursor *cursor) {
+    Matrix *matrix = cursor->matrix;
+    SearchFrame *frames = cursor->frames;
+    int base = cursor->base;
+    int depth = cursor->depth;
+    NodeId column, row, col;
+
+    switch (cursor->state) {
+        case CURSOR_ENTER:
+        case CURSOR_INTERRUPTED: goto enter;
+        case CURSOR_DONE: return CURSOR_DONE;
+        case CURSOR_CUTOFF:
+            if (cursor->descend) {
+                cursor->descend = 0;
+                goto descend;
+            }
+            goto backtrack;
+        default: goto backtrack;
+    }
+
+enter:
+    if (cursor->interrupt && atomic_load_explicit(cursor->interrupt, memory_order_relaxed)) {
+        cursor->depth = depth;
+        return cursor->state = CURSOR_INTERRUPTED;
+    }
+
+    matrix->search_calls++;
+    matrix->solution.num = base + depth;
+
+    if (depth >= cursor->max_depth) {
+        cursor->depth = depth;
+        return cursor->state = CURSOR_CUTOFF;
+    }
+
+descend:
+    column = choose_column(matrix);
+    if (column == 0) {
+        cursor->depth = depth;
+        return cursor->state = CURSOR_SOLUTION;
+    }
+
+    cover_column(matrix, column);
+    frames[depth].column = column;
+    frames[depth].end = column;
+    frames[depth].index = 0;
+    row = NODE(column).down;
+
+try_row:
+    if (row == frames[depth].end) {
+        uncover_column(matrix, column);
+        goto backtrack;
+    }
+
+    frames[depth].row = row;
+    frames[depth].index++;
+    matrix->solution.data[base + depth] = row;
+    foreachlink(row, right, col) {
+        commit_node(matrix, col);
+    }
+    depth++;
+    goto enter;
+
+backtrack:
+    if (depth == 0) {
+        matrix->solution.num = base;
+        cursor->depth = 0;
+        return cursor->state = CURSOR_DONE;
+    }
+
+    depth--;
+    column = frames[depth].column;
+    row = frames[depth].row;
+    foreachlink(row, left, col) {
+        uncommit_node(matrix, col);
+    }
+
+    row = NODE(row).down;
+    goto try_row;
+}
+
+
+/**
+ * Abandon a search part way through, uncovering every level so the matrix is as it was before.
+ */
+static void unwind_search(SearchCursor *cursor) {
+    Matrix *matrix = cursor->matrix;
+    if (cursor->state == CURSOR_DONE)
+        return;
+
+    while (cursor->depth > 0) {
+        cursor->depth--;
+        SearchFrame *frame = &cursor->frames[cursor->depth];
+        NodeId col;
+        foreachlink(frame->row, left, col) {
+            uncommit_node(matrix, col);
+        }
+        uncover_column(matrix, frame->column);
+    }
+
+    matrix->solution.num = cursor->base;
+    cursor->state = CURSOR_DONE;
+}
+
+
+static int search_matrix_iterative(Matrix *matrix, int max_depth) {
+    SearchCursor cursor;
+    init_cursor(&cursor, matrix, max_depth);
+
+    int result = 0;
+    CursorState state;
+    while ((state = advance_search(&cursor)) != CURSOR_DONE) {
+        if (state == CURSOR_SOLUTION) {
+            result = report_solution(matrix);
+        } else {
+            result = matrix->depth_callback(matrix, matrix->depth_baton);
+        }
+
+        if (result) {
+            unwind_search(&cursor);
+            break;
+        }
+    }
+
+    free(cursor.frames);
+    return result;
+}
+
+
+static int ignore_solution(Matrix *matrix, void *baton) {
+    return 0;
+}
+
+
+/*
+ * Count the solutions without reporting them.  The counting engine can neither tell symmetric
+ * copies apart nor keep to column bounds, so with either of those the solutions are searched for
+ * with the recursive engine instead, passing them to no callback.
+ */
+long int count_solutions(Matrix *matrix) {
+    if (matrix->symmetry || matrix->multiplicities) {
+        Callback callback = matrix->solution_callback;
+        SearchEngine engine = matrix->engine;
+        matrix->solution_callback = ignore_solution;
+        matrix->engine = ENGINE_RECURSIVE;
+        search_matrix(matrix, 0);
+        matrix->solution_callback = callback;
+        matrix->engine = engine;
+        return matrix->num_solutions;
+    }
+
+    matrix->search_calls = 0;
+    matrix->num_solutions = count_solutions_from_here(matrix);
+    return matrix->num_solutions;
+}
+
+
+SearchCursor *search_begin(Matrix *matrix) {
+    if (matrix->multiplicities)
+        return NULL;
+
+    matrix->search_calls = 0;
+    matrix->num_solutions = 0;
+
+    EXTARRAY_ENSURE(matrix->solution, matrix->num_rows);
+
+    SearchCursor *cursor = malloc(sizeof(SearchCursor));
+    init_cursor(cursor, matrix, INT_MAX);
+    return cursor;
+}
+
+
+int search_next(SearchCursor *cursor) {
+    Matrix *matrix = cursor->matrix;
+    while (advance_search(cursor) == CURSOR_SOLUTION) {
+        if (matrix->symmetry && !canonical_solution(matrix))
+            continue;
+        matrix->num_solutions++;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+void search_end(SearchCursor *cursor) {
+    unwind_search(cursor);
+    free(cursor->frames);
+    free(cursor);
+}
+
+
+/* Carry on the search to the next solution, cutoff or interruption, or the end. */
+CursorState search_advance(SearchCursor *cursor) {
+    return advance_search(cursor);
+}
+
+
+/* After a cutoff, have the next search_advance search below it, as though it weren't there. */
+void search_descend(SearchCursor *cursor) {
+    if (cursor->state == CURSOR_CUTOFF)
+        cursor->descend = 1;
+}
+
+
+static int split_frames(Matrix *matrix, SearchFrame *frames, int num_frames, SearchStep *steps) {
+    int depth;
+    for (depth = 0; depth < num_frames; depth++) {
+        NodeId last = NODE(frames[depth].end).up;
+        if (last == frames[depth].row)
+            continue;
+
+        int i;
+        for (i = 0; i <= depth; i++) {
+            steps[i].column = HEADER(frames[i].column).index - 1;
+            steps[i].row = frames[i].index;
+        }
+        NodeId row;
+        for (row = frames[depth].row; row != last; row = NODE(row).down)
+            steps[depth].row++;
+
+        frames[depth].end = last;
+        return depth + 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Hand the shallowest row the cursor has yet to try over to another search, which will find the
+ * solutions below it instead: this search stops short of it.  As there are more rows under a
+ * column, it is the last of them.  The path to the row from the cursor's base is put in steps,
+ * which needs room for one more than the cursor's depth, and its length is returned; 0 means
+ * the cursor had no rows left to hand over.
+ */
+int split_search(SearchCursor *cursor, SearchStep *steps) {
+    return split_frames(cursor->matrix, cursor->frames, cursor->depth, steps);
+}
+
+
+/* Choose the rows along a path from split_search, in a matrix in the same state as the cursor's. */
+void choose_steps(Matrix *matrix, const SearchStep *steps, int num_steps) {
+    int i, j;
+    for (i = 0; i < num_steps; i++) {
+        NodeId row = NODE(matrix_column(matrix, steps[i].column)).down;
+        for (j = 1; j < steps[i].row; j++)
+            row = NODE(row).down;
+        choose_row(matrix, row);
+    }
+}
+
+
+/**
+ * Estimate the number of nodes in the search from the current state of the matrix, by Knuth's
+ * method: follow a random path down the tree, taking the number of rows at each level as the
+ * number of branches at every node on it, and average over num_probes paths.  The estimate is
+ * right on average, but can be far out for one probe.  If limit is positive, each probe stops
+ * once its estimate passes it, which bounds what a probe costs in a deep tree.  The random
+ * numbers come from seed, which must not be 0.  Column bounds aren't supported: with them, no
+ * probe is made and -1 is returned.
+ */
+double estimate_search(Matrix *matrix, int num_probes, double limit, unsigned int *seed) {
+    if (matrix->multiplicities)
+        return -1;
+
+    int mark = matrix_mark(matrix);
+    double total = 0;
+    int i;
+    for (i = 0; i < num_probes; i++) {
+        double level_nodes = 1;
+        double nodes = 1;
+        NodeId column;
+        while ((limit <= 0 || nodes <= limit) && (column = choose_column(matrix)) != 0 && SIZE(column) > 0) {
+            level_nodes *= SIZE(column);
+            nodes += level_nodes;
+
+            *seed ^= *seed << 13;
+            *seed ^= *seed >> 17;
+            *seed ^= *seed << 5;
+            int j = *seed % SIZE(column);
+            NodeId row = NODE(column).down;
+            while (j-- > 0)
+                row = NODE(row).down;
+            choose_row(matrix, row);
+        }
+        matrix_rollback(matrix, mark);
+        total += nodes;
+    }
+    return total / num_probes;
+}
+
+
 NodeId find_column(Matrix *matrix, char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -378,36 +1712,185 @@ NodeId find_column(Matrix *matrix, char *fmt, ...) {
 
     va_end(args);
 
-    NodeId n;
-    foreachlink(ROOT, right, n) {
-        if (strcmp(HEADER(n).name, buffer) == 0)
-            return n;
+    return lookup_column(matrix, buffer, column_name_hash(buffer));
+}
+
+
+/**
+ * Find a column by its name and the name's column_name_hash, which can be worked out in advance.
+ * Covered columns are found too.  Returns 0 if there is no such column.
+ */
+NodeId lookup_column(Matrix *matrix, const char *name, unsigned int hash) {
+    ColumnIndex *index = matrix->column_index;
+    if (!index)
+        return 0;
+
+    int mask = index->num_slots - 1;
+    int i;
+    for (i = hash & mask; index->slots[i].column != -1; i = (i + 1) & mask) {
+        if (index->slots[i].hash == hash && strcmp(index->slots[i].name, name) == 0)
+            return COLUMN_AT(index->slots[i].column);
     }
 
     return 0;
+}
+
 
+static inline unsigned int row_key_hash(int a, int b) {
+    return (unsigned int) a * 2654435761u ^ (unsigned int) b * 40503u;
 }
 
 
-NodeId find_row(Matrix *matrix, NodeId *columns, int num_columns) {
-    int num_found;
+static RowIndexSlot *row_index_slot(RowIndex *index, int a, int b) {
+    int mask = index->num_slots - 1;
+    int i;
+    for (i = row_key_hash(a, b) & mask; index->slots[i].first != -1; i = (i + 1) & mask) {
+        if (index->slots[i].a == a && index->slots[i].b == b)
+            break;
+    }
+    return &index->slots[i];
+}
+
+
+static void row_index_add(RowIndex *index, int a, int b, NodeId row, int insert) {
+    int e = index->num_entries++;
+    if (!insert)
+        return;
+
+    if (a < b) {
+        int t = a;
+        a = b;
+        b = t;
+    }
+    RowIndexSlot *slot = row_index_slot(index, a, b);
+    index->entries[e].row = row;
+    index->entries[e].next = -1;
+    if (slot->first == -1) {
+        slot->a = a;
+        slot->b = b;
+        slot->first = e;
+    } else {
+        index->entries[slot->last].next = e;
+    }
+    slot->last = e;
+}
+
+
+/*
+ * Add the entries for a row, when given its first node (by id); other nodes, and the header and
+ * spacer nodes, are skipped.  Without insert, the entries are only counted.
+ */
+static void row_index_add_row(Matrix *matrix, RowIndex *index, NodeId row, int insert) {
+    if (NODE(row).column == row || NODE(row).column == ROOT)
+        return;
 
     NodeId n;
-    foreachlink(columns[0], down, n) {
-        num_found = 1;
+    foreachlink(row, right, n) {
+        if ((uintptr_t) n < (uintptr_t) row)
+            return;
+    }
 
+    n = row;
+    do {
+        int a = HEADER(NODE(n).column).index;
+        row_index_add(index, a, 0, row, insert);
         NodeId n2;
-        foreachlink(n, right, n2) {
-            int j;
-            for (j = 1; j < num_columns; j++) {
-                if (columns[j] == NODE(n2).column) {
-                    num_found++;
-                }
+        for (n2 = RIGHT(n); n2 != row; n2 = RIGHT(n2))
+            row_index_add(index, a, HEADER(NODE(n2).column).index, row, insert);
+        n = RIGHT(n);
+    } while (n != row);
+}
+
+
+/*
+ * Visit every row in the node arrays, rather than in the columns, so that rows which have been
+ * hidden are indexed too.
+ */
+static void row_index_add_rows(Matrix *matrix, RowIndex *index, int insert) {
+    index->num_entries = 0;
+#if INDEX_NODES
+    NodeId n;
+    for (n = 0; n < matrix->nodes.num; n++)
+        row_index_add_row(matrix, index, n, insert);
+#else
+    int i, j;
+    for (i = 0; i <= matrix->nodes.segments.num; i++) {
+        Node *nodes = (i < matrix->nodes.segments.num) ? matrix->nodes.segments.data[i] : matrix->nodes.current.data;
+        int num = (i < matrix->nodes.segments.num) ? matrix->nodes.current.max : matrix->nodes.current.num;
+        for (j = 0; j < num; j++)
+            row_index_add_row(matrix, index, &nodes[j], insert);
+    }
+#endif
+}
+
+
+static void destroy_row_index(RowIndex *index) {
+    free(index->slots);
+    free(index->entries);
+    free(index);
+}
+
+
+static RowIndex *build_row_index(Matrix *matrix) {
+    RowIndex *index = malloc(sizeof(RowIndex));
+    index->num_nodes = matrix->num_nodes;
+    row_index_add_rows(matrix, index, 0);
+
+    index->num_slots = 64;
+    while (index->num_slots < 2 * index->num_entries)
+        index->num_slots *= 2;
+    index->slots = malloc(sizeof(RowIndexSlot) * index->num_slots);
+    int i;
+    for (i = 0; i < index->num_slots; i++)
+        index->slots[i].first = -1;
+    index->entries = malloc(sizeof(RowIndexEntry) * (index->num_entries + 1));
+
+    row_index_add_rows(matrix, index, 1);
+    return index;
+}
+
+
+/**
+ * Find the first row with all of the given columns, returning its node in the first of them (or 0
+ * if there is none).  Rows are looked up by their first two columns in an index, which is built
+ * on the first call and again whenever nodes have been added since.  Rows hidden by chosen rows
+ * are found too, so it is up to the caller whether such a row can be chosen.
+ */
+NodeId find_row(Matrix *matrix, NodeId *columns, int num_columns) {
+    if (num_columns <= 0)
+        return 0;
+
+    if (matrix->row_index && matrix->row_index->num_nodes != matrix->num_nodes) {
+        destroy_row_index(matrix->row_index);
+        matrix->row_index = NULL;
+    }
+    if (!matrix->row_index)
+        matrix->row_index = build_row_index(matrix);
+    RowIndex *index = matrix->row_index;
+
+    int a = HEADER(columns[0]).index;
+    int b = (num_columns > 1) ? HEADER(columns[1]).index : 0;
+    RowIndexSlot *slot = (a < b) ? row_index_slot(index, b, a) : row_index_slot(index, a, b);
+
+    int e;
+    for (e = slot->first; e != -1; e = index->entries[e].next) {
+        NodeId row = index->entries[e].row;
+        NodeId found = 0;
+        int j;
+        for (j = 0; j < num_columns; j++) {
+            NodeId n = row;
+            while (NODE(n).column != columns[j]) {
+                n = RIGHT(n);
+                if (n == row)
+                    break;
             }
+            if (NODE(n).column != columns[j])
+                break;
+            if (j == 0)
+                found = n;
         }
-
-        if (num_found >= num_columns)
-            return n;
+        if (j == num_columns)
+            return found;
     }
 
     return 0;
@@ -418,14 +1901,241 @@ void choose_row(Matrix *matrix, NodeId row) {
     NodeId *solution_spot = EXTARRAY_ALLOC(matrix->solution);
     *solution_spot = row;
 
-    cover_column(matrix, NODE(row).column);
     NodeId col;
-    foreachlink(row, right, col) {
-        cover_column(matrix, NODE(col).column);
+    if (matrix->multiplicities) {
+        /* The row's columns may stay uncovered, so take the row itself out of them first. */
+        remove_vertically(matrix, row);
+        decrease_size(matrix, NODE(row).column);
+        hide_row(matrix, row);
+        commit_node_multiplicities(matrix, row);
+        foreachlink(row, right, col) {
+            commit_node_multiplicities(matrix, col);
+        }
+    } else {
+        cover_column(matrix, NODE(row).column);
+        foreachlink(row, right, col) {
+            commit_node(matrix, col);
+        }
     }
-    printf("Chose row: ");
-    print_row(matrix, row);
-    printf("\n");
+}
+
+
+/**
+ * Undo the last choose_row, returning its row (or 0 if no rows are chosen).  The chosen rows are
+ * the start of the solution vector, so they are unchosen in the reverse order.
+ */
+NodeId unchoose_row(Matrix *matrix) {
+    if (matrix->solution.num == 0)
+        return 0;
+    NodeId row = matrix->solution.data[--matrix->solution.num];
+
+    NodeId col;
+    if (matrix->multiplicities) {
+        foreachlink(row, left, col) {
+            uncommit_node_multiplicities(matrix, col);
+        }
+        uncommit_node_multiplicities(matrix, row);
+        unhide_row(matrix, row);
+        increase_size(matrix, NODE(row).column);
+        restore_vertically(matrix, row);
+    } else {
+        foreachlink(row, left, col) {
+            uncommit_node(matrix, col);
+        }
+        uncover_column(matrix, NODE(row).column);
+    }
+    return row;
+}
+
+
+/* The number of rows chosen so far, to roll back to later. */
+int matrix_mark(Matrix *matrix) {
+    return matrix->solution.num;
+}
+
+
+/**
+ * Unchoose every row chosen since the mark, leaving the matrix as it was then.  This only undoes
+ * the covering done by those rows, so a matrix can be reused for many sets of chosen rows.
+ */
+void matrix_rollback(Matrix *matrix, int mark) {
+    while (matrix->solution.num > mark)
+        unchoose_row(matrix);
+}
+
+
+/**
+ * Take a row out of every column it is in, so no search can choose it, until it is put back with
+ * restore_row.  Rows must be restored in the reverse order.
+ */
+void remove_row(Matrix *matrix, NodeId row) {
+    remove_vertically(matrix, row);
+    decrease_size(matrix, NODE(row).column);
+    hide_row(matrix, row);
+}
+
+
+void restore_row(Matrix *matrix, NodeId row) {
+    unhide_row(matrix, row);
+    increase_size(matrix, NODE(row).column);
+    restore_vertically(matrix, row);
+}
+
+
+#if INDEX_NODES
+/**
+ * Number every node by its row, with rows numbered from 0 in the order they were created (the
+ * order of their first nodes), as they are in solution streams and symmetries.  Headers and
+ * spacers are numbered -1.
+ */
+int *matrix_row_numbers(Matrix *matrix) {
+    int *row_numbers = malloc(sizeof(int) * matrix->nodes.num);
+    NodeId n;
+    for (n = 0; n < matrix->nodes.num; n++)
+        row_numbers[n] = -1;
+
+    int row = 0;
+    for (n = matrix->headers.num; n < matrix->nodes.num; n++) {
+        if (row_numbers[n] != -1 || NODE(n).column == ROOT)
+            continue;
+        row_numbers[n] = row;
+        NodeId x;
+        foreachlink(n, right, x) {
+            row_numbers[x] = row;
+        }
+        row++;
+    }
+
+    return row_numbers;
+}
+
+
+/**
+ * Renumber the nodes so that each row's nodes follow one another from left to right, and the rows
+ * of each column come one after another, top to bottom.  A row can only be kept with the others
+ * of one of its columns, and the one chosen is its primary column with the fewest rows, which is
+ * the one the search most likely covers it from.  Headers keep their ids.
+ *
+ * Rows are kept whole because covering a column walks along each of its rows; numbering the
+ * nodes purely column by column makes that walk jump around instead, which was several times
+ * slower on long rows.
+ *
+ * Every link, the solution and the symmetry are updated, and the row index is dropped.  Returns
+ * a table of the new id of each old one (which the caller frees), for ids held elsewhere.  Rows
+ * are then numbered (by matrix_row_numbers) in a different order.  Returns NULL with
+ * COMPACT_NODES, whose spacers would have to be rebuilt.
+ */
+NodeId *renumber_nodes(Matrix *matrix) {
+#if COMPACT_NODES
+    return NULL;
+#else
+    NodeId num_nodes = matrix->nodes.num;
+    NodeId num_headers = matrix->headers.num;
+    int *row_numbers = matrix_row_numbers(matrix);
+    NodeId *row_starts = malloc(sizeof(NodeId) * (num_nodes - num_headers + 1));
+    NodeId *row_columns = malloc(sizeof(NodeId) * (num_nodes - num_headers + 1));
+    int num_rows = 0;
+    NodeId n, x;
+
+    /* Rows are numbered in the order of their first nodes. */
+    for (n = num_headers; n < num_nodes; n++) {
+        if (row_numbers[n] < num_rows)
+            continue;
+        NodeId column = 0;
+        x = n;
+        do {
+            NodeId c = NODE(x).column;
+            if (HEADER(c).primary && (!column || SIZE(c) < SIZE(column)))
+                column = c;
+            x = RIGHT(x);
+        } while (x != n);
+        row_starts[num_rows] = n;
+        row_columns[num_rows] = column ? column : NODE(n).column;
+        num_rows++;
+    }
+    free(row_numbers);
+
+    /* Each column's share of the ids is the total length of the rows kept with it. */
+    NodeId *next = calloc(num_headers, sizeof(NodeId));
+    int i;
+    for (i = 0; i < num_rows; i++) {
+        x = row_starts[i];
+        do {
+            next[row_columns[i]]++;
+            x = RIGHT(x);
+        } while (x != row_starts[i]);
+    }
+    NodeId start = num_headers;
+    for (n = 0; n < num_headers; n++) {
+        NodeId count = next[n];
+        next[n] = start;
+        start += count;
+    }
+
+    NodeId *remap = malloc(sizeof(NodeId) * num_nodes);
+    for (n = 0; n < num_headers; n++)
+        remap[n] = n;
+    for (i = 0; i < num_rows; i++) {
+        x = row_starts[i];
+        do {
+            remap[x] = next[row_columns[i]]++;
+            x = RIGHT(x);
+        } while (x != row_starts[i]);
+    }
+    free(next);
+    free(row_starts);
+    free(row_columns);
+
+    Node *nodes = malloc(sizeof(Node) * num_nodes);
+    for (n = 0; n < num_nodes; n++) {
+        Node *node = &nodes[remap[n]];
+        *node = NODE(n);
+        node->up = remap[node->up];
+        node->down = remap[node->down];
+        node->left = remap[node->left];
+        node->right = remap[node->right];
+    }
+    /* Copied back rather than swapped, since the array may be mapped from a file. */
+    memcpy(matrix->nodes.data, nodes, sizeof(Node) * num_nodes);
+    free(nodes);
+
+    if (matrix->colors.data) {
+        int *colors = malloc(sizeof(int) * num_nodes);
+        for (n = 0; n < num_nodes; n++)
+            colors[remap[n]] = matrix->colors.data[n];
+        memcpy(matrix->colors.data, colors, sizeof(int) * num_nodes);
+        free(colors);
+    }
+
+    for (i = 0; i < matrix->solution.num; i++)
+        matrix->solution.data[i] = remap[matrix->solution.data[i]];
+
+    if (matrix->row_index) {
+        destroy_row_index(matrix->row_index);
+        matrix->row_index = NULL;
+    }
+
+    if (matrix->symmetry)
+        renumber_symmetry(matrix->symmetry, remap, num_nodes);
+
+    return remap;
+#endif
+}
+#endif
+
+
+/**
+ * Pass the solution in matrix->solution to the solution callback and count it, unless it is a
+ * symmetric copy of another solution (see break_symmetry).  Every engine reports solutions
+ * through this.
+ */
+int report_solution(Matrix *matrix) {
+    if (matrix->symmetry && !canonical_solution(matrix))
+        return 0;
+
+    int result = matrix->solution_callback(matrix, matrix->solution_baton);
+    matrix->num_solutions++;
+    return result;
 }
 
 
@@ -438,7 +2148,55 @@ int search_matrix(Matrix *matrix, int max_depth) {
     if (max_depth <= 0)
 	    max_depth = INT_MAX;
 
-    int result = search_matrix_internal(matrix, 0, max_depth);
+    int result;
+    if (matrix->multiplicities)
+        return search_matrix_multiplicities(matrix, 0, max_depth);
+
+    switch (matrix->engine) {
+        case ENGINE_ITERATIVE:
+            result = search_matrix_iterative(matrix, max_depth);
+            break;
+        case ENGINE_COUNT:
+            /* With a depth cutoff, the top of the tree is searched normally and only the
+               subsearches are counted.  Symmetric solutions can only be told apart by searching. */
+            if (max_depth == INT_MAX && !matrix->symmetry) {
+                matrix->num_solutions = count_solutions_from_here(matrix);
+                result = 0;
+            } else {
+                result = search_matrix_internal(matrix, 0, max_depth);
+            }
+            break;
+        case ENGINE_CELLS:
+            /* Likewise the sparse sets are only compiled for the subsearches. */
+            if (max_depth == INT_MAX) {
+                CellsMatrix *cells = compile_cells(matrix);
+                result = search_cells(cells);
+                destroy_cells(cells);
+            } else {
+                result = search_matrix_internal(matrix, 0, max_depth);
+            }
+            break;
+        case ENGINE_AUTO:
+        case ENGINE_BITS: {
+            BitsMatrix *bits = NULL;
+            if (max_depth == INT_MAX)
+                bits = compile_bits(matrix);
+            if (bits && matrix->engine == ENGINE_AUTO && !prefer_bits(bits)) {
+                destroy_bits(bits);
+                bits = NULL;
+            }
+            if (bits) {
+                result = search_bits(bits);
+                destroy_bits(bits);
+            } else {
+                result = search_matrix_internal(matrix, 0, max_depth);
+            }
+            break;
+        }
+        default:
+            result = search_matrix_internal(matrix, 0, max_depth);
+            break;
+    }
 
     return result;
 }
@@ -0,0 +1,401 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dancing_cells.h"
+
+
+/**
+ * Build the sparse sets from the columns and rows still linked into the matrix, so a matrix can be
+ * compiled part way through a search.  Primary items come first, in the order of the ROOT ring.
+ * Each row is emitted once, when it is reached from the first of its primary items; rows with
+ * none can never be chosen, and a purified column can still hold rows hidden from the others.
+ */
+CellsMatrix *compile_cells(Matrix *matrix) {
+    CellsMatrix *cells = malloc(sizeof(CellsMatrix));
+    cells->matrix = matrix;
+
+    int *item_of = malloc(sizeof(int) * (matrix->num_columns + 2));
+    NodeId *columns = malloc(sizeof(NodeId) * (matrix->num_columns + 1));
+
+    int num_items = 0;
+    int num_cells = 0;
+    NodeId c;
+    foreachcolumn(ROOT, c) {
+        item_of[HEADER(c).index] = num_items;
+        columns[num_items++] = c;
+        num_cells += SIZE(c);
+    }
+    cells->num_primary = num_items;
+    foreachcolumn(SECONDARY_ROOT, c) {
+        item_of[HEADER(c).index] = num_items;
+        columns[num_items++] = c;
+        num_cells += SIZE(c);
+    }
+
+    cells->num_items = num_items;
+    cells->num_active = cells->num_primary;
+    cells->item = malloc(sizeof(int) * cells->num_primary);
+    cells->item_pos = malloc(sizeof(int) * cells->num_primary);
+    cells->set_start = malloc(sizeof(int) * num_items);
+    cells->size = malloc(sizeof(int) * num_items);
+
+    cells->num_cells = num_cells;
+    cells->set = malloc(sizeof(int) * num_cells);
+    cells->cell_item = malloc(sizeof(int) * num_cells);
+    cells->cell_pos = malloc(sizeof(int) * num_cells);
+    cells->cell_option = malloc(sizeof(int) * num_cells);
+    cells->cell_color = malloc(sizeof(int) * num_cells);
+    cells->cell_node = malloc(sizeof(NodeId) * num_cells);
+    cells->option_start = malloc(sizeof(int) * (num_cells + 1));
+#if INDEX_NODES
+    cells->node_cell = malloc(sizeof(int) * matrix->nodes.num);
+    memset(cells->node_cell, -1, sizeof(int) * matrix->nodes.num);
+#else
+    cells->node_cell = NULL;
+#endif
+    cells->num_chosen = 0;
+    cells->chosen = malloc(sizeof(int) * (cells->num_primary + 1));
+
+    int i;
+    int start = 0;
+    for (i = 0; i < num_items; i++) {
+        if (i < cells->num_primary) {
+            cells->item[i] = i;
+            cells->item_pos[i] = i;
+        }
+        cells->set_start[i] = start;
+        cells->size[i] = 0;
+        start += SIZE(columns[i]);
+    }
+
+    int num_options = 0;
+    int cell = 0;
+    cells->has_colors = 0;
+    for (i = 0; i < cells->num_primary; i++) {
+        NodeId row;
+        foreachlink(columns[i], down, row) {
+            NodeId n;
+            int first = 1;
+            foreachlink(row, right, n) {
+                if (item_of[HEADER(NODE(n).column).index] < i) {
+                    first = 0;
+                    break;
+                }
+            }
+            if (!first)
+                continue;
+
+            cells->option_start[num_options] = cell;
+            n = row;
+            do {
+                int j = item_of[HEADER(NODE(n).column).index];
+                int pos = cells->set_start[j] + cells->size[j]++;
+                cells->set[pos] = cell;
+                cells->cell_pos[cell] = pos;
+                cells->cell_item[cell] = j;
+                cells->cell_option[cell] = num_options;
+                cells->cell_color[cell] = COLOR(n);
+                if (cells->cell_color[cell])
+                    cells->has_colors = 1;
+                cells->cell_node[cell] = n;
+#if INDEX_NODES
+                cells->node_cell[n] = cell;
+#endif
+                cell++;
+                n = RIGHT(n);
+            } while (n != row);
+            num_options++;
+        }
+    }
+    cells->option_start[num_options] = cell;
+    cells->num_options = num_options;
+    cells->num_cells = cell;
+
+    free(item_of);
+    free(columns);
+
+    return cells;
+}
+
+
+void destroy_cells(CellsMatrix *cells) {
+    free(cells->item);
+    free(cells->item_pos);
+    free(cells->set_start);
+    free(cells->size);
+    free(cells->set);
+    free(cells->cell_item);
+    free(cells->cell_pos);
+    free(cells->cell_option);
+    free(cells->cell_color);
+    free(cells->cell_node);
+    free(cells->option_start);
+    free(cells->node_cell);
+    free(cells->chosen);
+    free(cells);
+}
+
+
+/* Swap the other cells of an option out of the active prefixes of their items. */
+static inline void hide_option(CellsMatrix *cells, int x) {
+    int *set = cells->set;
+    int *size = cells->size;
+    int *set_start = cells->set_start;
+    int *cell_pos = cells->cell_pos;
+    int *cell_item = cells->cell_item;
+    int *cell_color = cells->cell_color;
+    int has_colors = cells->has_colors;
+    int o = cells->cell_option[x];
+    int option_end = cells->option_start[o + 1];
+    int y;
+    for (y = cells->option_start[o]; y < option_end; y++) {
+        if (y == x || (has_colors && cell_color[y] < 0))
+            continue;
+        int j = cell_item[y];
+        int last = set_start[j] + --size[j];
+        int p = cell_pos[y];
+        int z = set[last];
+        set[last] = y;
+        set[p] = z;
+        cell_pos[y] = last;
+        cell_pos[z] = p;
+    }
+}
+
+
+/* Undo hide_option, which only needs the prefixes grown back in the reverse order. */
+static inline void unhide_option(CellsMatrix *cells, int x) {
+    int *size = cells->size;
+    int *cell_item = cells->cell_item;
+    int *cell_color = cells->cell_color;
+    int has_colors = cells->has_colors;
+    int o = cells->cell_option[x];
+    int option_begin = cells->option_start[o];
+    int y;
+    for (y = cells->option_start[o + 1] - 1; y >= option_begin; y--) {
+        if (y != x && !(has_colors && cell_color[y] < 0))
+            size[cell_item[y]]++;
+    }
+}
+
+
+/*
+ * Hide each of an item's options.  The options still in the item's own set are exactly those not
+ * yet hidden, and the set is left alone until the item is uncovered.
+ */
+static void cover_item(CellsMatrix *cells, int item) {
+    int start = cells->set_start[item];
+    int end = start + cells->size[item];
+    int k;
+    for (k = start; k < end; k++)
+        hide_option(cells, cells->set[k]);
+
+    if (item < cells->num_primary) {
+        int p = cells->item_pos[item];
+        int last = --cells->num_active;
+        int other = cells->item[last];
+        cells->item[last] = item;
+        cells->item[p] = other;
+        cells->item_pos[item] = last;
+        cells->item_pos[other] = p;
+    }
+}
+
+
+static void uncover_item(CellsMatrix *cells, int item) {
+    if (item < cells->num_primary)
+        cells->num_active++;
+
+    int start = cells->set_start[item];
+    int k;
+    for (k = start + cells->size[item] - 1; k >= start; k--)
+        unhide_option(cells, cells->set[k]);
+}
+
+
+/* Hide the options of a secondary item with another colour than cell x, and mark the rest. */
+static void purify_item(CellsMatrix *cells, int x) {
+    int item = cells->cell_item[x];
+    int color = cells->cell_color[x];
+    int start = cells->set_start[item];
+    int end = start + cells->size[item];
+    int k;
+    for (k = start; k < end; k++) {
+        int y = cells->set[k];
+        if (cells->cell_color[y] == color)
+            cells->cell_color[y] = -1;
+        else
+            hide_option(cells, y);
+    }
+}
+
+
+static void unpurify_item(CellsMatrix *cells, int x) {
+    int item = cells->cell_item[x];
+    int color = cells->cell_color[x];
+    int start = cells->set_start[item];
+    int k;
+    for (k = start + cells->size[item] - 1; k >= start; k--) {
+        int y = cells->set[k];
+        if (cells->cell_color[y] < 0)
+            cells->cell_color[y] = color;
+        else
+            unhide_option(cells, y);
+    }
+}
+
+
+static inline void commit_cell(CellsMatrix *cells, int x) {
+    if (cells->cell_color[x] == 0)
+        cover_item(cells, cells->cell_item[x]);
+    else if (cells->cell_color[x] > 0)
+        purify_item(cells, x);
+}
+
+
+static inline void uncommit_cell(CellsMatrix *cells, int x) {
+    if (cells->cell_color[x] == 0)
+        uncover_item(cells, cells->cell_item[x]);
+    else if (cells->cell_color[x] > 0)
+        unpurify_item(cells, x);
+}
+
+
+/* Choose the first active item of least size, stopping at one of size 1 as choose_column does. */
+static int choose_item(CellsMatrix *cells) {
+    int *item = cells->item;
+    int *size = cells->size;
+    int best = -1;
+    int best_size = 0;
+    int i;
+    for (i = 0; i < cells->num_active; i++) {
+        int s = size[item[i]];
+        if (best == -1 || s < best_size) {
+            best = item[i];
+            best_size = s;
+            if (best_size <= 1)
+                break;
+        }
+    }
+    return best;
+}
+
+
+static int search_cells_internal(CellsMatrix *cells) {
+    Matrix *matrix = cells->matrix;
+    int result = 0;
+
+    matrix->search_calls++;
+
+    int item = choose_item(cells);
+    if (item == -1) {
+        return report_solution(matrix);
+    }
+    if (cells->size[item] == 0)
+        return 0;
+
+    cover_item(cells, item);
+
+    NodeId *solution_spot = &matrix->solution.data[matrix->solution.num];
+    matrix->solution.num++;
+
+    /* The item's own set is left alone while it is covered. */
+    int start = cells->set_start[item];
+    int end = start + cells->size[item];
+    int k;
+    for (k = start; k < end; k++) {
+        int x = cells->set[k];
+        int o = cells->cell_option[x];
+        *solution_spot = cells->cell_node[x];
+
+        int option_begin = cells->option_start[o];
+        int option_end = cells->option_start[o + 1];
+        int y;
+        for (y = option_begin; y < option_end; y++) {
+            if (y != x)
+                commit_cell(cells, y);
+        }
+
+        result = search_cells_internal(cells);
+
+        for (y = option_end - 1; y >= option_begin; y--) {
+            if (y != x)
+                uncommit_cell(cells, y);
+        }
+
+        if (result)
+            break;
+    }
+
+    matrix->solution.num--;
+
+    uncover_item(cells, item);
+
+    return result;
+}
+
+
+int search_cells(CellsMatrix *cells) {
+    return search_cells_internal(cells);
+}
+
+
+/**
+ * Take a row (given by any of its nodes in the original matrix) as part of the solution before the
+ * search starts, as choose_row does for the linked matrix.  This is undone by reset_cells, so one
+ * compiled matrix can be reused for many branches of a search.  Returns 0 if the row is no longer
+ * available.
+ */
+int choose_cells_row(CellsMatrix *cells, NodeId row) {
+#if INDEX_NODES
+    int x = cells->node_cell[row];
+    if (x < 0)
+        return 0;
+
+    /* Every cell of an available option is still in its item's set, and its items uncovered. */
+    int o = cells->cell_option[x];
+    int option_begin = cells->option_start[o];
+    int option_end = cells->option_start[o + 1];
+    int y;
+    for (y = option_begin; y < option_end; y++) {
+        int j = cells->cell_item[y];
+        if (cells->cell_pos[y] >= cells->set_start[j] + cells->size[j])
+            return 0;
+        if (j < cells->num_primary && cells->item_pos[j] >= cells->num_active)
+            return 0;
+    }
+
+    commit_cell(cells, x);
+    for (y = option_begin; y < option_end; y++) {
+        if (y != x)
+            commit_cell(cells, y);
+    }
+    cells->chosen[cells->num_chosen++] = x;
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+
+/* Put back the last option taken with choose_cells_row. */
+void unchoose_cells_row(CellsMatrix *cells) {
+    if (cells->num_chosen == 0)
+        return;
+
+    int x = cells->chosen[--cells->num_chosen];
+    int o = cells->cell_option[x];
+    int y;
+    for (y = cells->option_start[o + 1] - 1; y >= cells->option_start[o]; y--) {
+        if (y != x)
+            uncommit_cell(cells, y);
+    }
+    uncommit_cell(cells, x);
+}
+
+
+/* Put back every option taken with choose_cells_row, in the reverse order. */
+void reset_cells(CellsMatrix *cells) {
+    while (cells->num_chosen > 0)
+        unchoose_cells_row(cells);
+}
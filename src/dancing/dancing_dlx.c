@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dancing_dlx.h"
+
+
+/* Longest item name that create_column will take. */
+#define MAX_NAME_LENGTH 2000
+
+/* The file is read in blocks of this size, or larger if a line doesn't fit. */
+#define BLOCK_SIZE (1 << 20)
+
+/*
+ * Options are read in batches, with the index slot for each item name prefetched as it's read,
+ * and then the names themselves, so the lookups for a batch overlap instead of each waiting in
+ * turn on its cache misses.
+ */
+#define BATCH_OPTIONS 256
+
+#if defined(__GNUC__)
+    #define prefetch(address) __builtin_prefetch(address)
+#else
+    #define prefetch(address)
+#endif
+
+typedef struct ColorSlot {
+    unsigned int hash;
+    int color;               /* 0 if the slot is empty. */
+} ColorSlot;
+
+/*
+ * An item in a buffered option, with its name (and colour name, or NULL) in the block being read,
+ * and then its column and colour once they have been looked up.
+ */
+typedef struct DlxToken {
+    char *name;
+    char *color_name;
+    unsigned int hash;
+    NodeId column;
+    int color;
+} DlxToken;
+
+typedef struct DlxOption {
+    int first_token;
+    int line_number;
+} DlxOption;
+
+typedef struct DlxReader {
+    Matrix *matrix;
+    int have_items;
+    EXTARRAY(DlxToken) tokens;
+    EXTARRAY(DlxOption) options;
+    DlxColors *colors;
+    int num_color_slots;
+    ColorSlot *color_slots;
+    int *stamps;             /* The last option each column was seen in, by column index. */
+    int num_options;
+    int line_number;
+} DlxReader;
+
+
+static void parse_error(DlxReader *reader, char *message, char *name) {
+    fprintf(stderr, "Line %d: ", reader->line_number);
+    fprintf(stderr, message, name);
+    fprintf(stderr, "\n");
+}
+
+
+/* Split off the next whitespace-separated token in the line, or return NULL at the end. */
+static char *next_token(char **line) {
+    char *p = *line;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    if (!*p)
+        return NULL;
+
+    char *token = p;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+        p++;
+    if (*p)
+        *p++ = 0;
+    *line = p;
+    return token;
+}
+
+
+static void insert_color(DlxReader *reader, unsigned int hash, int color) {
+    int mask = reader->num_color_slots - 1;
+    int i;
+    for (i = hash & mask; reader->color_slots[i].color; i = (i + 1) & mask)
+        ;
+    reader->color_slots[i].hash = hash;
+    reader->color_slots[i].color = color;
+}
+
+
+/* Number a colour by its name, from 1, adding it if it's new. */
+static int find_color(DlxReader *reader, char *name) {
+    unsigned int hash = column_name_hash(name);
+    DlxColors *colors = reader->colors;
+
+    int mask = reader->num_color_slots - 1;
+    int i;
+    for (i = hash & mask; reader->color_slots[i].color; i = (i + 1) & mask) {
+        ColorSlot *slot = &reader->color_slots[i];
+        if (slot->hash == hash && strcmp(colors->names[slot->color - 1], name) == 0)
+            return slot->color;
+    }
+
+    if (2 * (colors->num + 1) > reader->num_color_slots) {
+        ColorSlot *old_slots = reader->color_slots;
+        int old_num_slots = reader->num_color_slots;
+        reader->num_color_slots *= 2;
+        reader->color_slots = calloc(reader->num_color_slots, sizeof(ColorSlot));
+        for (i = 0; i < old_num_slots; i++) {
+            if (old_slots[i].color)
+                insert_color(reader, old_slots[i].hash, old_slots[i].color);
+        }
+        free(old_slots);
+    }
+
+    colors->names = realloc(colors->names, sizeof(char *) * (colors->num + 1));
+    colors->names[colors->num++] = strdup(name);
+    insert_color(reader, hash, colors->num);
+    return colors->num;
+}
+
+
+/*
+ * Create the columns named on the first line: the primary ones, then "|", then the secondary ones.
+ * A primary name can be prefixed with "u:v|" (or "v|", meaning "v:v|") to cover it between u and v
+ * times.
+ */
+static int read_items(DlxReader *reader, char *line) {
+    Matrix *matrix = reader->matrix;
+    int primary = 1;
+    char *token;
+    while ((token = next_token(&line))) {
+        if (strcmp(token, "|") == 0) {
+            if (!primary) {
+                parse_error(reader, "More than one | in the items", NULL);
+                return 0;
+            }
+            primary = 0;
+            continue;
+        }
+
+        char *name = token;
+        int lower = 1, upper = 1;
+        char *bar = strchr(token, '|');
+        if (bar) {
+            if (!primary) {
+                parse_error(reader, "Secondary item %s can't have bounds", token);
+                return 0;
+            }
+            *bar = 0;
+            name = bar + 1;
+            char *colon = strchr(token, ':');
+            char *end;
+            int valid;
+            if (colon) {
+                lower = strtol(token, &end, 10);
+                valid = end > token && end == colon;
+                upper = strtol(colon + 1, &end, 10);
+                valid = valid && end > colon + 1 && !*end;
+            } else {
+                lower = upper = strtol(token, &end, 10);
+                valid = end > token && !*end;
+            }
+            if (!valid || lower < 0 || upper < 1 || lower > upper) {
+                parse_error(reader, "Bad bounds for item %s", name);
+                return 0;
+            }
+        }
+
+        if (!*name || strchr(name, ':') || strchr(name, '|') || strlen(name) > MAX_NAME_LENGTH) {
+            parse_error(reader, "Bad item name %s", name);
+            return 0;
+        }
+        if (lookup_column(matrix, name, column_name_hash(name))) {
+            parse_error(reader, "Item %s is named twice", name);
+            return 0;
+        }
+
+        NodeId column = create_column(matrix, primary, "%s", name);
+        if (lower != 1 || upper != 1)
+            set_column_bounds(matrix, column, lower, upper);
+    }
+
+    if (matrix->num_columns == 0) {
+        parse_error(reader, "No items", NULL);
+        return 0;
+    }
+
+    reader->stamps = calloc(matrix->num_columns + 1, sizeof(int));
+    return 1;
+}
+
+
+/* Buffer an option, made of item names that are optionally followed by ":colour". */
+static void buffer_option(DlxReader *reader, char *line) {
+    ColumnIndex *index = reader->matrix->column_index;
+    DlxOption *option = EXTARRAY_ALLOC(reader->options);
+    option->first_token = reader->tokens.num;
+    option->line_number = reader->line_number;
+
+    char *token;
+    while ((token = next_token(&line))) {
+        char *color_name = strchr(token, ':');
+        if (color_name)
+            *color_name++ = 0;
+
+        DlxToken *item = EXTARRAY_ALLOC(reader->tokens);
+        item->name = token;
+        item->color_name = color_name;
+        item->hash = column_name_hash(token);
+        prefetch(&index->slots[item->hash & (index->num_slots - 1)]);
+    }
+}
+
+
+/* Look up the columns and colours of a buffered option, and start loading the columns. */
+static int resolve_option(DlxReader *reader, DlxToken *items, int num_items) {
+    Matrix *matrix = reader->matrix;
+    int option = ++reader->num_options;
+    int i;
+    for (i = 0; i < num_items; i++) {
+        char *token = items[i].name;
+        char *color_name = items[i].color_name;
+
+        NodeId column = lookup_column(matrix, token, items[i].hash);
+        if (!column) {
+            parse_error(reader, "Unknown item %s", token);
+            return 0;
+        }
+
+        int *stamp = &reader->stamps[HEADER(column).index];
+        if (*stamp == option) {
+            parse_error(reader, "Item %s is in the option twice", token);
+            return 0;
+        }
+        *stamp = option;
+
+        int color = 0;
+        if (color_name) {
+            if (HEADER(column).primary) {
+                parse_error(reader, "Primary item %s can't have a colour", token);
+                return 0;
+            }
+            if (!*color_name) {
+                parse_error(reader, "Missing colour for item %s", token);
+                return 0;
+            }
+            color = find_color(reader, color_name);
+        }
+
+        items[i].column = column;
+        items[i].color = color;
+        prefetch(&NODE(column));
+    }
+
+    return 1;
+}
+
+
+/*
+ * Add the buffered options to the matrix as rows, in passes that each prefetch what the next will
+ * need: the names the options use, then their columns, then the last node in each column.
+ */
+static int flush_options(DlxReader *reader) {
+    Matrix *matrix = reader->matrix;
+    ColumnIndex *index = matrix->column_index;
+    int mask = index->num_slots - 1;
+    int i;
+    for (i = 0; i < reader->tokens.num; i++) {
+        ColumnIndexSlot *slot = &index->slots[reader->tokens.data[i].hash & mask];
+        if (slot->column != -1)
+            prefetch(slot->name);
+    }
+
+    int line_number = reader->line_number;
+    int ok = 1;
+    for (i = 0; ok && i < reader->options.num; i++) {
+        DlxOption *option = &reader->options.data[i];
+        int end = i + 1 < reader->options.num ? option[1].first_token : reader->tokens.num;
+        reader->line_number = option->line_number;
+        ok = resolve_option(reader, &reader->tokens.data[option->first_token], end - option->first_token);
+    }
+    reader->line_number = line_number;
+
+    for (i = 0; ok && i < reader->tokens.num; i++) {
+        NodeId column = reader->tokens.data[i].column;
+        prefetch(&NODE(NODE(column).up));
+        prefetch(&SIZE(column));
+    }
+
+    for (i = 0; ok && i < reader->options.num; i++) {
+        DlxOption *option = &reader->options.data[i];
+        int end = i + 1 < reader->options.num ? option[1].first_token : reader->tokens.num;
+        NodeId node = 0;
+        int j;
+        for (j = option->first_token; j < end; j++)
+            node = create_colored_node(matrix, node, reader->tokens.data[j].column, reader->tokens.data[j].color);
+    }
+
+    reader->tokens.num = 0;
+    reader->options.num = 0;
+    return ok;
+}
+
+
+static int read_line(DlxReader *reader, char *line) {
+    reader->line_number++;
+    if (line[0] == '|')
+        return 1;
+    char *p = line;
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+        p++;
+    if (!*p)
+        return 1;
+
+    if (!reader->have_items) {
+        reader->have_items = 1;
+        return read_items(reader, line);
+    }
+
+    buffer_option(reader, line);
+    if (reader->options.num == BATCH_OPTIONS)
+        return flush_options(reader);
+    return 1;
+}
+
+
+/**
+ * Read a matrix in the text format of Knuth's DLX programs, in a single pass over the file.  The
+ * first line names the items (columns), and each line after it is an option (row) naming some
+ * of them.  Lines starting with "|" are comments, and blank lines are skipped.  Items are looked
+ * up by name in the matrix's column index, and colours in a similar table of their own.
+ *
+ * If colors is not NULL, it is set to the names of the colours used, which the caller frees with
+ * free_dlx_colors.  Returns NULL, after printing where the problem is, if the file is malformed.
+ */
+Matrix *read_dlx_matrix(FILE *file, DlxColors *colors) {
+    DlxColors own_colors;
+    DlxReader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.matrix = create_matrix();
+    reader.colors = colors ? colors : &own_colors;
+    reader.colors->num = 0;
+    reader.colors->names = NULL;
+    reader.num_color_slots = 16;
+    reader.color_slots = calloc(reader.num_color_slots, sizeof(ColorSlot));
+
+    /*
+     * Lines are split in place in the block, and any partial line at the end is moved to the start
+     * for the next read, once the options buffered from the block have been flushed.
+     */
+    size_t block_size = BLOCK_SIZE;
+    char *block = malloc(block_size + 1);
+    size_t used = 0;
+    int at_end = 0;
+    int ok = 1;
+    while (ok && !at_end) {
+        size_t got = fread(block + used, 1, block_size - used, file);
+        used += got;
+        at_end = got == 0;
+
+        char *start = block;
+        char *end = block + used;
+        while (ok && start < end) {
+            char *newline = memchr(start, '\n', end - start);
+            if (!newline && !at_end)
+                break;
+            if (!newline)
+                newline = end;
+            *newline = 0;
+            ok = read_line(&reader, start);
+            start = newline + 1;
+        }
+        if (ok && reader.options.num)
+            ok = flush_options(&reader);
+
+        used = start < end ? end - start : 0;
+        memmove(block, start, used);
+        if (used == block_size) {
+            block_size *= 2;
+            block = realloc(block, block_size + 1);
+        }
+    }
+
+    if (ok && !reader.have_items) {
+        parse_error(&reader, "No items", NULL);
+        ok = 0;
+    }
+
+    free(block);
+    EXTARRAY_FREE(reader.tokens);
+    EXTARRAY_FREE(reader.options);
+    free(reader.stamps);
+    free(reader.color_slots);
+    if (!ok || !colors)
+        free_dlx_colors(reader.colors);
+    if (!ok) {
+        destroy_matrix(reader.matrix);
+        return NULL;
+    }
+
+    return reader.matrix;
+}
+
+
+void free_dlx_colors(DlxColors *colors) {
+    int i;
+    for (i = 0; i < colors->num; i++)
+        free(colors->names[i]);
+    free(colors->names);
+    colors->num = 0;
+    colors->names = NULL;
+}
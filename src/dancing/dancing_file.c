@@ -0,0 +1,237 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dancing_file.h"
+
+
+#define BYTE_ORDER_MARK 0x01020304
+
+#define FLAG_COMPACT_NODES 1
+#define FLAG_SIZE_BUCKETS 2
+
+/* Sections start on cache lines, which also keeps every array aligned once mapped. */
+#define ALIGN(offset) (((offset) + 63) & ~(uint64_t) 63)
+
+
+#if INDEX_NODES
+static uint32_t file_flags() {
+    uint32_t flags = 0;
+#if COMPACT_NODES
+    flags |= FLAG_COMPACT_NODES;
+#endif
+#if SIZE_BUCKETS
+    flags |= FLAG_SIZE_BUCKETS;
+#endif
+    return flags;
+}
+
+
+/* Header slots are only real headers if their node is its own column. */
+#define IS_HEADER(id) (NODE(id).column == (id))
+
+
+static int write_section(FILE *file, uint64_t *position, uint64_t offset, const void *data, size_t length) {
+    static const char zeros[64];
+    if (fwrite(zeros, 1, offset - *position, file) != offset - *position)
+        return 0;
+    if (length && fwrite(data, 1, length, file) != length)
+        return 0;
+    *position = offset + length;
+    return 1;
+}
+#endif
+
+
+/**
+ * Write a matrix, in its current state of covering and with any rows chosen so far, to a file
+ * that load_matrix can map back in.  Returns 1 on success, or 0 on failure (which is always the
+ * case without INDEX_NODES, since the nodes are then pointers).
+ */
+int save_matrix(Matrix *matrix, const char *filename) {
+#if INDEX_NODES
+    MatrixFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "DLXM", 4);
+    header.version = MATRIX_FILE_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.node_size = sizeof(Node);
+    header.header_size = sizeof(Header);
+    header.flags = file_flags();
+    header.num_columns = matrix->num_columns;
+    header.num_rows = matrix->num_rows;
+    header.num_nodes = matrix->num_nodes;
+    header.multiplicities = matrix->multiplicities;
+    header.nodes_num = matrix->nodes.num;
+    header.headers_num = matrix->headers.num;
+    header.solution_num = matrix->solution.num;
+    header.colors_num = matrix->colors.num;
+
+    NodeId c;
+    for (c = 0; c < matrix->headers.num; c++) {
+        if (IS_HEADER(c) && HEADER(c).name)
+            header.names_size += strlen(HEADER(c).name) + 1;
+    }
+
+    header.nodes_offset = ALIGN(sizeof(header));
+    header.headers_offset = ALIGN(header.nodes_offset + sizeof(Node) * matrix->nodes.num);
+    header.sizes_offset = ALIGN(header.headers_offset + sizeof(Header) * matrix->headers.num);
+    header.links_offset = ALIGN(header.sizes_offset + sizeof(int) * matrix->sizes.num);
+#if COMPACT_NODES
+    header.colors_offset = ALIGN(header.links_offset + sizeof(ColumnLinks) * matrix->column_links.num);
+#else
+    header.colors_offset = header.links_offset;
+#endif
+    header.solution_offset = ALIGN(header.colors_offset + sizeof(int) * matrix->colors.num);
+    header.names_offset = ALIGN(header.solution_offset + sizeof(NodeId) * matrix->solution.num);
+
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+        return 0;
+
+    uint64_t position = 0;
+    int ok = write_section(file, &position, 0, &header, sizeof(header))
+          && write_section(file, &position, header.nodes_offset, matrix->nodes.data, sizeof(Node) * matrix->nodes.num)
+          && write_section(file, &position, header.headers_offset, NULL, 0);
+
+    /* Headers go one at a time, with their names swapped for offsets. */
+    uint64_t name_offset = 0;
+    for (c = 0; ok && c < matrix->headers.num; c++) {
+        Header saved = HEADER(c);
+        if (IS_HEADER(c) && saved.name) {
+            saved.name = (char *) (uintptr_t) (name_offset + 1);
+            name_offset += strlen(HEADER(c).name) + 1;
+        } else {
+            saved.name = NULL;
+        }
+        ok = write_section(file, &position, position, &saved, sizeof(saved));
+    }
+
+    ok = ok && write_section(file, &position, header.sizes_offset, matrix->sizes.data, sizeof(int) * matrix->sizes.num);
+#if COMPACT_NODES
+    ok = ok && write_section(file, &position, header.links_offset, matrix->column_links.data, sizeof(ColumnLinks) * matrix->column_links.num);
+#endif
+    ok = ok && write_section(file, &position, header.colors_offset, matrix->colors.data, sizeof(int) * matrix->colors.num);
+    ok = ok && write_section(file, &position, header.solution_offset, matrix->solution.data, sizeof(NodeId) * matrix->solution.num);
+    ok = ok && write_section(file, &position, header.names_offset, NULL, 0);
+    for (c = 0; ok && c < matrix->headers.num; c++) {
+        if (IS_HEADER(c) && HEADER(c).name)
+            ok = write_section(file, &position, position, HEADER(c).name, strlen(HEADER(c).name) + 1);
+    }
+
+    if (fclose(file) != 0)
+        ok = 0;
+    return ok;
+#else
+    return 0;
+#endif
+}
+
+
+#if INDEX_NODES
+static int check_header(MatrixFileHeader *header, uint64_t file_size) {
+    if (memcmp(header->magic, "DLXM", 4) != 0
+            || header->version != MATRIX_FILE_VERSION
+            || header->byte_order != BYTE_ORDER_MARK
+            || header->node_size != sizeof(Node)
+            || header->header_size != sizeof(Header)
+            || header->flags != file_flags())
+        return 0;
+
+    return header->nodes_offset + sizeof(Node) * header->nodes_num <= file_size
+        && header->headers_offset + sizeof(Header) * header->headers_num <= file_size
+        && header->sizes_offset + sizeof(int) * header->headers_num <= file_size
+#if COMPACT_NODES
+        && header->links_offset + sizeof(ColumnLinks) * header->headers_num <= file_size
+#endif
+        && (header->colors_num == 0 || header->colors_num == header->nodes_num)
+        && header->colors_offset + sizeof(int) * header->colors_num <= file_size
+        && header->solution_offset + sizeof(NodeId) * header->solution_num <= file_size
+        && header->names_offset + header->names_size <= file_size;
+}
+#endif
+
+
+/**
+ * Map a matrix saved by save_matrix.  The mapping is private, so pages are only copied as the
+ * search writes to them, and nothing is parsed apart from fixing up the column names.  Nodes and
+ * columns can't be added to a loaded matrix, but it can otherwise be used (and cloned) as usual.
+ * Returns NULL if the file can't be read, or was written by a different version or build.
+ */
+Matrix *load_matrix(const char *filename) {
+#if INDEX_NODES
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(MatrixFileHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    MatrixFileHeader *header = (MatrixFileHeader *) base;
+    if (!check_header(header, st.st_size)) {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    Matrix *matrix = malloc(sizeof(Matrix));
+    memset(matrix, 0, sizeof(Matrix));
+    matrix->mapping = base;
+    matrix->mapping_size = st.st_size;
+
+    matrix->nodes.data = (Node *) (base + header->nodes_offset);
+    matrix->nodes.num = matrix->nodes.max = header->nodes_num;
+    matrix->headers.data = (Header *) (base + header->headers_offset);
+    matrix->headers.num = matrix->headers.max = header->headers_num;
+    matrix->sizes.data = (int *) (base + header->sizes_offset);
+    matrix->sizes.num = matrix->sizes.max = header->headers_num;
+#if COMPACT_NODES
+    matrix->column_links.data = (ColumnLinks *) (base + header->links_offset);
+    matrix->column_links.num = matrix->column_links.max = header->headers_num;
+#endif
+    if (header->colors_num) {
+        matrix->colors.data = (int *) (base + header->colors_offset);
+        matrix->colors.num = matrix->colors.max = header->colors_num;
+    }
+
+    matrix->num_columns = header->num_columns;
+    matrix->num_rows = header->num_rows;
+    matrix->num_nodes = header->num_nodes;
+    matrix->multiplicities = header->multiplicities;
+
+    char *names = base + header->names_offset;
+    NodeId c;
+    for (c = 0; c < matrix->headers.num; c++) {
+        if (HEADER(c).name)
+            HEADER(c).name = names + (uintptr_t) HEADER(c).name - 1;
+    }
+
+    EXTARRAY_ENSURE(matrix->solution, header->solution_num > 100 ? header->solution_num : 100);
+    memcpy(matrix->solution.data, base + header->solution_offset, sizeof(NodeId) * header->solution_num);
+    matrix->solution.num = header->solution_num;
+
+    reindex_matrix(matrix);
+
+    return matrix;
+#else
+    return NULL;
+#endif
+}
+
+
+/* Unmap the arrays of a loaded matrix, for destroy_matrix. */
+void unmap_matrix(Matrix *matrix) {
+    munmap(matrix->mapping, matrix->mapping_size);
+    matrix->mapping = NULL;
+}
@@ -0,0 +1,338 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dancing_reduce.h"
+
+
+/* Marks on the columns of one row, by column index. */
+typedef struct {
+    int *stamps;
+    int *colors;
+    int stamp;
+} RowMarks;
+
+
+static void mark_row(Matrix *matrix, RowMarks *marks, NodeId row) {
+    marks->stamp++;
+    NodeId n = row;
+    do {
+        int i = HEADER(NODE(n).column).index;
+        marks->stamps[i] = marks->stamp;
+        marks->colors[i] = COLOR(n);
+        n = RIGHT(n);
+    } while (n != row);
+}
+
+
+static inline int is_marked(Matrix *matrix, RowMarks *marks, NodeId column) {
+    return marks->stamps[HEADER(column).index] == marks->stamp;
+}
+
+
+/* Whether two rows with these colours in a column can't both be chosen. */
+static inline int exclusive(Matrix *matrix, NodeId column, int color1, int color2) {
+    if (HEADER(column).primary)
+        return HEADER(column).bound == 1;
+    if (color1 < 0 || color2 < 0)
+        return 0;
+    return color1 == 0 || color1 != color2;
+}
+
+
+/* Whether a row can't be chosen along with the row last marked. */
+static int clashes(Matrix *matrix, RowMarks *marks, NodeId row) {
+    NodeId n = row;
+    do {
+        NodeId column = NODE(n).column;
+        if (is_marked(matrix, marks, column)
+                && exclusive(matrix, column, COLOR(n), marks->colors[HEADER(column).index]))
+            return 1;
+        n = RIGHT(n);
+    } while (n != row);
+    return 0;
+}
+
+
+/*
+ * Choose the row of each exactly-once column with only one row left.  Returns FALSE if a primary
+ * column has fewer rows left than it must be covered by.
+ */
+static int force_rows(Matrix *matrix, ReduceStats *stats, int *changed) {
+    NodeId *forced = malloc(sizeof(NodeId) * (matrix->num_columns + 1));
+    int num_forced = 0;
+    int ok = 1;
+
+    NodeId column;
+    foreachcolumn(ROOT, column) {
+        int lower = HEADER(column).bound - HEADER(column).slack;
+        if (SIZE(column) < lower) {
+            ok = 0;
+            break;
+        }
+        if (SIZE(column) == 1 && HEADER(column).bound == 1 && HEADER(column).slack == 0)
+            forced[num_forced++] = column;
+    }
+
+    int i;
+    for (i = 0; i < num_forced && ok; i++) {
+        column = forced[i];
+        /* An earlier row may have covered the column, or taken its last row. */
+        if (COLUMN_RIGHT(COLUMN_LEFT(column)) != column)
+            continue;
+        if (SIZE(column) == 0) {
+            ok = 0;
+            break;
+        }
+        choose_row(matrix, NODE(column).down);
+        stats->forced_rows++;
+        *changed = 1;
+    }
+
+    free(forced);
+    return ok;
+}
+
+
+/* Check a row that clashes with the first row of a column against all the others. */
+static int clashes_with_column(Matrix *matrix, RowMarks *marks, NodeId row, NodeId column, NodeId first) {
+    mark_row(matrix, marks, row);
+    if (is_marked(matrix, marks, column))
+        return 0;
+
+    NodeId n;
+    foreachlink(first, down, n) {
+        if (n != column && !clashes(matrix, marks, n))
+            return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * Remove the rows that clash with every row in a column that must be covered, since choosing
+ * one would leave the column impossible to cover.  Only rows clashing with the first row in the
+ * column need to be checked.
+ */
+static long int remove_clashing_rows(Matrix *matrix, RowMarks *marks, NodeId column) {
+    long int num_removed = 0;
+    NodeId first = NODE(column).down;
+    NodeId y;
+    foreachlink(first, right, y) {
+        NodeId other = NODE(y).column;
+        if (COLOR(y) < 0 || (HEADER(other).primary && HEADER(other).bound != 1))
+            continue;
+
+        NodeId n = NODE(y).down;
+        while (n != y) {
+            NodeId next = NODE(n).down;
+            if (n != other && exclusive(matrix, other, COLOR(n), COLOR(y))
+                    && clashes_with_column(matrix, marks, n, column, first)) {
+                remove_row(matrix, n);
+                num_removed++;
+            }
+            n = next;
+        }
+    }
+    return num_removed;
+}
+
+
+/* Remove the rows with no primary columns, which the search never chooses. */
+static long int remove_secondary_rows(Matrix *matrix) {
+    long int num_removed = 0;
+    NodeId column;
+    foreachcolumn(SECONDARY_ROOT, column) {
+        NodeId n = NODE(column).down;
+        while (n != column) {
+            NodeId next = NODE(n).down;
+            NodeId x = RIGHT(n);
+            while (x != n && !HEADER(NODE(x).column).primary)
+                x = RIGHT(x);
+            if (x == n) {
+                remove_row(matrix, n);
+                num_removed++;
+            }
+            n = next;
+        }
+    }
+    return num_removed;
+}
+
+
+static inline uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+
+typedef struct {
+    uint64_t signature;      /* Of the primary columns, in any order. */
+    NodeId row;
+} RowSignature;
+
+
+static int compare_signatures(const void *a, const void *b) {
+    uint64_t x = ((const RowSignature *) a)->signature;
+    uint64_t y = ((const RowSignature *) b)->signature;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Check whether row a has the same primary columns as the row last marked, and only secondary
+ * columns (in the same colours) that it also has.  Returns the length of row a if so, or 0.
+ */
+static int dominates(Matrix *matrix, RowMarks *marks, NodeId a, int num_primary) {
+    int length = 0;
+    NodeId n = a;
+    do {
+        NodeId column = NODE(n).column;
+        int i = HEADER(column).index;
+        if (marks->stamps[i] != marks->stamp || marks->colors[i] != COLOR(n))
+            return 0;
+        num_primary -= HEADER(column).primary;
+        length++;
+        n = RIGHT(n);
+    } while (n != a);
+    return num_primary == 0 ? length : 0;
+}
+
+
+/*
+ * Remove each row whose primary columns are the same as another row's, and whose secondary
+ * columns include all of the other's: any solution with it has a counterpart with the other.
+ * Rows are grouped by a signature of their primary columns, and compared within each group.
+ */
+static long int remove_dominated_rows(Matrix *matrix, RowMarks *marks) {
+    RowSignature *rows = malloc(sizeof(RowSignature) * (matrix->num_rows + 1));
+    int num_rows = 0;
+
+    /* Take each row once, from the first of its primary columns (by index). */
+    NodeId column;
+    foreachcolumn(ROOT, column) {
+        NodeId n;
+        foreachlink(column, down, n) {
+            uint64_t signature = mix(HEADER(column).index);
+            NodeId x;
+            foreachlink(n, right, x) {
+                Header *header = &HEADER(NODE(x).column);
+                if (header->primary && header->index < HEADER(column).index)
+                    break;
+                if (header->primary)
+                    signature += mix(header->index);
+            }
+            if (x != n)
+                continue;
+            rows[num_rows].signature = signature;
+            rows[num_rows].row = n;
+            num_rows++;
+        }
+    }
+
+    qsort(rows, num_rows, sizeof(RowSignature), compare_signatures);
+
+    long int num_removed = 0;
+    int start, end;
+    for (start = 0; start < num_rows; start = end) {
+        for (end = start + 1; end < num_rows && rows[end].signature == rows[start].signature; end++)
+            continue;
+
+        int i, j;
+        for (i = start; i < end; i++) {
+            if (!rows[i].row)
+                continue;
+            mark_row(matrix, marks, rows[i].row);
+            int num_primary = 0;
+            int length = 0;
+            NodeId n = rows[i].row;
+            do {
+                num_primary += HEADER(NODE(n).column).primary;
+                length++;
+                n = RIGHT(n);
+            } while (n != rows[i].row);
+
+            for (j = start; j < end; j++) {
+                if (j == i || !rows[j].row)
+                    continue;
+                /* Of two identical rows, only one goes. */
+                int other_length = dominates(matrix, marks, rows[j].row, num_primary);
+                if (other_length && (other_length < length || j < i)) {
+                    remove_row(matrix, rows[i].row);
+                    rows[i].row = 0;
+                    num_removed++;
+                    break;
+                }
+            }
+        }
+    }
+
+    free(rows);
+    return num_removed;
+}
+
+
+/**
+ * Shrink the matrix before searching it, repeating until nothing changes:
+ *
+ *   - Fail (returning FALSE) if a primary column has fewer rows than it must be covered by.
+ *   - Choose the only row of each column that has one, with choose_row.
+ *   - Remove every row that clashes with all the rows of a column that must be covered.
+ *   - Remove rows with no primary columns, which the search would never choose.
+ *   - With REDUCE_DOMINATED (and no column bounds), remove each row whose secondary columns are
+ *     a superset of those of another row with the same primary columns.  Every solution then
+ *     still has a counterpart using the other row, but it is no longer found itself.
+ *
+ * The solutions are otherwise the same, with the forced rows at the start of each.  Removed rows
+ * are gone for good: rows chosen before this can't be unchosen afterwards.  Counts are put in
+ * stats, which may be NULL.
+ */
+int reduce_matrix(Matrix *matrix, int flags, ReduceStats *stats) {
+    ReduceStats ignored;
+    if (!stats)
+        stats = &ignored;
+    memset(stats, 0, sizeof(ReduceStats));
+
+    RowMarks marks;
+    marks.stamps = calloc(matrix->num_columns + 1, sizeof(int));
+    marks.colors = malloc(sizeof(int) * (matrix->num_columns + 1));
+    marks.stamp = 0;
+
+    int ok = 1;
+    int changed = 1;
+    while (changed && ok) {
+        changed = 0;
+        stats->num_passes++;
+
+        ok = force_rows(matrix, stats, &changed);
+        if (!ok)
+            break;
+
+        /* Only once, after checking that no column is already empty. */
+        if (stats->num_passes == 1)
+            stats->secondary_rows = remove_secondary_rows(matrix);
+
+        NodeId column;
+        foreachcolumn(ROOT, column) {
+            if (SIZE(column) == 0 || HEADER(column).bound - HEADER(column).slack < 1)
+                continue;
+            long int num_removed = remove_clashing_rows(matrix, &marks, column);
+            stats->clashing_rows += num_removed;
+            changed |= num_removed > 0;
+        }
+
+        if ((flags & REDUCE_DOMINATED) && !matrix->multiplicities) {
+            long int num_removed = remove_dominated_rows(matrix, &marks);
+            stats->dominated_rows += num_removed;
+            changed |= num_removed > 0;
+        }
+    }
+
+    free(marks.stamps);
+    free(marks.colors);
+    return ok;
+}
@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dancing_stream.h"
+
+
+/* Solutions are buffered and written (and read) in blocks of this size. */
+#define STREAM_BUFFER_SIZE (1 << 20)
+
+/* Most bytes one number takes in either encoding. */
+#define MAX_NUMBER_BYTES 5
+
+/* Larger solutions than this in a stream are taken to mean it's corrupt. */
+#define MAX_SOLUTION_ROWS (1 << 24)
+
+#define HEADER_SIZE 8
+
+
+static void flush_buffer(SolutionWriter *writer) {
+    if (writer->buffer_used && fwrite(writer->buffer, 1, writer->buffer_used, writer->file) != writer->buffer_used)
+        writer->failed = 1;
+    writer->bytes_written += writer->buffer_used;
+    writer->buffer_used = 0;
+}
+
+
+#if INDEX_NODES
+/* Make room in the buffer for up to length more bytes. */
+static unsigned char *reserve(SolutionWriter *writer, size_t length) {
+    if (writer->buffer_used + length > writer->buffer_size) {
+        flush_buffer(writer);
+        if (length > writer->buffer_size) {
+            writer->buffer_size = length;
+            writer->buffer = realloc(writer->buffer, length);
+        }
+    }
+    return writer->buffer + writer->buffer_used;
+}
+#endif
+
+
+static inline unsigned char *put_varint(unsigned char *p, unsigned int value) {
+    while (value >= 0x80) {
+        *p++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+
+static inline unsigned char *put_uint32(unsigned char *p, unsigned int value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+    return p + 4;
+}
+
+
+/**
+ * Start a stream of the solutions of a matrix, written to an open file.  The rows are numbered
+ * up front, so the matrix must be complete.  Returns NULL without INDEX_NODES, since there is
+ * then no cheap way to get from a node to its row number.
+ */
+SolutionWriter *create_solution_writer(Matrix *matrix, FILE *file, StreamEncoding encoding) {
+#if INDEX_NODES
+    SolutionWriter *writer = malloc(sizeof(SolutionWriter));
+    memset(writer, 0, sizeof(SolutionWriter));
+    writer->file = file;
+    writer->encoding = encoding;
+    writer->row_numbers = matrix_row_numbers(matrix);
+    writer->buffer_size = STREAM_BUFFER_SIZE;
+    writer->buffer = malloc(writer->buffer_size);
+
+    unsigned char *p = reserve(writer, HEADER_SIZE);
+    memcpy(p, "DLXS", 4);
+    p[4] = SOLUTION_STREAM_VERSION;
+    p[5] = encoding;
+    p[6] = 0;
+    p[7] = 0;
+    writer->buffer_used += HEADER_SIZE;
+
+    return writer;
+#else
+    return NULL;
+#endif
+}
+
+
+/* Add the matrix's current solution to the stream.  Takes the place of a solution callback. */
+int write_solution(Matrix *matrix, SolutionWriter *writer) {
+#if INDEX_NODES
+    int num = matrix->solution.num;
+    unsigned char *start = reserve(writer, (size_t) (num + 2) * MAX_NUMBER_BYTES);
+    unsigned char *p = start;
+    int i;
+
+    if (writer->encoding == STREAM_PLAIN) {
+        p = put_uint32(p, num);
+        for (i = 0; i < num; i++)
+            p = put_uint32(p, writer->row_numbers[matrix->solution.data[i]]);
+    } else {
+        EXTARRAY_ENSURE(writer->previous, num);
+        unsigned int *rows = writer->previous.data;
+        int limit = num < writer->previous.num ? num : writer->previous.num;
+        int shared = 0;
+        while (shared < limit && rows[shared] == writer->row_numbers[matrix->solution.data[shared]])
+            shared++;
+        unsigned int base = shared < writer->previous.num ? rows[shared] : 0;
+        for (i = shared; i < num; i++)
+            rows[i] = writer->row_numbers[matrix->solution.data[i]];
+        writer->previous.num = num;
+
+        p = put_varint(p, shared);
+        p = put_varint(p, num - shared);
+        if (shared < num) {
+            int delta = (int) (rows[shared] - base);
+            p = put_varint(p, ((unsigned int) delta << 1) ^ (unsigned int) (delta >> 31));
+            for (i = shared + 1; i < num; i++)
+                p = put_varint(p, rows[i]);
+        }
+    }
+
+    writer->buffer_used += p - start;
+#endif
+    return 0;
+}
+
+
+/* Write out the rest of the stream (but leave the file open).  Returns 0 if any write failed. */
+int destroy_solution_writer(SolutionWriter *writer) {
+    flush_buffer(writer);
+    if (fflush(writer->file) != 0)
+        writer->failed = 1;
+
+    int ok = !writer->failed;
+    free(writer->row_numbers);
+    EXTARRAY_FREE(writer->previous);
+    free(writer->buffer);
+    free(writer);
+    return ok;
+}
+
+
+/* Check whether the stream has ended, refilling the buffer if it's empty. */
+static int at_end(SolutionReader *reader) {
+    if (reader->buffer_position == reader->buffer_used) {
+        reader->buffer_used = fread(reader->buffer, 1, STREAM_BUFFER_SIZE, reader->file);
+        reader->buffer_position = 0;
+    }
+    return reader->buffer_used == 0;
+}
+
+
+static inline int get_byte(SolutionReader *reader) {
+    if (reader->buffer_position == reader->buffer_used && at_end(reader))
+        return -1;
+    return reader->buffer[reader->buffer_position++];
+}
+
+
+static int get_varint(SolutionReader *reader, unsigned int *value) {
+    unsigned int result = 0;
+    int shift = 0;
+    int byte;
+    do {
+        byte = get_byte(reader);
+        if (byte < 0 || shift > 28)
+            return 0;
+        result |= (unsigned int) (byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+
+    *value = result;
+    return 1;
+}
+
+
+static int get_uint32(SolutionReader *reader, unsigned int *value) {
+    unsigned int result = 0;
+    int i;
+    for (i = 0; i < 4; i++) {
+        int byte = get_byte(reader);
+        if (byte < 0)
+            return 0;
+        result |= (unsigned int) byte << (8 * i);
+    }
+
+    *value = result;
+    return 1;
+}
+
+
+/* Start reading a solution stream.  Returns NULL if the file doesn't start like one. */
+SolutionReader *create_solution_reader(FILE *file) {
+    SolutionReader *reader = malloc(sizeof(SolutionReader));
+    memset(reader, 0, sizeof(SolutionReader));
+    reader->file = file;
+    reader->buffer = malloc(STREAM_BUFFER_SIZE);
+
+    unsigned char header[HEADER_SIZE];
+    int i;
+    for (i = 0; i < HEADER_SIZE; i++) {
+        int byte = get_byte(reader);
+        if (byte < 0)
+            break;
+        header[i] = byte;
+    }
+
+    if (i < HEADER_SIZE || memcmp(header, "DLXS", 4) != 0 || header[4] != SOLUTION_STREAM_VERSION
+            || header[5] > STREAM_COMPRESSED) {
+        destroy_solution_reader(reader);
+        return NULL;
+    }
+    reader->encoding = header[5];
+
+    return reader;
+}
+
+
+/**
+ * Read the next solution in the stream into reader->rows.  Returns 1 if there was one, 0 at the
+ * end of the stream, or -1 if the stream is corrupt.
+ */
+int read_solution(SolutionReader *reader) {
+    if (at_end(reader))
+        return 0;
+
+    unsigned int i;
+    if (reader->encoding == STREAM_PLAIN) {
+        unsigned int num;
+        if (!get_uint32(reader, &num) || num > MAX_SOLUTION_ROWS)
+            return -1;
+        EXTARRAY_ENSURE(reader->rows, num);
+        for (i = 0; i < num; i++) {
+            if (!get_uint32(reader, &reader->rows.data[i]))
+                return -1;
+        }
+        reader->rows.num = num;
+        return 1;
+    }
+
+    unsigned int shared, num_new;
+    if (!get_varint(reader, &shared) || !get_varint(reader, &num_new)
+            || shared > reader->rows.num || num_new > MAX_SOLUTION_ROWS)
+        return -1;
+    EXTARRAY_ENSURE(reader->rows, shared + num_new);
+    unsigned int *rows = reader->rows.data;
+
+    if (num_new > 0) {
+        unsigned int zigzag;
+        if (!get_varint(reader, &zigzag))
+            return -1;
+        unsigned int base = shared < reader->rows.num ? rows[shared] : 0;
+        rows[shared] = base + ((zigzag >> 1) ^ -(zigzag & 1));
+        for (i = shared + 1; i < shared + num_new; i++) {
+            if (!get_varint(reader, &rows[i]))
+                return -1;
+        }
+    }
+
+    reader->rows.num = shared + num_new;
+    return 1;
+}
+
+
+void destroy_solution_reader(SolutionReader *reader) {
+    EXTARRAY_FREE(reader->rows);
+    free(reader->buffer);
+    free(reader);
+}
@@ -0,0 +1,542 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dancing_symmetry.h"
+
+
+/* Closing the generators under composition is given up past this many group elements. */
+#define MAX_GROUP_SIZE 4096
+
+/* Solutions with up to this many rows are checked without allocating. */
+#define SMALL_SOLUTION 64
+
+
+#if INDEX_NODES
+
+#define POSITION(node) (HEADER(NODE(node).column).index - 1)
+
+
+static Symmetry *create_symmetry(Matrix *matrix) {
+    Symmetry *symmetry = malloc(sizeof(Symmetry));
+    memset(symmetry, 0, sizeof(Symmetry));
+    symmetry->num_columns = matrix->num_columns;
+    symmetry->row_numbers = matrix_row_numbers(matrix);
+
+    NodeId n;
+    for (n = matrix->headers.num; n < matrix->nodes.num; n++) {
+        if (symmetry->row_numbers[n] >= symmetry->num_rows)
+            symmetry->num_rows = symmetry->row_numbers[n] + 1;
+    }
+
+    symmetry->row_starts = calloc(symmetry->num_rows, sizeof(NodeId));
+    for (n = matrix->headers.num; n < matrix->nodes.num; n++) {
+        int row = symmetry->row_numbers[n];
+        if (row >= 0 && !symmetry->row_starts[row])
+            symmetry->row_starts[row] = n;
+    }
+
+    symmetry->removed = calloc(symmetry->num_rows, 1);
+
+    return symmetry;
+}
+
+
+void destroy_symmetry(Symmetry *symmetry) {
+    int i;
+    for (i = 0; i < symmetry->num_generators; i++)
+        free(symmetry->generators[i]);
+    free(symmetry->generators);
+    for (i = 0; i < symmetry->group_size; i++)
+        free(symmetry->elements[i]);
+    free(symmetry->elements);
+    free(symmetry->row_numbers);
+    free(symmetry->row_starts);
+    free(symmetry->removed);
+    free(symmetry);
+}
+
+
+/* Follow the nodes of the matrix to their new ids, after renumber_nodes. */
+void renumber_symmetry(Symmetry *symmetry, const NodeId *remap, int num_nodes) {
+    int *row_numbers = malloc(sizeof(int) * num_nodes);
+    int n;
+    for (n = 0; n < num_nodes; n++)
+        row_numbers[remap[n]] = symmetry->row_numbers[n];
+    free(symmetry->row_numbers);
+    symmetry->row_numbers = row_numbers;
+
+    int row;
+    for (row = 0; row < symmetry->num_rows; row++)
+        symmetry->row_starts[row] = remap[symmetry->row_starts[row]];
+}
+
+
+static inline uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+
+/* Hash the columns (mapped through column_images) and colours of a row, in any order. */
+static uint64_t row_signature(Matrix *matrix, Symmetry *symmetry, const int *column_images, int row) {
+    NodeId start = symmetry->row_starts[row];
+    NodeId n = start;
+    uint64_t signature = 0;
+    do {
+        uint64_t position = column_images[POSITION(n)];
+        signature += mix((position << 32) | (uint32_t) COLOR(n));
+        n = RIGHT(n);
+    } while (n != start);
+    return signature;
+}
+
+
+typedef struct {
+    int *stamps;
+    int *colors;
+    int stamp;
+} RowMatcher;
+
+
+/* Check that a row mapped through column_images is exactly the target row. */
+static int match_row(Matrix *matrix, Symmetry *symmetry, RowMatcher *matcher, const int *column_images, int row, int target) {
+    int stamp = ++matcher->stamp;
+    int count = 0;
+
+    NodeId start = symmetry->row_starts[target];
+    NodeId n = start;
+    do {
+        matcher->stamps[POSITION(n)] = stamp;
+        matcher->colors[POSITION(n)] = COLOR(n);
+        count++;
+        n = RIGHT(n);
+    } while (n != start);
+
+    start = symmetry->row_starts[row];
+    n = start;
+    do {
+        int position = column_images[POSITION(n)];
+        if (matcher->stamps[position] != stamp || matcher->colors[position] != COLOR(n))
+            return 0;
+        count--;
+        n = RIGHT(n);
+    } while (n != start);
+
+    return count == 0;
+}
+
+
+/*
+ * Find the image of every row under a column permutation, by looking up the signature of each
+ * mapped row among the signatures of the rows.  Identical rows are matched one to one.
+ */
+static int derive_row_images(Matrix *matrix, Symmetry *symmetry, RowMatcher *matcher, const int *column_images, int *row_images) {
+    int num_rows = symmetry->num_rows;
+    int *identity = malloc(sizeof(int) * symmetry->num_columns);
+    int i;
+    for (i = 0; i < symmetry->num_columns; i++)
+        identity[i] = i;
+
+    int num_slots = 1;
+    while (num_slots < 2 * num_rows)
+        num_slots *= 2;
+    int *slots = malloc(sizeof(int) * num_slots);
+    for (i = 0; i < num_slots; i++)
+        slots[i] = -1;
+
+    uint64_t *signatures = malloc(sizeof(uint64_t) * num_rows);
+    for (i = 0; i < num_rows; i++) {
+        signatures[i] = row_signature(matrix, symmetry, identity, i);
+        int slot = signatures[i] & (num_slots - 1);
+        while (slots[slot] != -1)
+            slot = (slot + 1) & (num_slots - 1);
+        slots[slot] = i;
+    }
+
+    char *taken = calloc(num_rows, 1);
+    int ok = 1;
+    for (i = 0; i < num_rows && ok; i++) {
+        uint64_t signature = row_signature(matrix, symmetry, column_images, i);
+        int slot = signature & (num_slots - 1);
+        row_images[i] = -1;
+        for (; slots[slot] != -1; slot = (slot + 1) & (num_slots - 1)) {
+            int candidate = slots[slot];
+            if (signatures[candidate] == signature && !taken[candidate]
+                    && match_row(matrix, symmetry, matcher, column_images, i, candidate)) {
+                row_images[i] = candidate;
+                taken[candidate] = 1;
+                break;
+            }
+        }
+        ok = row_images[i] != -1;
+    }
+
+    free(taken);
+    free(signatures);
+    free(slots);
+    free(identity);
+    return ok;
+}
+
+
+/**
+ * Declare a symmetry of the matrix, which must be complete.  column_images[i] is the position of
+ * the column that column i maps to, and row_images (if not NULL) does the same for rows; if it is
+ * NULL, the rows are mapped to whichever rows have the images of their columns.  Primary columns
+ * must map to primary columns with the same bounds.  Returns FALSE, declaring nothing, if the
+ * permutations aren't a symmetry of the matrix (or without INDEX_NODES).
+ */
+int add_symmetry(Matrix *matrix, const int *column_images, const int *row_images) {
+    Symmetry *symmetry = matrix->symmetry ? matrix->symmetry : create_symmetry(matrix);
+    int num_columns = symmetry->num_columns;
+    int num_rows = symmetry->num_rows;
+    int *generator = malloc(sizeof(int) * (num_columns + num_rows));
+    char *seen = calloc(num_columns > num_rows ? num_columns : num_rows, 1);
+    int ok = !symmetry->elements;
+
+    int i;
+    for (i = 0; i < num_columns && ok; i++) {
+        int image = column_images[i];
+        if (image < 0 || image >= num_columns || seen[image]) {
+            ok = 0;
+            break;
+        }
+        seen[image] = 1;
+        Header *from = &HEADER(matrix_column(matrix, i));
+        Header *to = &HEADER(matrix_column(matrix, image));
+        ok = from->primary == to->primary && from->bound == to->bound && from->slack == to->slack;
+        generator[i] = image;
+    }
+
+    RowMatcher matcher;
+    matcher.stamps = calloc(num_columns, sizeof(int));
+    matcher.colors = malloc(sizeof(int) * num_columns);
+    matcher.stamp = 0;
+
+    int *generator_rows = generator + num_columns;
+    if (ok && row_images) {
+        memset(seen, 0, num_rows);
+        for (i = 0; i < num_rows && ok; i++) {
+            int image = row_images[i];
+            ok = image >= 0 && image < num_rows && !seen[image]
+                    && match_row(matrix, symmetry, &matcher, column_images, i, image);
+            if (ok)
+                seen[image] = 1;
+            generator_rows[i] = image;
+        }
+    } else if (ok) {
+        ok = derive_row_images(matrix, symmetry, &matcher, column_images, generator_rows);
+    }
+
+    free(matcher.stamps);
+    free(matcher.colors);
+    free(seen);
+
+    if (!ok) {
+        free(generator);
+        if (!matrix->symmetry)
+            destroy_symmetry(symmetry);
+        return 0;
+    }
+
+    symmetry->generators = realloc(symmetry->generators, sizeof(int *) * (symmetry->num_generators + 1));
+    symmetry->generators[symmetry->num_generators++] = generator;
+    matrix->symmetry = symmetry;
+    return 1;
+}
+
+
+static unsigned int hash_element(const int *element, int length) {
+    unsigned int hash = 2166136261U;
+    int i;
+    for (i = 0; i < length; i++)
+        hash = (hash ^ (unsigned int) element[i]) * 16777619U;
+    return hash;
+}
+
+
+/* Close the generators under composition, starting from the identity.  Returns the group size. */
+static int generate_group(Symmetry *symmetry) {
+    int length = symmetry->num_columns + symmetry->num_rows;
+    int **elements = malloc(sizeof(int *) * MAX_GROUP_SIZE);
+    unsigned int *hashes = malloc(sizeof(unsigned int) * MAX_GROUP_SIZE);
+    int num_elements = 1;
+    int i;
+
+    elements[0] = malloc(sizeof(int) * length);
+    for (i = 0; i < symmetry->num_columns; i++)
+        elements[0][i] = i;
+    for (i = 0; i < symmetry->num_rows; i++)
+        elements[0][symmetry->num_columns + i] = i;
+    hashes[0] = hash_element(elements[0], length);
+
+    int *product = malloc(sizeof(int) * length);
+    int e;
+    for (e = 0; e < num_elements; e++) {
+        int g;
+        for (g = 0; g < symmetry->num_generators; g++) {
+            int *generator = symmetry->generators[g];
+            for (i = 0; i < symmetry->num_columns; i++)
+                product[i] = generator[elements[e][i]];
+            for (; i < length; i++)
+                product[i] = generator[symmetry->num_columns + elements[e][i]];
+
+            unsigned int hash = hash_element(product, length);
+            int j;
+            for (j = 0; j < num_elements; j++) {
+                if (hashes[j] == hash && memcmp(elements[j], product, sizeof(int) * length) == 0)
+                    break;
+            }
+            if (j < num_elements)
+                continue;
+
+            if (num_elements == MAX_GROUP_SIZE) {
+                for (j = 0; j < num_elements; j++)
+                    free(elements[j]);
+                free(elements);
+                free(hashes);
+                free(product);
+                return 0;
+            }
+            hashes[num_elements] = hash;
+            elements[num_elements] = product;
+            num_elements++;
+            product = malloc(sizeof(int) * length);
+        }
+    }
+
+    free(product);
+    free(hashes);
+    symmetry->elements = elements;
+    return num_elements;
+}
+
+
+/*
+ * Pick a representative of each orbit of the rows in a column under the symmetries that fix it,
+ * marking them in keep (if not NULL).  seen must be all zero, and is left that way.  Returns the
+ * number of orbits.
+ */
+static int pick_representatives(Matrix *matrix, Symmetry *symmetry, NodeId column, char *seen, char *keep) {
+    int position = HEADER(column).index - 1;
+    int num_kept = 0;
+    NodeId n;
+
+    foreachlink(column, down, n) {
+        int row = symmetry->row_numbers[n];
+        if (seen[row])
+            continue;
+        num_kept++;
+        if (keep)
+            keep[row] = 1;
+        int e;
+        for (e = 0; e < symmetry->group_size; e++) {
+            int *element = symmetry->elements[e];
+            if (element[position] == position)
+                seen[element[symmetry->num_columns + row]] = 1;
+        }
+    }
+
+    foreachlink(column, down, n) {
+        seen[symmetry->row_numbers[n]] = 0;
+    }
+
+    return num_kept;
+}
+
+
+/*
+ * Find the column left with the fewest rows once one row of each orbit is kept (and of those, the
+ * one losing the largest fraction of its rows).  That column is then likely to be the first one
+ * searched, where cutting it down saves the most.
+ */
+static NodeId choose_breaker(Matrix *matrix, Symmetry *symmetry, char *seen) {
+    NodeId best = 0;
+    long int best_kept = 0, best_size = 0;
+    NodeId column;
+
+    foreachcolumn(ROOT, column) {
+        long int size = SIZE(column);
+        if (HEADER(column).bound != 1 || HEADER(column).slack != 0 || size == 0)
+            continue;
+        long int kept = pick_representatives(matrix, symmetry, column, seen, NULL);
+        if (kept < size && (!best || kept < best_kept || (kept == best_kept && size > best_size))) {
+            best = column;
+            best_kept = kept;
+            best_size = size;
+        }
+    }
+
+    return best;
+}
+
+
+/**
+ * Restrict the search to one solution in each set of symmetric ones.  The declared symmetries are
+ * closed into a group (less any that move the rows already chosen).  Then, in one primary column
+ * that must be covered exactly once, only one row of each orbit under the symmetries fixing that
+ * column is kept, since every solution has a symmetric copy using one of them; this is how Knuth
+ * restricts the X pentomino to one eighth of the board.  The search still finds some symmetric
+ * copies, and report_solution passes on only the least of them.
+ *
+ * The column is chosen automatically when 0 is passed; if no column helps, solutions are only
+ * filtered.  Returns the size of the group, or 0 if it couldn't be broken.
+ */
+int break_symmetry(Matrix *matrix, NodeId column) {
+    Symmetry *symmetry = matrix->symmetry;
+    if (!symmetry || symmetry->elements)
+        return 0;
+    if (column && (!HEADER(column).primary || HEADER(column).bound != 1 || HEADER(column).slack != 0))
+        return 0;
+
+    symmetry->group_size = generate_group(symmetry);
+    if (symmetry->group_size == 0)
+        return 0;
+
+    char *chosen = calloc(symmetry->num_rows, 1);
+    int i;
+    for (i = 0; i < matrix->solution.num; i++)
+        chosen[symmetry->row_numbers[matrix->solution.data[i]]] = 1;
+
+    int num_elements = 0;
+    int e;
+    for (e = 0; e < symmetry->group_size; e++) {
+        int *row_images = symmetry->elements[e] + symmetry->num_columns;
+        for (i = 0; i < matrix->solution.num; i++) {
+            if (!chosen[row_images[symmetry->row_numbers[matrix->solution.data[i]]]])
+                break;
+        }
+        if (i < matrix->solution.num)
+            free(symmetry->elements[e]);
+        else
+            symmetry->elements[num_elements++] = symmetry->elements[e];
+    }
+    symmetry->group_size = num_elements;
+    free(chosen);
+
+    char *seen = calloc(symmetry->num_rows, 1);
+    if (!column)
+        column = choose_breaker(matrix, symmetry, seen);
+
+    if (column) {
+        char *keep = calloc(symmetry->num_rows, 1);
+        symmetry->breaker = column;
+        symmetry->breaker_rows = SIZE(column);
+        symmetry->kept_rows = pick_representatives(matrix, symmetry, column, seen, keep);
+
+        NodeId *rows = malloc(sizeof(NodeId) * symmetry->breaker_rows);
+        int num_rows = 0;
+        NodeId n;
+        foreachlink(column, down, n) {
+            rows[num_rows++] = n;
+        }
+        for (i = 0; i < num_rows; i++) {
+            int row = symmetry->row_numbers[rows[i]];
+            if (keep[row])
+                continue;
+            remove_row(matrix, rows[i]);
+            symmetry->removed[row] = 1;
+        }
+
+        free(rows);
+        free(keep);
+    }
+    free(seen);
+
+    return symmetry->group_size;
+}
+
+
+static void sort_rows(int *rows, int num) {
+    int i;
+    for (i = 1; i < num; i++) {
+        int row = rows[i];
+        int j = i;
+        while (j > 0 && rows[j - 1] > row) {
+            rows[j] = rows[j - 1];
+            j--;
+        }
+        rows[j] = row;
+    }
+}
+
+
+/**
+ * Check whether the matrix's solution is the least of its symmetric copies the search also finds
+ * (comparing the sorted row numbers), and if it is, count the copies in num_symmetric_solutions.
+ * Called by report_solution; it only reads the symmetry, so threads can share it.
+ */
+int canonical_solution(Matrix *matrix) {
+    Symmetry *symmetry = matrix->symmetry;
+    if (symmetry->group_size == 0) {
+        matrix->num_symmetric_solutions++;
+        return 1;
+    }
+
+    int num = matrix->solution.num;
+    int buffer[2 * SMALL_SOLUTION];
+    int *rows = num <= SMALL_SOLUTION ? buffer : malloc(sizeof(int) * 2 * num);
+    int *image = rows + num;
+    int i;
+    for (i = 0; i < num; i++)
+        rows[i] = symmetry->row_numbers[matrix->solution.data[i]];
+    sort_rows(rows, num);
+
+    int canonical = 1;
+    int num_fixing = 0;
+    int e;
+    for (e = 0; e < symmetry->group_size && canonical; e++) {
+        int *row_images = symmetry->elements[e] + symmetry->num_columns;
+        int removed = 0;
+        for (i = 0; i < num; i++) {
+            image[i] = row_images[rows[i]];
+            removed |= symmetry->removed[image[i]];
+        }
+        if (removed)
+            continue;
+
+        sort_rows(image, num);
+        int difference = 0;
+        for (i = 0; i < num && !difference; i++)
+            difference = image[i] - rows[i];
+        if (difference < 0)
+            canonical = 0;
+        else if (difference == 0)
+            num_fixing++;
+    }
+
+    if (canonical)
+        matrix->num_symmetric_solutions += symmetry->group_size / num_fixing;
+
+    if (rows != buffer)
+        free(rows);
+    return canonical;
+}
+
+#else
+
+int add_symmetry(Matrix *matrix, const int *column_images, const int *row_images) {
+    return 0;
+}
+
+
+int break_symmetry(Matrix *matrix, NodeId column) {
+    return 0;
+}
+
+
+int canonical_solution(Matrix *matrix) {
+    matrix->num_symmetric_solutions++;
+    return 1;
+}
+
+
+void destroy_symmetry(Symmetry *symmetry) {
+}
+
+#endif
@@ -1,80 +1,156 @@
-#include <assert.h>
-#include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <unistd.h>
 
+#include "dancing_bits.h"
+#include "dancing_cells.h"
 #include "dancing_threads.h"
 
 
-typedef enum {
-    MT_READY,
-    MT_SOLUTION,
-    MT_WORK_DONE,
-    MT_FINISHED
-} MessageType;
+/*
+ * Every worker (the calling thread is the first) searches its own clone of the matrix, one task
+ * at a time.  A task is a branch of the search tree, given as the path to it from the top.  The
+ * worker follows the path with choose_steps, and searches the top levels below it (down to the
+ * depth cutoff) with a cursor, whose stack is the worker's private deque of branches still to
+ * try; below the cutoff each branch is searched to the end with the fastest engine (the bitsets,
+ * if the matrix fits and they are expected to win, or the sparse sets when asked for, either
+ * compiled once per worker and reset for each branch).
+ *
+ * With ADAPTIVE_DEPTH the cutoff is decided for each branch instead: the cursor stops at every
+ * node, and the worker estimates the size of the branch below it with a few random probes
+ * (estimate_search), and times it by how long its own whole branches have taken for their
+ * estimated sizes, which makes up for the engine's speed and the estimates' bias alike.  Branches
+ * expected to take longer than TARGET_BRANCH_TIME are gone into with the cursor, where they can
+ * be split; the rest are searched to the end.  The top of a task is always gone into.
+ *
+ * An idle worker asks a busy one for work, and the busy one, at its next node, hands over the
+ * shallowest branch it has yet to try (which is the oldest, and likely the biggest), with
+ * split_search.  So tasks are only made when a worker is idle, and a branch with most of the
+ * work in it is split up as far as it needs to be.  The search is over when no worker is busy.
+ *
+ * The solution callback is only called on the calling thread, with the original matrix.  The
+ * other workers collect their solutions (with their nodes mapped to the original's) in batches,
+ * and queue each batch when it fills up or they go idle; the first worker passes them to the
+ * callback between its own branches and solutions, as well as while it's idle.  The queue is
+ * bounded, so a worker finding solutions faster than the callback takes them waits.
+ */
+
+
+/* Solutions found by one worker, without the rows chosen before the search. */
+typedef struct SolutionBatch {
+    struct SolutionBatch *next;
+    int num_solutions;
+    int num_ids;
+    int *lengths;
+    NodeId *ids;
+} SolutionBatch;
 
 
 typedef struct ThreadData {
     int worker_id;
     struct ThreadControl *control;
     pthread_t thread;
-    pthread_mutex_t mutex;
-    pthread_cond_t work_available;
     Matrix *matrix;
-    struct ThreadData *next_ready_thread;
-    int finish;
+    BitsMatrix *bits;
+    CellsMatrix *cells;
+    int root;                /* Rows chosen before the search began. */
+    NodeMap *node_map;
+    SolutionBatch *batch;
+
+    /* The task, if has_task is set, or the one being searched. */
+    SearchStep *task;
+    int task_length;
+    int has_task;
+    int busy;
+
+    /*
+     * A worker asking this one for work, and the one this one is asking.  work_requested is set
+     * under the mutex, but read by the cursor without it.
+     */
+    atomic_int work_requested;
+    struct ThreadData *thief;
+    struct ThreadData *victim;
+    int refused;
+    int next_victim;
+
+    /* For the adaptive depth: the random probes, and how long whole branches took for their size. */
+    unsigned int seed;
+    double estimate;         /* Of the branch about to be searched whole, or 0 if not probed. */
+    double probed_estimate;
+    double probed_time;
+    double whole_time;
+    double probe_time;
+
+    /* Statistics. */
+    long int num_solutions;
+    long int search_calls;
+    long int num_tasks;
+    double search_time;
+    long int num_shared_branches;
+    long int num_whole_branches;
+    long int branch_times[NUM_BRANCH_TIMES];
 } ThreadData;
 
 
-typedef struct {
-    MessageType type;
-    ThreadData *worker_data;
-    union {
-        struct {
-            long int num_solutions;
-            long int search_calls;
-        };
-    };
-} Message;
-
+typedef struct ThreadControl {
+    int num_threads;
+    ThreadData *threads;
+    int depth_cutoff;
+    Matrix *matrix;
 
-#define QUEUE_SIZE_PER_THREAD 100
+    /* Guards the tasks and requests of every worker. */
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    int num_busy;
+    long int num_requests;
+
+    /* Also guarded: full batches of solutions, in the order they were queued, and spare ones. */
+    SolutionBatch *queue_head;
+    SolutionBatch *queue_tail;
+    atomic_int num_queued;   /* Written under the mutex, but peeked at without it. */
+    SolutionBatch *spare_batches;
+    int batch_ids;
+    long int num_batches;
+
+    /* Set once the search is to stop, and read by every worker without the mutex. */
+    atomic_int finish_all;
+} ThreadControl;
 
 
-typedef struct {
-    int queue_size;
-    Message *queue;
-    int queue_start;
-    int num_queued;
-    pthread_mutex_t mutex;
-    pthread_cond_t message_available;
-    pthread_cond_t space_available;
-} Queue;
+/* How long an idle worker waits after being refused before asking again. */
+#define REFUSED_WAIT_NS 1000000
 
+/* A batch holds this many solutions, or this many nodes (or one solution, if that's more). */
+#define BATCH_SOLUTIONS 1024
+#define BATCH_IDS 16384
+/* Queued batches per worker, before workers wait for the callback to catch up. */
+#define QUEUED_BATCHES 4
 
-typedef struct ThreadControl {
-    int num_threads;
-    ThreadData *threads;
-    Queue queue;
-    int finish_all;
-    ThreadData *first_ready_thread;
-} ThreadControl;
+/* With ADAPTIVE_DEPTH, how long a branch can be expected to take before it is shared. */
+#define TARGET_BRANCH_TIME 0.01
+#define NUM_PROBES 8
+/* Probing stops while it has taken more than this share of the time in whole branches. */
+#define PROBE_SHARE 0.0625
+/*
+ * Time taken per estimated node, until a worker has timed some branches of its own.  This is on
+ * the slow side, which keeps the first probes short in a tree with slow nodes.
+ */
+#define DEFAULT_NODE_TIME 1E-5
 
 
 static pthread_key_t worker_id_key = 0;
 
 
-#define DEBUG_THREADS 1
+#define DEBUG_THREADS 0
 
 #if DEBUG_THREADS
 static void thread_printf(char *fmt, ...) {
     static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-    
+
     va_list args;
     va_start(args, fmt);
 
@@ -82,7 +158,7 @@ static void thread_printf(char *fmt, ...) {
     vsnprintf(buffer, sizeof(buffer), fmt, args);
 
     va_end(args);
-    
+
     char worker_str[10];
     ThreadData *data = pthread_getspecific(worker_id_key);
     if (data) {
@@ -94,7 +170,7 @@ static void thread_printf(char *fmt, ...) {
     pthread_mutex_lock(&mutex);
     printf("[%p%s] %s", (void *) pthread_self(), worker_str, buffer);
     pthread_mutex_unlock(&mutex);
-    
+
     fflush(stdout);
 }
 #else
@@ -102,343 +178,561 @@ static void thread_printf(char *fmt, ...) { }
 #endif
 
 
-static void init_queue(Queue *queue, int queue_size) {
-    queue->queue_size = queue_size;
-    queue->queue = calloc(queue_size, sizeof(Message));
-
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->message_available, NULL);
-    pthread_cond_init(&queue->space_available, NULL);
+static double thread_cpu_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec/1E+9;
 }
 
 
-static void teardown_queue(Queue *queue) {
-    free(queue->queue);
+static SolutionBatch *create_batch(ThreadControl *control) {
+    SolutionBatch *batch = malloc(sizeof(SolutionBatch));
+    batch->next = NULL;
+    batch->num_solutions = 0;
+    batch->num_ids = 0;
+    batch->lengths = malloc(BATCH_SOLUTIONS * sizeof(int));
+    batch->ids = malloc(control->batch_ids * sizeof(NodeId));
+    return batch;
+}
+
 
-    pthread_mutex_destroy(&queue->mutex);
-    pthread_cond_destroy(&queue->message_available);
-    pthread_cond_destroy(&queue->space_available);
+static void destroy_batch(SolutionBatch *batch) {
+    free(batch->lengths);
+    free(batch->ids);
+    free(batch);
 }
 
 
-static void set_timeout(struct timespec *abstime, int seconds) {
-  clock_gettime(CLOCK_REALTIME, abstime);
-  abstime->tv_sec += seconds;
+/*
+ * Call the callback on a solution, with the original matrix, mapping its nodes there with map
+ * unless they already are (map is NULL).  Only on the calling thread.
+ */
+static void deliver_solution(ThreadControl *control, NodeMap *map, const NodeId *ids, int num_ids) {
+    Matrix *matrix = control->matrix;
+    int root = matrix->solution.num;
+    memcpy(&matrix->solution.data[root], ids, num_ids * sizeof(NodeId));
+    if (map)
+        map_nodes(map, &matrix->solution.data[root], num_ids);
+    matrix->solution.num += num_ids;
+    if (matrix->solution_callback(matrix, matrix->solution_baton))
+        atomic_store(&control->finish_all, 1);
+    matrix->solution.num = root;
 }
 
 
-/**
- * Put a message into the queue, blocking for space if necessary.  The message is copied.
+/*
+ * Take every queued batch and deliver its solutions, on the calling thread.  The mutex must be
+ * held; it is let go while the callback is called, so the other workers can carry on.
  */
-static void put_message(Queue *queue, Message *message) {
-	pthread_mutex_lock(&queue->mutex);
-	
-    while (queue->num_queued >= queue->queue_size) {
-	    thread_printf("Waiting for space on queue!\n");
-        pthread_cond_wait(&queue->space_available, &queue->mutex);
+static void deliver_batches(ThreadControl *control) {
+    SolutionBatch *batches = control->queue_head;
+    control->queue_head = NULL;
+    control->queue_tail = NULL;
+    atomic_store(&control->num_queued, 0);
+    pthread_cond_broadcast(&control->changed);
+    pthread_mutex_unlock(&control->mutex);
+
+    SolutionBatch *batch;
+    SolutionBatch *last = NULL;
+    for (batch = batches; batch; batch = batch->next) {
+        int i;
+        int start = 0;
+        for (i = 0; i < batch->num_solutions && !atomic_load(&control->finish_all); i++) {
+            deliver_solution(control, NULL, &batch->ids[start], batch->lengths[i]);
+            start += batch->lengths[i];
+        }
+        batch->num_solutions = 0;
+        batch->num_ids = 0;
+        last = batch;
     }
 
-    queue->queue[(queue->queue_start + queue->num_queued) % queue->queue_size] = *message;
-	queue->num_queued++;
-    thread_printf("Put one message, queue size is now %d\n", queue->num_queued);
+    pthread_mutex_lock(&control->mutex);
+    if (last) {
+        last->next = control->spare_batches;
+        control->spare_batches = batches;
+    }
+}
+
+
+/* Queue the worker's batch for the calling thread, and start another.  The mutex must be held. */
+static void queue_batch(ThreadData *data) {
+    ThreadControl *control = data->control;
+    SolutionBatch *batch = data->batch;
+    if (batch->num_solutions == 0)
+        return;
 
-    if (queue->num_queued == 1) {
-        thread_printf("Signalling that a message is now available\n");
-        pthread_cond_signal(&queue->message_available);
+    while (atomic_load(&control->num_queued) >= QUEUED_BATCHES * control->num_threads && !atomic_load(&control->finish_all))
+        pthread_cond_wait(&control->changed, &control->mutex);
+    if (atomic_load(&control->finish_all)) {
+        batch->num_solutions = 0;
+        batch->num_ids = 0;
+        return;
     }
-	
-	pthread_mutex_unlock(&queue->mutex);
+
+    batch->next = NULL;
+    if (control->queue_tail)
+        control->queue_tail->next = batch;
+    else
+        control->queue_head = batch;
+    control->queue_tail = batch;
+    atomic_fetch_add(&control->num_queued, 1);
+    control->num_batches++;
+    pthread_cond_broadcast(&control->changed);
+
+    if (control->spare_batches) {
+        data->batch = control->spare_batches;
+        control->spare_batches = data->batch->next;
+    } else {
+        data->batch = create_batch(control);
+    }
+}
+
+
+/*
+ * On the calling thread, deliver any batches the other workers have queued.  The count is checked
+ * without the mutex, so that it's only taken when there is something to deliver.
+ */
+static void check_batches(ThreadData *data) {
+    ThreadControl *control = data->control;
+    if (data->worker_id != 0 || !atomic_load(&control->num_queued))
+        return;
+    pthread_mutex_lock(&control->mutex);
+    deliver_batches(control);
+    pthread_mutex_unlock(&control->mutex);
 }
 
 
 /**
- * Get a message from the queue.  Returns FALSE if no messages are available.
- * The message is copied and removed from the queue.
+ * Found a solution in this thread.  The calling thread delivers it straight away; the others add
+ * it to their batch.
  */
-static int get_message(Queue *queue, Message *message) {
-    pthread_mutex_lock(&queue->mutex);
-    
-    if (queue->num_queued <= 0) {
-        thread_printf("Waiting for message on queue!\n");
-        pthread_cond_wait(&queue->message_available, &queue->mutex);
+static int thread_solution(Matrix *matrix, ThreadData *data) {
+    ThreadControl *control = data->control;
+    NodeId *ids = &matrix->solution.data[data->root];
+    int num_ids = matrix->solution.num - data->root;
+
+    if (data->worker_id == 0) {
+        check_batches(data);
+        if (!atomic_load(&control->finish_all))
+            deliver_solution(control, data->node_map, ids, num_ids);
+        return atomic_load(&control->finish_all);
     }
 
-    assert(queue->num_queued > 0);
+    SolutionBatch *batch = data->batch;
+    if (batch->num_solutions == BATCH_SOLUTIONS || batch->num_ids + num_ids > control->batch_ids) {
+        pthread_mutex_lock(&control->mutex);
+        queue_batch(data);
+        pthread_mutex_unlock(&control->mutex);
+        batch = data->batch;
+    }
+    memcpy(&batch->ids[batch->num_ids], ids, num_ids * sizeof(NodeId));
+    map_nodes(data->node_map, &batch->ids[batch->num_ids], num_ids);
+    batch->lengths[batch->num_solutions++] = num_ids;
+    batch->num_ids += num_ids;
+    return atomic_load(&control->finish_all);
+}
 
-    *message = queue->queue[queue->queue_start];
-    queue->queue_start = (queue->queue_start + 1) % queue->queue_size;
-    queue->num_queued--;
-    thread_printf("Got one message, queue size is now %d\n", queue->num_queued);
 
-    if (queue->num_queued == queue->queue_size - 1) {
-        thread_printf("Signalling that space is now available\n");
-        pthread_cond_signal(&queue->space_available);
+/**
+ * Answer the worker asking this one for work, with the shallowest branch the cursor has yet to
+ * try, or refuse it if there is none.
+ */
+static void answer_request(ThreadData *data, SearchCursor *cursor) {
+    ThreadControl *control = data->control;
+    pthread_mutex_lock(&control->mutex);
+
+    ThreadData *thief = data->thief;
+    if (thief) {
+        int num_steps = split_search(cursor, &thief->task[data->task_length]);
+        if (num_steps > 0) {
+            memcpy(thief->task, data->task, data->task_length * sizeof(SearchStep));
+            thief->task_length = data->task_length + num_steps;
+            thief->has_task = 1;
+            thief->busy = 1;
+            control->num_busy++;
+            thread_printf("Handed a task of depth %d to worker %d\n", thief->task_length, thief->worker_id);
+        } else {
+            thief->refused = 1;
+        }
+        thief->victim = NULL;
+        data->thief = NULL;
+        pthread_cond_broadcast(&control->changed);
     }
+    atomic_store(&data->work_requested, 0);
 
-    pthread_mutex_unlock(&queue->mutex);
-    
-    return 1;
+    pthread_mutex_unlock(&control->mutex);
 }
 
 
-#define MIN2(a,b) ((a) < (b) ? (a) : (b))
-#define MIN3(a,b,c) MIN2(MIN2((a),(b)), (c))
-
-
-static int get_messages(Queue *queue, Message *message, int max, int timeout) {
-    pthread_mutex_lock(&queue->mutex);
-    
-    if (queue->num_queued <= 0) {
-        thread_printf("Waiting for message on queue!\n");
-        struct timespec abstime;
-        set_timeout(&abstime, timeout);
-        //pthread_cond_timedwait(&queue->message_available, &queue->mutex, &abstime);
-        pthread_cond_wait(&queue->message_available, &queue->mutex);
+/* Search below the cutoff, keeping the statistics of the search so far. */
+static int search_rest(ThreadData *data) {
+    Matrix *matrix = data->matrix;
+    if (data->bits) {
+        reset_bits(data->bits);
+        int i;
+        for (i = data->root; i < matrix->solution.num; i++)
+            choose_bits_row(data->bits, matrix->solution.data[i]);
+        return search_bits(data->bits);
     }
-
-    if (queue->num_queued <= 0) {
-        thread_printf("Timed out waiting for messages\n");
-        pthread_mutex_unlock(&queue->mutex);
-        return 0;
+    if (data->cells) {
+        /* Only the rows that differ from the last branch's are put back and chosen again. */
+        CellsMatrix *cells = data->cells;
+        int num_rows = matrix->solution.num - data->root;
+        int i = 0;
+        while (i < cells->num_chosen && i < num_rows
+                && cells->cell_node[cells->chosen[i]] == matrix->solution.data[data->root + i])
+            i++;
+        while (cells->num_chosen > i)
+            unchoose_cells_row(cells);
+        for (; i < num_rows; i++)
+            choose_cells_row(cells, matrix->solution.data[data->root + i]);
+        return search_cells(cells);
     }
 
-    /* Copy as many continguous messages as we can into the buffer (we don't try to follow
-       wraparound). */
-    int num_to_copy = MIN3(queue->num_queued, queue->queue_size - queue->queue_start, max);
-    assert(num_to_copy > 0);
-    memcpy(message, &queue->queue[queue->queue_start], num_to_copy * sizeof(Message));
+    long int num_solutions = matrix->num_solutions;
+    long int search_calls = matrix->search_calls;
+    int result = search_matrix(matrix, 0);
+    matrix->num_solutions += num_solutions;
+    matrix->search_calls += search_calls;
+    return result;
+}
+
+
+/* Search a whole branch, timing it for the adaptive depth and the histogram. */
+static int search_whole_branch(ThreadData *data) {
+    double start = thread_cpu_time();
 
-    queue->queue_start = (queue->queue_start + num_to_copy) % queue->queue_size;
-    queue->num_queued -= num_to_copy;
-    thread_printf("Got %d messages, queue size is now %d\n", num_to_copy, queue->num_queued);
+    int result = search_rest(data);
 
-    if (queue->num_queued + num_to_copy == queue->queue_size) {
-        thread_printf("Signalling that space is now available\n");
-        pthread_cond_broadcast(&queue->space_available);
+    double time = thread_cpu_time() - start;
+    data->whole_time += time;
+    if (data->estimate > 0) {
+        data->probed_estimate += data->estimate;
+        data->probed_time += time;
     }
-    
-    pthread_mutex_unlock(&queue->mutex);
-    
-    return num_to_copy;
-}
+    data->num_whole_branches++;
 
+    int bin = 0;
+    double limit;
+    for (limit = 1E-5; time >= limit && bin < NUM_BRANCH_TIMES - 1; limit *= 10)
+        bin++;
+    data->branch_times[bin]++;
 
-/**
- * Found a solution in this thread; put it in a message to send back to the main thread.
- */
-static int thread_solution(Matrix *matrix, ThreadData *data) {
-    //thread_printf("Solution in worker %d!\n", data->worker_id);
-    Message message;
-    message.type = MT_SOLUTION;
-    message.worker_data = data;
-    //TODO set solution
-    //put_message(&data->control->queue, &message);
-    return data->control->finish_all;
+    return result;
 }
 
 
-static void process_messages(Matrix *matrix, ThreadControl *control) {
-    #define NUM_TO_PROCESS 20
-    #define MESSAGE_TIMEOUT 1
-    Message messages[NUM_TO_PROCESS];
-    int num_messages = get_messages(&control->queue, messages, NUM_TO_PROCESS, MESSAGE_TIMEOUT);
-    if (num_messages == 0)
-        return;
-
-    matrix->num_messages += num_messages;
-    thread_printf("Processing %d messages\n", num_messages);
+/*
+ * Whether the branch at a cutoff is expected to take long enough to be worth sharing.  One probe
+ * usually comes out far too low for a big branch (most paths die out early), and too low is the
+ * costly mistake, so the branch is shared if any of a few probes says it should be; otherwise the
+ * largest is kept for timing the branch.  A probe costs as much as a path down the tree, which in
+ * a deep tree with slow nodes can be more than the branches it's for, so each probe stops once it
+ * has an answer, and the probes have a budget.
+ */
+static int worth_sharing(ThreadData *data) {
+    double node_time = DEFAULT_NODE_TIME;
+    if (data->probed_estimate > 0)
+        node_time = data->probed_time / data->probed_estimate;
+    double limit = TARGET_BRANCH_TIME / node_time;
 
+    data->estimate = 0;
     int i;
-    for (i = 0; i < num_messages; i++) {
-        Message *message = &messages[i];
-        ThreadData *thread_data = message->worker_data;
-        switch (message->type) {
-            case MT_READY: {
-                thread_printf("Received ready message from worker %d\n", thread_data->worker_id);
-
-                thread_data->next_ready_thread = control->first_ready_thread;
-                control->first_ready_thread = message->worker_data;
-            } break;
-
-            case MT_SOLUTION: {
-                thread_printf("Received solution message from worker %d\n", thread_data->worker_id);
-            
-                //if (!finish_all)
-                //    finish_all |= matrix->solution_callback(matrix, matrix->solution_baton);
-            } break;
-
-            case MT_WORK_DONE: {
-                thread_printf("Received work done message from worker %d (num solutions %d, search calls %d)\n", thread_data->worker_id, message->num_solutions, message->search_calls);
-            
-                /* Copy statistics into main matrix. */
-                matrix->num_solutions += message->num_solutions;
-                matrix->search_calls += message->search_calls;
-            } break;
-
-            case MT_FINISHED: {
-                thread_printf("Received finished message from worker %d\n", thread_data->worker_id);
-            } break;
+    for (i = 0; i < NUM_PROBES; i++) {
+        if (data->probe_time > TARGET_BRANCH_TIME + data->whole_time * PROBE_SHARE) {
+            data->estimate = 0;
+            return 0;
         }
+        double start = thread_cpu_time();
+        double estimate = estimate_search(data->matrix, 1, limit, &data->seed);
+        data->probe_time += thread_cpu_time() - start;
+        if (estimate > limit)
+            return 1;
+        if (estimate > data->estimate)
+            data->estimate = estimate;
     }
+    return 0;
 }
 
 
-static ThreadData *wait_for_ready_thread(Matrix *matrix, ThreadControl *control) {
-    thread_printf("Waiting for ready thread\n");
-    while (!control->first_ready_thread) {
-        process_messages(matrix, control);
+/* Advance a task's cursor to the end, sharing its branches or searching them whole. */
+static int search_task_branches(ThreadData *data, SearchCursor *cursor) {
+    ThreadControl *control = data->control;
+    Matrix *matrix = data->matrix;
+    cursor->interrupt = &data->work_requested;
+    int adaptive = control->depth_cutoff == ADAPTIVE_DEPTH;
+    cursor->max_depth = control->depth_cutoff - data->task_length;
+    if (adaptive || cursor->max_depth < 0)
+        cursor->max_depth = 0;
+
+    int result = 0;
+    CursorState state;
+    while (!result && !atomic_load(&control->finish_all) && (state = search_advance(cursor)) != CURSOR_DONE) {
+        check_batches(data);
+        if (state == CURSOR_SOLUTION) {
+            result = report_solution(matrix);
+        } else if (state == CURSOR_CUTOFF) {
+            if (adaptive && (cursor->depth == 0 || worth_sharing(data))) {
+                search_descend(cursor);
+                data->num_shared_branches++;
+            } else {
+                result = search_whole_branch(data);
+            }
+        } else {
+            answer_request(data, cursor);
+        }
     }
-    ThreadData *thread_data = control->first_ready_thread;
-    control->first_ready_thread = thread_data->next_ready_thread;
-    return thread_data;
+    return result;
 }
 
 
-/**
- * Reached depth level; need to hand rest of this tree to a thread.
- */
-static int start_thread_search(Matrix *matrix, ThreadControl *control) {
-    /* First wait for a ready threadfree. */
-    ThreadData *thread_data = wait_for_ready_thread(matrix, control);
-    if (!thread_data)
-        return 1;
-    
-    /* Make a clone of the current matrix for the thread to use. */
-    thread_printf("Assigning subsearch %d to worker %d\n", matrix->num_subsearches, thread_data->worker_id);
-    
-    Matrix *submatrix = clone_matrix(matrix);
-    thread_printf("Cloned matrix to %p\n", submatrix);
-    
-    submatrix->solution_callback = (Callback) thread_solution;
-    submatrix->solution_baton = thread_data;
-    
-    pthread_mutex_lock(&thread_data->mutex);
-    thread_data->matrix = submatrix;
-    pthread_cond_signal(&thread_data->work_available);
-    pthread_mutex_unlock(&thread_data->mutex);
-    thread_printf("Signaled worker %d\n", thread_data->worker_id);
-
-    matrix->num_subsearches++;
-    
-    return 0;
-}
+static void search_task(ThreadData *data) {
+    ThreadControl *control = data->control;
+    Matrix *matrix = data->matrix;
+    thread_printf("Searching a task of depth %d\n", data->task_length);
+    double search_start = thread_cpu_time();
 
+    int mark = matrix_mark(matrix);
+    choose_steps(matrix, data->task, data->task_length);
 
-static void send_ready(ThreadData *data) {
-    Message message;
-    message.type = MT_READY;
-    message.worker_data = data;
-    put_message(&data->control->queue, &message);
-}
+    int result;
+    SearchCursor *cursor = search_begin(matrix);
+    if (cursor) {
+        result = search_task_branches(data, cursor);
+        search_end(cursor);
+    } else {
+        /* There's no cursor with column bounds, so the task is searched whole, and not shared. */
+        matrix->search_calls = 0;
+        matrix->num_solutions = 0;
+        data->estimate = 0;
+        result = search_whole_branch(data);
+    }
+    if (result)
+        atomic_store(&control->finish_all, 1);
 
+    matrix_rollback(matrix, mark);
 
-static void send_work_done(ThreadData *data) {
-    Message message;
-    message.type = MT_WORK_DONE;
-    message.worker_data = data;
-    message.num_solutions = data->matrix->num_solutions;
-    message.search_calls = data->matrix->search_calls;
-    put_message(&data->control->queue, &message);
+    data->num_solutions += matrix->num_solutions;
+    data->search_calls += matrix->search_calls;
+    data->num_tasks++;
+    data->search_time += thread_cpu_time() - search_start;
 }
 
 
-static void send_finished(ThreadData *data) {
-    Message message;
-    message.type = MT_FINISHED;
-    message.worker_data = data;
-    put_message(&data->control->queue, &message);
+/* Pick a busy worker that isn't already being asked for work, taking each in turn. */
+static ThreadData *choose_victim(ThreadData *data) {
+    ThreadControl *control = data->control;
+    int i;
+    for (i = 0; i < control->num_threads; i++) {
+        ThreadData *victim = &control->threads[(data->next_victim + i) % control->num_threads];
+        if (victim != data && victim->busy && !victim->thief) {
+            data->next_victim = victim->worker_id + 1;
+            return victim;
+        }
+    }
+    return NULL;
 }
 
 
 static void *thread_worker(ThreadData *data) {
+    ThreadControl *control = data->control;
     pthread_setspecific(worker_id_key, data);
 
-    do {
-        /* Wait for the main thread to give us work (or tell us to exit). */
-	    thread_printf("Waiting for work\n");
-        pthread_mutex_lock(&data->mutex);
-        send_ready(data);
-        pthread_cond_wait(&data->work_available, &data->mutex);
-        pthread_mutex_unlock(&data->mutex);
-	
-        if (data->matrix) {
-	        thread_printf("Received work\n");
-	        search_matrix_internal(data->matrix, 0, INT_MAX);
-	        thread_printf("Finished work\n");
-	        send_work_done(data);
-	        thread_printf("Destroying matrix %p\n", data->matrix);
-	        destroy_matrix(data->matrix);
-            data->matrix = NULL;
+    pthread_mutex_lock(&control->mutex);
+    for (;;) {
+        if (data->worker_id == 0 && control->queue_head) {
+            deliver_batches(control);
+            continue;
         }
-    } while (!data->finish);
-    
-    thread_printf("Shutting down\n");
-    send_finished(data);
 
+        if (data->has_task) {
+            data->has_task = 0;
+            pthread_mutex_unlock(&control->mutex);
+            search_task(data);
+            pthread_mutex_lock(&control->mutex);
+
+            /* The solutions go before the worker stops being busy, so none are left behind. */
+            if (data->batch)
+                queue_batch(data);
+
+            /* Nothing is left to hand over. */
+            if (data->thief) {
+                data->thief->refused = 1;
+                data->thief->victim = NULL;
+                data->thief = NULL;
+            }
+            atomic_store(&data->work_requested, 0);
+            data->busy = 0;
+            control->num_busy--;
+            pthread_cond_broadcast(&control->changed);
+            continue;
+        }
+
+        if (control->num_busy == 0 || atomic_load(&control->finish_all))
+            break;
+
+        if (data->victim) {
+            pthread_cond_wait(&control->changed, &control->mutex);
+        } else if (data->refused) {
+            /* Give the workers a moment to get to branches that can be split. */
+            data->refused = 0;
+            struct timespec abstime;
+            clock_gettime(CLOCK_REALTIME, &abstime);
+            abstime.tv_nsec += REFUSED_WAIT_NS;
+            if (abstime.tv_nsec >= 1000000000) {
+                abstime.tv_sec++;
+                abstime.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&control->changed, &control->mutex, &abstime);
+        } else {
+            ThreadData *victim = choose_victim(data);
+            if (victim) {
+                thread_printf("Asking worker %d for work\n", victim->worker_id);
+                victim->thief = data;
+                atomic_store(&victim->work_requested, 1);
+                data->victim = victim;
+                control->num_requests++;
+            } else {
+                pthread_cond_wait(&control->changed, &control->mutex);
+            }
+        }
+    }
+    pthread_cond_broadcast(&control->changed);
+    pthread_mutex_unlock(&control->mutex);
+
+    thread_printf("Shutting down\n");
     return NULL;
 }
 
 
+/**
+ * Search with num_threads workers, including the calling thread.  Branches in the top
+ * depth_cutoff levels (below any rows already chosen) are shared among the workers as they
+ * become idle; 0 means none are, and ADAPTIVE_DEPTH means the branches expected to take longer
+ * than TARGET_BRANCH_TIME are.  Matrices with column bounds are searched by one worker.
+ */
 int search_with_threads(Matrix *matrix, int depth_cutoff, int num_threads) {
     if (!worker_id_key) {
 	    pthread_key_create(&worker_id_key, NULL);
     }
 
+    matrix->search_calls = 0;
+    matrix->num_solutions = 0;
     matrix->num_messages = 0;
     matrix->num_subsearches = 0;
-    
+    matrix->clone_time = 0;
+    matrix->subsearch_time = 0;
+    matrix->num_shared_branches = 0;
+    matrix->num_whole_branches = 0;
+    matrix->probe_time = 0;
+    matrix->num_batches = 0;
+    memset(matrix->branch_times, 0, sizeof(matrix->branch_times));
+    EXTARRAY_ENSURE(matrix->solution, matrix->num_rows);
+
     ThreadControl control;
     memset(&control, 0, sizeof(control));
-
-    control.num_threads = num_threads;
-
-    init_queue(&control.queue, num_threads * QUEUE_SIZE_PER_THREAD);
-
-    /* Create some threads. */
-    control.threads = calloc(num_threads, sizeof(ThreadData));
+    control.num_threads = num_threads > 0 ? num_threads : 1;
+    control.depth_cutoff = depth_cutoff;
+    control.matrix = matrix;
+    control.batch_ids = matrix->num_columns + 1 > BATCH_IDS ? matrix->num_columns + 1 : BATCH_IDS;
+    /* There is nobody to share with. */
+    if (control.num_threads == 1 && depth_cutoff == ADAPTIVE_DEPTH)
+        control.depth_cutoff = 0;
+    pthread_mutex_init(&control.mutex, NULL);
+    pthread_cond_init(&control.changed, NULL);
+
+    control.threads = calloc(control.num_threads, sizeof(ThreadData));
     int i;
     for (i = 0; i < control.num_threads; i++) {
         ThreadData *data = &control.threads[i];
-        data->worker_id = i+1;
+        data->worker_id = i;
         data->control = &control;
-        pthread_mutex_init(&data->mutex, NULL);
-        pthread_cond_init(&data->work_available, NULL);
-        pthread_create(&data->thread, NULL, (void *(*)(void*))thread_worker, data);
-        thread_printf("Created thread %d as %p\n", data->worker_id, (void *) data->thread);
+        data->next_victim = i + 1;
+        data->seed = i + 1;
+        /* Every level of the search covers a primary column. */
+        data->task = malloc((matrix->num_columns + 1) * sizeof(SearchStep));
+
+        double clone_start = thread_cpu_time();
+        data->matrix = clone_matrix(matrix);
+        if (matrix->engine == ENGINE_AUTO || matrix->engine == ENGINE_BITS)
+            data->bits = compile_bits(data->matrix);
+        if (data->bits && matrix->engine == ENGINE_AUTO && !prefer_bits(data->bits)) {
+            destroy_bits(data->bits);
+            data->bits = NULL;
+        }
+#if INDEX_NODES
+        if (matrix->engine == ENGINE_CELLS && !matrix->multiplicities)
+            data->cells = compile_cells(data->matrix);
+#endif
+        matrix->clone_time += thread_cpu_time() - clone_start;
+        data->root = matrix->solution.num;
+        data->node_map = create_node_map(data->matrix, matrix);
+        if (i > 0)
+            data->batch = create_batch(&control);
+        data->matrix->solution_callback = (Callback) thread_solution;
+        data->matrix->solution_baton = data;
     }
-    
-    matrix->depth_callback = (Callback) start_thread_search;
-    matrix->depth_baton = &control;
+
+    /* The first worker starts with the whole search. */
+    control.threads[0].has_task = 1;
+    control.threads[0].busy = 1;
+    control.num_busy = 1;
 
     thread_printf("Beginning search\n");
-    int result = search_matrix(matrix, depth_cutoff);
+    for (i = 1; i < control.num_threads; i++) {
+        ThreadData *data = &control.threads[i];
+        pthread_create(&data->thread, NULL, (void *(*)(void*))thread_worker, data);
+        thread_printf("Created thread %d as %p\n", data->worker_id, (void *) data->thread);
+    }
+    thread_worker(&control.threads[0]);
+    pthread_setspecific(worker_id_key, NULL);
     thread_printf("Finished search\n");
-    
-    /* Process messages, and when each worker is in ready state, shut it down. */
-    for (i = 0; i < control.num_threads; i++) {
-        ThreadData *thread_data = wait_for_ready_thread(matrix, &control);
 
-        pthread_mutex_lock(&thread_data->mutex);
-        thread_data->finish = 1;
-        pthread_cond_signal(&thread_data->work_available);
-        pthread_mutex_unlock(&thread_data->mutex);
-	    thread_printf("Told worker %d to finish\n", thread_data->worker_id);
-    }
-    
     for (i = 0; i < control.num_threads; i++) {
-        ThreadData *thread_data = &control.threads[i];
-        pthread_join(thread_data->thread, NULL);
-        thread_printf("Joined worker %d\n", thread_data->worker_id);
+        ThreadData *data = &control.threads[i];
+        if (i > 0) {
+            pthread_join(data->thread, NULL);
+            thread_printf("Joined worker %d\n", data->worker_id);
+        }
 
-        pthread_mutex_destroy(&thread_data->mutex);
-        pthread_cond_destroy(&thread_data->work_available);
+        matrix->num_solutions += data->num_solutions;
+        matrix->num_symmetric_solutions += data->matrix->num_symmetric_solutions;
+        matrix->search_calls += data->search_calls;
+        matrix->num_subsearches += data->num_tasks;
+        matrix->subsearch_time += data->search_time;
+        matrix->num_shared_branches += data->num_shared_branches;
+        matrix->num_whole_branches += data->num_whole_branches;
+        matrix->probe_time += data->probe_time;
+        int j;
+        for (j = 0; j < NUM_BRANCH_TIMES; j++)
+            matrix->branch_times[j] += data->branch_times[j];
+
+        if (data->bits)
+            destroy_bits(data->bits);
+        if (data->cells)
+            destroy_cells(data->cells);
+        if (data->node_map)
+            destroy_node_map(data->node_map);
+        if (data->batch)
+            destroy_batch(data->batch);
+        destroy_matrix(data->matrix);
+        free(data->task);
+    }
+    matrix->num_messages = control.num_requests;
+    matrix->num_batches = control.num_batches;
+
+    /* Clean up; batches are left over if the search was stopped. */
+    SolutionBatch *lists[2] = { control.queue_head, control.spare_batches };
+    for (i = 0; i < 2; i++) {
+        while (lists[i]) {
+            SolutionBatch *next = lists[i]->next;
+            destroy_batch(lists[i]);
+            lists[i] = next;
+        }
     }
-
-    process_messages(matrix, &control);
-    
-    /* Clean up. */
     free(control.threads);
-    teardown_queue(&control.queue);
+    pthread_mutex_destroy(&control.mutex);
+    pthread_cond_destroy(&control.changed);
 
-    return result;
+    return atomic_load(&control.finish_all);
 }
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "basic.h"
+#include "dancing.h"
+#include "dancing_dlx.h"
+
+
+typedef struct {
+    Problem problem;
+    DlxColors colors;
+} DlxProblem;
+
+
+static void print_option_node(Matrix *matrix, DlxProblem *problem, NodeId node) {
+    printf("%s", HEADER(NODE(node).column).name);
+    int color = COLOR(node);
+    if (color < 0)
+        color = COLOR(NODE(node).column);
+    if (color)
+        printf(":%s", problem->colors.names[color - 1]);
+}
+
+
+/* Print each option in the solution on its own line, in the same form as the input. */
+static int print_dlx_solution(Matrix *matrix, DlxProblem *problem) {
+    printf("Solution:\n");
+    int i;
+    for (i = 0; i < matrix->solution.num; i++) {
+        NodeId row = matrix->solution.data[i];
+        printf("   ");
+        print_option_node(matrix, problem, row);
+        NodeId n;
+        foreachlink(row, right, n) {
+            printf(" ");
+            print_option_node(matrix, problem, n);
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
+
+
+static DlxProblem *create_dlx_problem(Options *options) {
+    FILE *file = stdin;
+    if (options->input_filename && strcmp(options->input_filename, "-") != 0) {
+        file = fopen(options->input_filename, "r");
+        if (!file) {
+            perror(options->input_filename);
+            exit(1);
+        }
+    }
+
+    DlxProblem *problem = malloc(sizeof(DlxProblem));
+    memset(problem, 0, sizeof(DlxProblem));
+
+    Matrix *matrix = read_dlx_matrix(file, &problem->colors);
+    if (file != stdin)
+        fclose(file);
+    if (!matrix)
+        exit(1);
+
+    /* The file was the matrix itself, not a batch of problems to solve against it. */
+    options->input_filename = NULL;
+
+    problem->problem.matrix = matrix;
+    matrix->solution_callback = (Callback) print_dlx_solution;
+    matrix->solution_baton = problem;
+
+    return problem;
+}
+
+
+static void destroy_dlx_problem(DlxProblem *problem) {
+    destroy_matrix(problem->problem.matrix);
+    free_dlx_colors(&problem->colors);
+    free(problem);
+}
+
+
+int main(int argc, char *argv[]) {
+    return basic_main(argc, argv, (CreateProblem *) create_dlx_problem, (DestroyProblem *) destroy_dlx_problem);
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dancing.h"
+#include "dancing_dlx.h"
+#include "dancing_stream.h"
+
+
+/*
+ * Print a solution stream written with -o as text: each solution's row numbers on a line, or, given
+ * the DLX file the solutions are for, each solution's options in the same form as dlx -s.
+ */
+
+
+static void print_help() {
+    fprintf(stderr, "Usage: dlxdecode [-f DLXFILE] [STREAM]\n"
+        "Options:\n"
+        "    -f DLXFILE    Print the options of each solution from DLXFILE (default: row numbers)\n"
+        "    STREAM        Solution stream to read (default: stdin)\n");
+    exit(1);
+}
+
+
+/* Find the first node of each row, numbering the rows as the stream does. */
+static NodeId *find_row_starts(Matrix *matrix) {
+    NodeId *row_starts = malloc(sizeof(NodeId) * (matrix->num_rows + 1));
+#if INDEX_NODES
+    char *seen = calloc(matrix->nodes.num, 1);
+    int row = 0;
+    NodeId n;
+    for (n = matrix->headers.num; n < matrix->nodes.num; n++) {
+        if (seen[n] || NODE(n).column == ROOT)
+            continue;
+        row_starts[row++] = n;
+        NodeId x;
+        foreachlink(n, right, x) {
+            seen[x] = 1;
+        }
+    }
+    free(seen);
+#else
+    fprintf(stderr, "Rows can only be numbered with INDEX_NODES\n");
+    exit(1);
+#endif
+    return row_starts;
+}
+
+
+static void print_option(Matrix *matrix, DlxColors *colors, NodeId row) {
+    NodeId n = row;
+    do {
+        if (n != row)
+            printf(" ");
+        printf("%s", HEADER(NODE(n).column).name);
+        if (COLOR(n))
+            printf(":%s", colors->names[COLOR(n) - 1]);
+        n = RIGHT(n);
+    } while (n != row);
+}
+
+
+int main(int argc, char *argv[]) {
+    char *dlx_filename = NULL;
+    char *stream_filename = NULL;
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            dlx_filename = argv[++i];
+        else if (argv[i][0] == '-' && argv[i][1])
+            print_help();
+        else
+            stream_filename = argv[i];
+    }
+
+    Matrix *matrix = NULL;
+    DlxColors colors;
+    NodeId *row_starts = NULL;
+    if (dlx_filename) {
+        FILE *dlx_file = fopen(dlx_filename, "r");
+        if (!dlx_file) {
+            perror(dlx_filename);
+            exit(1);
+        }
+        matrix = read_dlx_matrix(dlx_file, &colors);
+        fclose(dlx_file);
+        if (!matrix)
+            exit(1);
+        row_starts = find_row_starts(matrix);
+    }
+
+    FILE *file = stdin;
+    if (stream_filename && strcmp(stream_filename, "-") != 0) {
+        file = fopen(stream_filename, "rb");
+        if (!file) {
+            perror(stream_filename);
+            exit(1);
+        }
+    }
+
+    SolutionReader *reader = create_solution_reader(file);
+    if (!reader) {
+        fprintf(stderr, "Not a solution stream\n");
+        exit(1);
+    }
+
+    int result;
+    while ((result = read_solution(reader)) == 1) {
+        if (!matrix) {
+            for (i = 0; i < reader->rows.num; i++)
+                printf(i ? " %u" : "%u", reader->rows.data[i]);
+            printf("\n");
+            continue;
+        }
+
+        printf("Solution:\n");
+        for (i = 0; i < reader->rows.num; i++) {
+            if (reader->rows.data[i] >= matrix->num_rows) {
+                fprintf(stderr, "Row %u is not in %s\n", reader->rows.data[i], dlx_filename);
+                exit(1);
+            }
+            printf("   ");
+            print_option(matrix, &colors, row_starts[reader->rows.data[i]]);
+            printf("\n");
+        }
+    }
+    if (result < 0)
+        fprintf(stderr, "Warning, the stream is corrupt or cut short\n");
+
+    destroy_solution_reader(reader);
+    if (file != stdin)
+        fclose(file);
+    if (matrix) {
+        free(row_starts);
+        free_dlx_colors(&colors);
+        destroy_matrix(matrix);
+    }
+
+    return result < 0;
+}
@@ -4,6 +4,7 @@
 
 #include "basic.h"
 #include "dancing.h"
+#include "dancing_symmetry.h"
 
 
 #define BOARD_SIZE 8
@@ -101,7 +102,8 @@ static int print_pentominoes(Matrix *matrix, PentominoesProblem *problem) {
 }
 
 
-static int arrange_pentomino(Pentomino *p, int i, int j, int flip, int rotation, int board_rows, int board_cols, NodeId square_columns[8][8], NodeId *positions) {
+/* Find the columns of the squares covered by a pentomino, numbered from 1 (0 for a hole). */
+static int arrange_pentomino(Pentomino *p, int i, int j, int flip, int rotation, int board_rows, int board_cols, int square_columns[8][8], int *positions) {
     int k;
     for (k = 0; k < PENTOMINO_LENGTH; k++) {
         int r = p->r[k];
@@ -129,26 +131,27 @@ static int arrange_pentomino(Pentomino *p, int i, int j, int flip, int rotation,
         if (r < 0 || c < 0 || r >= board_rows || c >= board_cols)
             return 0;
 
-        NodeId pos = square_columns[r][c];
+        int pos = square_columns[r][c];
         if (pos == 0)
             return 0;
 
-        positions[k] = pos;
+        positions[k] = pos - 1;
     }
 
     return 1;
 }
 
 
-static PentominoesProblem *create_pentominoes_problem() {
+/*
+ * The matrix is built in one go from its rows, with room for every placement of every piece
+ * (some of which are then ruled out by the hole in the middle).  Square columns come first, and
+ * then piece columns, all primary.
+ */
+static Matrix *build_pentominoes_matrix() {
     int num_squares = BOARD_SIZE * BOARD_SIZE - 2*2;
     int num_cols = NUM_PENTOMINOES + num_squares;
     int num_rows = 0;
 
-    PentominoesProblem *problem = malloc(sizeof(PentominoesProblem));
-    memset(problem, 0, sizeof(PentominoesProblem));
-    Matrix *matrix = problem->problem.matrix = create_matrix();
-
     int i;
     for (i = 0; i < NUM_PENTOMINOES; i++) {
         Pentomino *p = &PENTOMINOES[i];
@@ -156,28 +159,28 @@ static PentominoesProblem *create_pentominoes_problem() {
     }
     int num_nodes = (PENTOMINO_LENGTH + 1) * num_rows;
 
-    NodeId square_columns[BOARD_SIZE][BOARD_SIZE];
-    NodeId piece_columns[NUM_PENTOMINOES];
-
+    int square_columns[BOARD_SIZE][BOARD_SIZE];
+    int num_columns = 0;
     for (i = 0; i < BOARD_SIZE; i++) {
         int j;
         for (j = 0; j < BOARD_SIZE; j++) {
             if (i >= 3 && i <= 4 && j >= 3 && j <= 4) {
                 square_columns[i][j] = 0;
             } else {
-                square_columns[i][j] = create_column(matrix, 1, "%d%d", i, j);
+                square_columns[i][j] = ++num_columns;
             }
         }
     }
 
-    for (i = 0; i < NUM_PENTOMINOES; i++) {
-        piece_columns[i] = create_column(matrix, 1, "%s", PENTOMINOES[i].name);
-    }
+    int *row_offsets = malloc(sizeof(int) * (num_rows + 1));
+    int *column_indices = malloc(sizeof(int) * num_nodes);
+    int num_placements = 0;
+    int num_indices = 0;
+    row_offsets[0] = 0;
 
     int pi;
     for (pi = 0; pi < NUM_PENTOMINOES; pi++) {
         Pentomino *p = &PENTOMINOES[pi];
-        NodeId piece_col = piece_columns[pi];
         int flip, rotation, i, j;
         for (flip = 0; flip < p->flips; flip++)
             for (rotation = 0; rotation < p->rotations; rotation++) {
@@ -185,26 +188,90 @@ static PentominoesProblem *create_pentominoes_problem() {
                 int maxj = BOARD_SIZE - ((rotation & 1) ? p->rows : p->cols);
                 for (i = 0; i <= maxi; i++)
                     for (j = 0; j <= maxj; j++) {
-                        NodeId positions[PENTOMINO_LENGTH];
-                        if (!arrange_pentomino(p, i, j, flip, rotation, BOARD_SIZE, BOARD_SIZE, square_columns, positions))
+                        if (!arrange_pentomino(p, i, j, flip, rotation, BOARD_SIZE, BOARD_SIZE, square_columns, &column_indices[num_indices]))
                             continue;
 
-                        NodeId node = 0;
-                        int k;
-                        for (k = 0; k < PENTOMINO_LENGTH; k++) {
-                            node = create_node(matrix, node, positions[k]);
-                        }
-                        node = create_node(matrix, node, piece_col);
-
-                        // {
-                        //     printf("%d, %d, %d, %d,     ", i, j, flip, rotation);
-                        //     print_row(node);
-                        //     printf("\n");
-                        // }
+                        num_indices += PENTOMINO_LENGTH;
+                        column_indices[num_indices++] = num_squares + pi;
+                        row_offsets[++num_placements] = num_indices;
                     }
             }
     }
 
+    Matrix *matrix = build_matrix_csr(num_cols, num_cols, num_placements, row_offsets, column_indices);
+    free(row_offsets);
+    free(column_indices);
+
+    for (i = 0; i < BOARD_SIZE; i++) {
+        int j;
+        for (j = 0; j < BOARD_SIZE; j++) {
+            if (square_columns[i][j])
+                name_column(matrix, matrix_column(matrix, square_columns[i][j] - 1), "%d%d", i, j);
+        }
+    }
+
+    for (i = 0; i < NUM_PENTOMINOES; i++) {
+        name_column(matrix, matrix_column(matrix, num_squares + i), "%s", PENTOMINOES[i].name);
+    }
+
+    return matrix;
+}
+
+
+/*
+ * The board (and so the matrix) is unchanged by rotating it a quarter turn and by reflecting it.
+ * The pieces stay put, and the rows follow the squares.
+ */
+static void add_pentominoes_symmetries(Matrix *matrix) {
+    int num_squares = BOARD_SIZE * BOARD_SIZE - 2*2;
+    int num_cols = NUM_PENTOMINOES + num_squares;
+    int positions[BOARD_SIZE][BOARD_SIZE];
+    int rotation[num_cols];
+    int reflection[num_cols];
+
+    int num_positions = 0;
+    int i, j;
+    for (i = 0; i < BOARD_SIZE; i++) {
+        for (j = 0; j < BOARD_SIZE; j++) {
+            if (i >= 3 && i <= 4 && j >= 3 && j <= 4)
+                positions[i][j] = -1;
+            else
+                positions[i][j] = num_positions++;
+        }
+    }
+
+    for (i = 0; i < BOARD_SIZE; i++) {
+        for (j = 0; j < BOARD_SIZE; j++) {
+            if (positions[i][j] == -1)
+                continue;
+            rotation[positions[i][j]] = positions[j][BOARD_SIZE - 1 - i];
+            reflection[positions[i][j]] = positions[i][BOARD_SIZE - 1 - j];
+        }
+    }
+    for (i = num_squares; i < num_cols; i++) {
+        rotation[i] = i;
+        reflection[i] = i;
+    }
+
+    if (!add_symmetry(matrix, rotation, NULL) || !add_symmetry(matrix, reflection, NULL))
+        fprintf(stderr, "Warning, could not add the board's symmetries\n");
+}
+
+
+static PentominoesProblem *create_pentominoes_problem(Options *options) {
+    PentominoesProblem *problem = malloc(sizeof(PentominoesProblem));
+    memset(problem, 0, sizeof(PentominoesProblem));
+
+    Matrix *matrix = load_cached_matrix(options, "pentominoes");
+    if (!matrix) {
+        matrix = build_pentominoes_matrix();
+        save_cached_matrix(options, matrix, "pentominoes");
+    }
+    problem->problem.matrix = matrix;
+
+    if (options->break_symmetry)
+        add_pentominoes_symmetries(matrix);
+
     matrix->solution_callback = (Callback) print_pentominoes;
     matrix->solution_baton = problem;        
 
@@ -3,6 +3,7 @@
 
 #include "basic.h"
 #include "dancing.h"
+#include "dancing_symmetry.h"
 
 
 typedef struct {
@@ -55,11 +56,8 @@ static int print_queens(Matrix *matrix, QueensProblem *problem) {
 }
 
 
-static QueensProblem *create_queens_problem(Options *options) {
-    QueensProblem *problem = malloc(sizeof(QueensProblem));
-    memset(problem, 0, sizeof(QueensProblem));
-    Matrix *matrix = problem->problem.matrix = create_matrix();
-    int size = problem->size = options->problem_size;
+static Matrix *build_queens_matrix(int size) {
+    Matrix *matrix = create_matrix();
 
     NodeId r_cols[size];
     NodeId f_cols[size];
@@ -96,6 +94,56 @@ static QueensProblem *create_queens_problem(Options *options) {
         }
     }
 
+    return matrix;
+}
+
+
+/*
+ * The board is unchanged by rotating it a quarter turn, which takes rank i to file n-1-i and file
+ * j to rank j, and by reflecting it left to right.  Columns are ranks, files, then the two sets
+ * of diagonals, as build_queens_matrix creates them.
+ */
+static void add_queens_symmetries(Matrix *matrix, int size) {
+    int num_diagonals = 2 * size - 1;
+    int r = 0, f = size, a = 2 * size, b = 2 * size + num_diagonals;
+    int num_cols = 2 * size + 2 * num_diagonals;
+    int rotation[num_cols];
+    int reflection[num_cols];
+
+    int i;
+    for (i = 0; i < size; i++) {
+        rotation[r + i] = f + size - 1 - i;
+        rotation[f + i] = r + i;
+        reflection[r + i] = r + i;
+        reflection[f + i] = f + size - 1 - i;
+    }
+    for (i = 0; i < num_diagonals; i++) {
+        rotation[a + i] = b + num_diagonals - 1 - i;
+        rotation[b + i] = a + i;
+        reflection[a + i] = b + num_diagonals - 1 - i;
+        reflection[b + i] = a + num_diagonals - 1 - i;
+    }
+
+    if (!add_symmetry(matrix, rotation, NULL) || !add_symmetry(matrix, reflection, NULL))
+        fprintf(stderr, "Warning, could not add the board's symmetries\n");
+}
+
+
+static QueensProblem *create_queens_problem(Options *options) {
+    QueensProblem *problem = malloc(sizeof(QueensProblem));
+    memset(problem, 0, sizeof(QueensProblem));
+    int size = problem->size = options->problem_size;
+
+    Matrix *matrix = load_cached_matrix(options, "queens-%d", size);
+    if (!matrix) {
+        matrix = build_queens_matrix(size);
+        save_cached_matrix(options, matrix, "queens-%d", size);
+    }
+    problem->problem.matrix = matrix;
+
+    if (options->break_symmetry)
+        add_queens_symmetries(matrix, size);
+
     matrix->solution_callback = (Callback) print_queens;
     matrix->solution_baton = problem;        
 
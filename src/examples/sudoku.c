@@ -1,13 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "basic.h"
 #include "dancing.h"
+#include "dancing_bits.h"
 
 
 typedef struct {
     Problem problem;
     int size;
+    int block_size;
+    char *symbols;
+    NodeId *rows;            /* Row for each cell and symbol. */
+    char *board;             /* Puzzle being solved in batch mode. */
+    int symbol_number[256];  /* Number of each character as a symbol in batch mode, or -1. */
 } SudokuProblem;
 
 
@@ -70,19 +77,151 @@ static void prespecify_sudoku_cell(Matrix *matrix, int row_num, int column_num,
 }
 
 
-static SudokuProblem *create_sudoku_problem(Options *options) {
-    SudokuProblem *problem = malloc(sizeof(SudokuProblem));
-    memset(problem, 0, sizeof(SudokuProblem));
-    Matrix *matrix = problem->problem.matrix = create_matrix();
-    int size = problem->size = options->problem_size;
+/*
+ * Fill in the board from the first solution and stop.  Columns are numbered in the order they were
+ * created, so the cell comes from the row's X column and the symbol from its R column.
+ */
+static int fill_sudoku(Matrix *matrix, SudokuProblem *problem) {
+    int size = problem->size;
+    int num_cells = size * size;
+    int i;
+    for (i = 0; i < matrix->solution.num; i++) {
+        int cell = -1, symbol = -1;
+        NodeId n = matrix->solution.data[i];
+        do {
+            int index = HEADER(NODE(n).column).index - 1;
+            if (index < num_cells)
+                cell = index;
+            else if (index < 2 * num_cells)
+                symbol = (index - num_cells) % size;
+            n = RIGHT(n);
+        } while (n != matrix->solution.data[i]);
+        problem->board[cell] = problem->symbols[symbol];
+    }
 
-    if (size != 4 && size != 9 && size != 16) {
-        fprintf(stderr, "Size must be one of 4, 9, or 16!\n");
-        exit(1);
+    return 1;
+}
+
+
+/*
+ * Read the givens of a puzzle as the number of each cell's symbol, or -1 for an empty cell, and
+ * the symbols (as bits) used in each row, column and block.  Returns 0 if two of them clash (the
+ * same symbol twice in a row, column or block).
+ */
+static int read_sudoku_givens(SudokuProblem *problem, const char *line, int *givens, unsigned int *used) {
+    int size = problem->size;
+    int block_size = problem->block_size;
+    int i;
+    memset(used, 0, sizeof(unsigned int) * 3 * size);
+    for (i = 0; i < size * size; i++) {
+        givens[i] = problem->symbol_number[(unsigned char) line[i]];
+        if (givens[i] < 0)
+            continue;
+
+        unsigned int bit = 1u << givens[i];
+        int row = i / size, col = i % size;
+        int block = (row / block_size) * block_size + col / block_size;
+        if ((used[row] | used[size + col] | used[2 * size + block]) & bit)
+            return 0;
+        used[row] |= bit;
+        used[size + col] |= bit;
+        used[2 * size + block] |= bit;
+    }
+    return 1;
+}
+
+
+/**
+ * Solve one puzzle per line, given as the symbols of each cell in turn with '.' (or '0' for 9x9)
+ * for an empty cell, and print each solution in the same format if printing solutions.  A puzzle
+ * whose givens clash, or that has no solution, is reported with its line number instead.
+ *
+ * The matrix of the empty grid is built once.  By default (and with the bits engine) it is
+ * compiled into bitsets once, and for each puzzle the givens are chosen in it before searching
+ * and reset afterwards; the other engines choose them in the linked matrix and roll them back.
+ */
+static void solve_sudoku_file(SudokuProblem *problem, Options *options, FILE *file) {
+    Matrix *matrix = problem->problem.matrix;
+    int size = problem->size;
+    int num_cells = size * size;
+
+    int i;
+    for (i = 0; i < 256; i++)
+        problem->symbol_number[i] = -1;
+    for (i = 0; i < size; i++)
+        problem->symbol_number[(unsigned char) problem->symbols[i]] = i;
+
+    BitsMatrix *bits = NULL;
+    if (matrix->engine == ENGINE_AUTO || matrix->engine == ENGINE_BITS)
+        bits = compile_bits(matrix);
+
+    matrix->solution_callback = (Callback) fill_sudoku;
+    EXTARRAY_ENSURE(matrix->solution, matrix->num_rows);
+    int mark = matrix_mark(matrix);
+
+    char line[1024];
+    char board[16 * 16 + 2];
+    int givens[16 * 16];
+    unsigned int used[3 * 16];
+    int line_number = 0;
+    problem->board = board;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        if (strcspn(line, "\r\n") < num_cells || line[0] == '#')
+            continue;
+
+        problem->problem.num_problems++;
+        if (!read_sudoku_givens(problem, line, givens, used)) {
+            fprintf(stderr, "Line %d: The givens clash\n", line_number);
+            continue;
+        }
+
+        memcpy(board, line, num_cells);
+        board[num_cells] = '\n';
+        board[num_cells + 1] = '\0';
+
+        long int num_solutions = matrix->num_solutions;
+        if (bits)
+            reset_bits(bits);
+        for (i = 0; i < num_cells; i++) {
+            if (givens[i] < 0)
+                continue;
+            NodeId row = problem->rows[i * size + givens[i]];
+            if (bits)
+                choose_bits_row(bits, row);
+            else
+                choose_row(matrix, row);
+        }
+
+        if (bits) {
+            search_bits(bits);
+        } else {
+            /* Searching resets the statistics, which are kept for the whole file. */
+            long int search_calls = matrix->search_calls;
+            search_matrix(matrix, 0);
+            matrix->num_solutions += num_solutions;
+            matrix->search_calls += search_calls;
+            matrix_rollback(matrix, mark);
+        }
+
+        if (matrix->num_solutions > num_solutions) {
+            problem->problem.num_solved++;
+            if (options->print_solution)
+                fputs(board, stdout);
+        } else {
+            fprintf(stderr, "Line %d: No solution\n", line_number);
+        }
     }
 
-    int block_size = (size == 4) ? 2 : (size == 9) ? 3 : 4;
-    char *symbols = (size == 4) ? "abcd" : (size == 9) ? "123456789" : "0123456789abcdef";
+    if (bits)
+        destroy_bits(bits);
+}
+
+
+static Matrix *build_sudoku_matrix(SudokuProblem *problem, int block_size) {
+    Matrix *matrix = create_matrix();
+    int size = problem->size;
+    char *symbols = problem->symbols;
     int num_symbols = size;
 
     NodeId spot_headers[16][16];
@@ -121,6 +260,7 @@ static SudokuProblem *create_sudoku_problem(Options *options) {
                 NodeId c_col = column_headers[j][k];
                 NodeId b_col = block_headers[i/block_size][j/block_size][k];
                 NodeId node = create_node(matrix, 0, x_col);
+                problem->rows[(i * size + j) * num_symbols + k] = node;
                 node = create_node(matrix, node, r_col);
                 node = create_node(matrix, node, c_col);
                 node = create_node(matrix, node, b_col);
@@ -128,43 +268,90 @@ static SudokuProblem *create_sudoku_problem(Options *options) {
         }
     }
 
-    matrix->solution_callback = (Callback) print_sudoku;
-    matrix->solution_baton = problem;        
+    return matrix;
+}
 
-    /* Prespecify the first row (without loss of generality). */
-    for (i = 0; i < size; i++) {
-        prespecify_sudoku_cell(matrix, 0, i, symbols[i]);
-        prespecify_sudoku_cell(matrix, 1, i, symbols[(i + 3) % 9]);
-        prespecify_sudoku_cell(matrix, 2, i, symbols[(i + 6) % 9]);
-    }
-    for (i = 3; i < 6; i++) {
-        prespecify_sudoku_cell(matrix, i, 0, symbols[(i * 3 + 1) % 9]);
-        prespecify_sudoku_cell(matrix, i, 1, symbols[(i * 3 + 2) % 9]);
-        prespecify_sudoku_cell(matrix, i, 2, symbols[(i * 3 + 3) % 9]);
+
+/* Find the row for each cell and symbol in a cached matrix, from its X and R columns. */
+static void find_sudoku_rows(SudokuProblem *problem, Matrix *matrix) {
+    int size = problem->size;
+    int num_cells = size * size;
+    int cell, k;
+    for (cell = 0; cell < num_cells; cell++) {
+        for (k = 0; k < size; k++) {
+            NodeId columns[2];
+            columns[0] = matrix_column(matrix, cell);
+            columns[1] = matrix_column(matrix, num_cells + (cell / size) * size + k);
+            problem->rows[cell * size + k] = find_row(matrix, columns, 2);
+        }
     }
-    
+}
 
-    return problem;
+
+#if INDEX_NODES
+static void renumber_sudoku_rows(SudokuProblem *problem, const NodeId *remap) {
+    int i;
+    for (i = 0; i < problem->size * problem->size * problem->size; i++)
+        problem->rows[i] = remap[problem->rows[i]];
 }
+#endif
 
 
-/*static void read_start_file(char *filename, SudokuProblem *problem, Matrix *matrix) {
-    char *board = calloc(problem->size * problem->size, sizeof(int));
+static SudokuProblem *create_sudoku_problem(Options *options) {
+    SudokuProblem *problem = malloc(sizeof(SudokuProblem));
+    memset(problem, 0, sizeof(SudokuProblem));
+    int size = problem->size = options->problem_size;
 
-    int i;
-    for (i = 0; i < problem->size; i++) {
-        int j;
-        for (int j = 0; i < problem->size; i++) {
-            int ch = fgetc(stdin);
+    if (size != 4 && size != 9 && size != 16) {
+        fprintf(stderr, "Size must be one of 4, 9, or 16!\n");
+        exit(1);
+    }
+
+    int block_size = problem->block_size = (size == 4) ? 2 : (size == 9) ? 3 : 4;
+    char *symbols = problem->symbols = (size == 4) ? "abcd" : (size == 9) ? "123456789" : "0123456789abcdef";
+    problem->rows = malloc(size * size * size * sizeof(NodeId));
+
+    /* The cached matrix is the empty grid; the first band is prespecified afterwards. */
+    Matrix *matrix = load_cached_matrix(options, "sudoku-%d", size);
+    if (matrix) {
+        find_sudoku_rows(problem, matrix);
+    } else {
+        matrix = build_sudoku_matrix(problem, block_size);
+        save_cached_matrix(options, matrix, "sudoku-%d", size);
+    }
+    problem->problem.matrix = matrix;
+
+    int i, j;
+    matrix->solution_callback = (Callback) print_sudoku;
+    matrix->solution_baton = problem;        
+#if INDEX_NODES
+    problem->problem.renumber = (void *) renumber_sudoku_rows;
+#endif
+
+    if (options->input_filename) {
+        problem->problem.solve_file = (void *) solve_sudoku_file;
+        return problem;
+    }
+
+    /*
+     * Prespecify the first band and the block below its first block (without loss of generality).
+     * For 9x9 that is 36 cells, which leaves 1116000 solutions.
+     */
+    for (i = 0; i < 2 * block_size && i < size; i++) {
+        for (j = 0; j < size; j++) {
+            if (i >= block_size && j >= block_size)
+                break;
+            prespecify_sudoku_cell(matrix, i, j, symbols[(i * block_size + i / block_size + j) % size]);
         }
     }
 
-    free(board);
-}*/
+    return problem;
+}
 
 
 static void destroy_sudoku_problem(SudokuProblem *problem) {
     destroy_matrix(problem->problem.matrix);
+    free(problem->rows);
     free(problem);
 }
 
@@ -3,6 +3,8 @@
 #ifndef BASIC_H
 #define BASIC_H
 
+#include <stdio.h>
+
 #include "dancing.h"
 
 
@@ -14,10 +16,29 @@ typedef struct {
     int print_stats;         /* -z */
     int print_solution;      /* -s */
     char *input_filename;    /* -f FILENAME */
+    char *cache_dir;         /* -m DIRECTORY */
+    char *output_filename;   /* -o FILENAME */
+    int compress_output;     /* -k */
+    int break_symmetry;      /* -y */
+    int reduce;              /* -r (or -R) */
+    int reduce_flags;        /* REDUCE_DOMINATED with -R */
+    int renumber;            /* -l */
+    SearchEngine engine;     /* -e ENGINE */
 } Options;
 
-typedef struct {
+typedef struct Problem {
     Matrix *matrix;
+
+    /*
+     * Optional: solve each problem read from the -f file against the matrix, instead of a single
+     * search.  Sets the counts below.
+     */
+    void (*solve_file)(struct Problem *problem, Options *options, FILE *file);
+    long int num_problems;
+    long int num_solved;
+
+    /* Optional: follow any node ids the problem holds to their new ids, after renumber_nodes. */
+    void (*renumber)(struct Problem *problem, const NodeId *remap);
 } Problem;
 
 
@@ -25,6 +46,8 @@ typedef Problem *CreateProblem(Options *options);
 typedef void DestroyProblem(Problem *problem);
 
 
+extern Matrix *load_cached_matrix(Options *options, char *fmt, ...);
+extern void save_cached_matrix(Options *options, Matrix *matrix, char *fmt, ...);
 extern int basic_main(int argc, char *argv[], CreateProblem create_problem, DestroyProblem destroy_problem);
 
 
@@ -3,18 +3,42 @@
 #ifndef DANCING_H
 #define DANCING_H
 
+#include <stdatomic.h>
+
 #include "extarray.h"
 #include "segarray.h"
 
 
 #define INDEX_NODES 1
 
+/* Keep primary columns in buckets by size, so the smallest can be found without a scan. */
+#ifndef SIZE_BUCKETS
+    #define SIZE_BUCKETS 0
+#endif
+
+/*
+ * Store each row as a contiguous run of nodes between spacer nodes, as in Knuth's DLX1, so nodes
+ * don't need left and right links.  Spacers have ROOT as their column; a spacer's up link is the
+ * first node of the row before it, and its down link the last node of the row after it.  So rows
+ * must be built one at a time: create_node can only add to the row just created, and returns 0
+ * (adding nothing) if asked to add to any other.
+ */
+#ifndef COMPACT_NODES
+    #define COMPACT_NODES 0
+#endif
+
+#if COMPACT_NODES && !INDEX_NODES
+    #error "COMPACT_NODES requires INDEX_NODES"
+#endif
+
 #if INDEX_NODES
     typedef unsigned int NodeId;
 
     #define NODE(id) (matrix->nodes.data[id])
     #define HEADER(id) (matrix->headers.data[id])
+    #define SIZE(id) (matrix->sizes.data[id])
     #define ROOT 0
+    #define SECONDARY_ROOT 1
 #else
     struct Header;
 
@@ -22,45 +46,240 @@
 
     #define NODE(id) (*id)
     #define HEADER(id) (*(Header *) id)
+    #define SIZE(id) (HEADER(id).size)
     #define ROOT matrix->root
+    #define SECONDARY_ROOT matrix->secondary_root
 #endif
 
 typedef struct Node {
     NodeId up, down;
+#if !COMPACT_NODES
     NodeId left, right;
+#endif
     NodeId column;
+#if !INDEX_NODES
+    int color;
+#endif
 } Node;
 
+/*
+ * Nodes in secondary columns can have a colour greater than 0, in which case any number of rows
+ * may share the column as long as they agree on the colour.  While a column is purified to a
+ * colour, the nodes agreeing with it have -1 instead.  With INDEX_NODES the colours are kept out
+ * of the nodes, in an array that is only allocated once the first coloured node is created, so
+ * only a matrix with colours pays for them.  SET_COLOR can only be used on such a matrix.
+ */
+#if INDEX_NODES
+    #define COLOR(id) (matrix->colors.data ? matrix->colors.data[id] : 0)
+    #define SET_COLOR(id, c) (matrix->colors.data[id] = (c))
+#else
+    #define COLOR(id) (NODE(id).color)
+    #define SET_COLOR(id, c) (NODE(id).color = (c))
+#endif
+
+#if COMPACT_NODES
+    typedef struct ColumnLinks {
+        NodeId left, right;
+    } ColumnLinks;
+
+    #define RIGHT(id) (NODE((id) + 1).column == ROOT ? NODE((id) + 1).up : (id) + 1)
+    #define LEFT(id) (NODE((id) - 1).column == ROOT ? NODE((id) - 1).down : (id) - 1)
+    #define COLUMN_RIGHT(id) (matrix->column_links.data[id].right)
+    #define COLUMN_LEFT(id) (matrix->column_links.data[id].left)
+#else
+    #define RIGHT(id) (NODE(id).right)
+    #define LEFT(id) (NODE(id).left)
+    #define COLUMN_RIGHT(id) (NODE(id).right)
+    #define COLUMN_LEFT(id) (NODE(id).left)
+#endif
+
+/*
+ * Column data kept apart from the nodes.  Plain covering doesn't touch it: with INDEX_NODES, the
+ * sizes, which covering does change, are kept in their own dense array instead.  With SIZE_BUCKETS
+ * though, every change of size reads primary and relinks bucket_prev and bucket_next here, and a
+ * search with multiplicities counts bound down as it chooses rows.
+ */
 typedef struct Header {
 #if INDEX_NODES == 0
     Node node;
+    int size;
 #endif
     char *name;
     int index;
-    int size;
     int primary;
+    /*
+     * A primary column must be covered at least bound - slack times and at most bound times.
+     * Unlike the rest of the header, the bound is search state: a search with multiplicities
+     * counts it down as rows are chosen, and back up as they are unchosen.  The slack is fixed.
+     */
+    int bound;
+    int slack;
+#if SIZE_BUCKETS
+    /* Links in the list of columns of the same size, updated as covering changes the sizes. */
+    NodeId bucket_prev, bucket_next;
+#endif
 } Header;
 
 struct Matrix;
+struct Symmetry;
+typedef struct NodeMap NodeMap;
+
+/*
+ * ENGINE_AUTO uses the bits engine when the matrix fits in it and prefer_bits expects it to be
+ * faster, and otherwise the recursive one.
+ */
+typedef enum {
+    ENGINE_AUTO,
+    ENGINE_RECURSIVE,
+    ENGINE_ITERATIVE,
+    ENGINE_COUNT,
+    ENGINE_CELLS,
+    ENGINE_BITS
+} SearchEngine;
+
+/* One level of the explicit stack used by the iterative engine. */
+typedef struct SearchFrame {
+    NodeId column;
+    NodeId row;
+    NodeId end;              /* The level stops at this row (or the column), see split_search. */
+    int index;               /* Position of the row in the column, from 1. */
+} SearchFrame;
+
+typedef enum {
+    CURSOR_ENTER,
+    CURSOR_SOLUTION,
+    CURSOR_CUTOFF,
+    CURSOR_INTERRUPTED,
+    CURSOR_DONE
+} CursorState;
+
+/* A suspended search, for pulling solutions one at a time. */
+typedef struct SearchCursor {
+    struct Matrix *matrix;
+    SearchFrame *frames;
+    int base;
+    int depth;
+    int max_depth;
+    CursorState state;
+
+    /*
+     * If set, checked at each node, which stops the search (to be carried on) when it's TRUE.  It
+     * can be set from another thread.
+     */
+    atomic_int *interrupt;
+
+    /* Set by search_descend, to carry on below a cutoff. */
+    int descend;
+} SearchCursor;
+
+/*
+ * A branch of the search tree, as the position of the column chosen (see matrix_column) and that
+ * of the row taken in it (counting from 1 at the top).  Positions are the same in clones.
+ */
+typedef struct SearchStep {
+    int column;
+    int row;
+} SearchStep;
 
 typedef int (*Callback)(struct Matrix *matrix, void *baton);
 
+/* Bins of the branch time histogram, by decade: under 10 us, under 100 us, ..., 1 s and over. */
+#define NUM_BRANCH_TIMES 7
+
+/*
+ * Hash index from column names to columns, with open addressing.  Each slot holds a name's hash,
+ * the name itself (so a lookup doesn't have to go through the header), and the column, as its
+ * NodeId or (for pointer nodes, which differ in clones) its position in the header array; an
+ * empty slot has a column of -1.
+ */
+typedef struct ColumnIndexSlot {
+    unsigned int hash;
+    long int column;
+    char *name;
+} ColumnIndexSlot;
+
+typedef struct ColumnIndex {
+    int num_slots;           /* Always a power of two, and at least twice num_columns. */
+    int num_columns;
+    ColumnIndexSlot *slots;
+} ColumnIndex;
+
+/*
+ * Index from pairs of columns (by their index, the smaller first) to the rows that have both, and
+ * from single columns (paired with 0) to their rows.  Each slot heads a list of entries, in the
+ * order the rows were created.
+ */
+typedef struct RowIndexSlot {
+    int a, b;
+    int first;               /* First entry, or -1 if the slot is empty. */
+    int last;
+} RowIndexSlot;
+
+typedef struct RowIndexEntry {
+    NodeId row;
+    int next;
+} RowIndexEntry;
+
+typedef struct RowIndex {
+    int num_nodes;           /* Nodes in the matrix when the index was built. */
+    int num_slots;
+    RowIndexSlot *slots;
+    int num_entries;
+    RowIndexEntry *entries;
+} RowIndex;
+
 typedef struct Matrix {
+    /* Primary columns are linked from ROOT, and secondary ones from SECONDARY_ROOT. */
     #if INDEX_NODES
         EXTARRAY(Node) nodes;
         EXTARRAY(Header) headers;
+        EXTARRAY(int) sizes;
+        EXTARRAY(int) colors;    /* Empty until a node has a colour. */
+        #if COMPACT_NODES
+            EXTARRAY(ColumnLinks) column_links;
+        #endif
     #else
         SEGARRAY(Node) nodes;
         SEGARRAY(Header) headers;
         NodeId root;
+        NodeId secondary_root;
     #endif
 
     int num_columns;
     int num_rows;
     int num_nodes;
 
+    /* Set in clones, which share their column names (and the index of them) with the original. */
+    int shared_names;
+    ColumnIndex *column_index;
+
+    /* Built by find_row when first needed, and not shared with clones. */
+    RowIndex *row_index;
+
+    /* Set when the arrays (and names) are mapped from a file by load_matrix. */
+    void *mapping;
+    size_t mapping_size;
+
+    /* Set when any column has bounds other than exactly once; see set_column_bounds. */
+    int multiplicities;
+
+    /* Symmetries declared with add_symmetry, shared with clones. */
+    struct Symmetry *symmetry;
+
     EXTARRAY(NodeId) solution;
 
+    SearchEngine engine;
+
+#if SIZE_BUCKETS
+    /*
+     * First primary column of each size (or 0), whose bucket_prev is the last, and the lowest size
+     * that might be non-empty.
+     */
+    EXTARRAY(NodeId) buckets;
+    int bucket_min;
+    int bucket_count;
+#endif
+
     Callback solution_callback;
     void *solution_baton;
 
@@ -69,27 +288,90 @@ typedef struct Matrix {
 
     /* Statistics. */
     long int num_solutions;
+    long int num_symmetric_solutions;    /* Including symmetric copies, with break_symmetry. */
     long int search_calls;
     long int num_messages;
     long int num_subsearches;
+    double clone_time;
+    double subsearch_time;
+    long int num_shared_branches;        /* Gone into with a cursor, where they can be split. */
+    long int num_whole_branches;         /* Searched to the end in one go. */
+    long int branch_times[NUM_BRANCH_TIMES];
+    double probe_time;
+    long int num_batches;
 } Matrix;
 
 
-#define foreachlink(h,a,x) for (x = NODE(h).a; x != (h); x = NODE(x).a)
+#define LINK_up(id) (NODE(id).up)
+#define LINK_down(id) (NODE(id).down)
+#define LINK_left(id) LEFT(id)
+#define LINK_right(id) RIGHT(id)
+
+/* Walk around a column (up or down) or a row (left or right), starting after h. */
+#define foreachlink(h,a,x) for (x = LINK_##a(h); x != (h); x = LINK_##a(x))
+
+/* Walk along the columns linked from ROOT or SECONDARY_ROOT. */
+#define foreachcolumn(h,x) for (x = COLUMN_RIGHT(h); x != (h); x = COLUMN_RIGHT(x))
 
 
 extern Matrix *create_matrix();
 extern NodeId create_column(Matrix *matrix, int primary, char *fmt, ...);
 extern NodeId create_node(Matrix *matrix, NodeId after, NodeId column);
+extern NodeId create_colored_node(Matrix *matrix, NodeId after, NodeId column, int color);
+extern Matrix *build_matrix_csr(int num_columns, int num_primary, int num_rows, const int *row_offsets, const int *column_indices);
+extern void name_column(Matrix *matrix, NodeId column, char *fmt, ...);
+extern NodeId matrix_column(Matrix *matrix, int i);
+extern void set_column_bounds(Matrix *matrix, NodeId column, int lower, int upper);
 extern void destroy_matrix(Matrix *matrix);
+extern void reindex_matrix(Matrix *matrix);
 extern Matrix *clone_matrix(Matrix *matrix);
+extern NodeMap *create_node_map(Matrix *clone, Matrix *original);
+extern void map_nodes(NodeMap *map, NodeId *ids, int num_ids);
+extern void destroy_node_map(NodeMap *map);
 extern void print_matrix(Matrix *matrix);
 extern void print_row(Matrix *matrix, NodeId row);
 extern void print_solution(Matrix *matrix);
 extern int search_matrix_internal(Matrix *matrix, int depth, int max_depth);
 extern NodeId find_column(Matrix *matrix, char *fmt, ...);
+extern unsigned int column_name_hash(const char *name);
+extern NodeId lookup_column(Matrix *matrix, const char *name, unsigned int hash);
 extern NodeId find_row(Matrix *matrix, NodeId *columns, int num_columns);
 extern void choose_row(Matrix *matrix, NodeId row);
+extern NodeId unchoose_row(Matrix *matrix);
+extern int matrix_mark(Matrix *matrix);
+extern void matrix_rollback(Matrix *matrix, int mark);
+extern void remove_row(Matrix *matrix, NodeId row);
+extern void restore_row(Matrix *matrix, NodeId row);
+#if INDEX_NODES
+extern int *matrix_row_numbers(Matrix *matrix);
+extern NodeId *renumber_nodes(Matrix *matrix);
+#endif
+extern int report_solution(Matrix *matrix);
 extern int search_matrix(Matrix *matrix, int max_depth);
+extern long int count_solutions(Matrix *matrix);
+
+/*
+ * Pull-style search.  Each call to search_next finds the next solution, leaving it in
+ * matrix->solution, and returns TRUE; it returns FALSE once there are no more.  The matrix
+ * belongs to the cursor until search_end is called, which also restores the matrix if the search
+ * is abandoned early.  Callbacks on the matrix are not used.  Cursors don't branch on column
+ * bounds, so search_begin returns NULL for a matrix with multiplicities.
+ */
+extern SearchCursor *search_begin(Matrix *matrix);
+extern int search_next(SearchCursor *cursor);
+extern void search_end(SearchCursor *cursor);
+
+/*
+ * Lower level control of a cursor, for sharing one search among threads.  search_advance stops
+ * at every solution (which it leaves to the caller to report), cutoff and interruption, and
+ * split_search hands a branch the cursor has yet to try over to a search elsewhere, which starts
+ * with choose_steps.  After a cutoff, search_descend carries on below it rather than backtracking,
+ * so with max_depth 0 the caller decides at every node whether the cursor searches below it.
+ */
+extern CursorState search_advance(SearchCursor *cursor);
+extern void search_descend(SearchCursor *cursor);
+extern double estimate_search(Matrix *matrix, int num_probes, double limit, unsigned int *seed);
+extern int split_search(SearchCursor *cursor, SearchStep *steps);
+extern void choose_steps(Matrix *matrix, const SearchStep *steps, int num_steps);
 
 #endif
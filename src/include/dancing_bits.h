@@ -0,0 +1,57 @@
+#pragma once
+
+#ifndef DANCING_BITS_H
+#define DANCING_BITS_H
+
+#include <stdint.h>
+
+#include "dancing.h"
+
+
+/* Matrices with more rows than this are left to the linked search. */
+#define BITS_MAX_ROWS 4096
+
+/*
+ * A small matrix compiled into bitsets.  Each column has a bitset of the rows in it, and the state
+ * at each level of the search is just a bitset of the rows still available and one of the primary
+ * columns still to be covered.  Choosing a row clears the rows of each of its columns from the
+ * available set, and backtracking goes back to the previous level's copy.
+ */
+typedef struct BitsMatrix {
+    Matrix *matrix;
+
+    int num_columns;
+    int num_primary;
+    int num_rows;
+    int num_uncovered;       /* Primary columns still to be covered at the first level. */
+    int row_words;           /* Words in a set of rows. */
+    int column_words;        /* Words in a set of primary columns. */
+
+    uint64_t *column_rows;   /* Set of rows in each column. */
+    int *column_begin;       /* First and last+1 words with any of each column's rows. */
+    int *column_end;
+    int *row_start;          /* Start of each row's columns in row_columns. */
+    int *row_columns;
+    int *row_primary;        /* Number of primary columns in each row. */
+
+    /* Rows of each primary column in the order of its list, with the node in the column. */
+    int *list_start;
+    int *list_rows;
+    NodeId *list_nodes;
+
+    int *node_row;           /* Row of each node in the original matrix, or -1. */
+
+    uint64_t *rows;          /* Rows still available, at each level. */
+    uint64_t *uncovered;     /* Primary columns still to be covered, at each level. */
+} BitsMatrix;
+
+
+extern BitsMatrix *compile_bits(Matrix *matrix);
+extern void destroy_bits(BitsMatrix *bits);
+extern int prefer_bits(const BitsMatrix *bits);
+extern int search_bits(BitsMatrix *bits);
+extern int choose_bits_row(BitsMatrix *bits, NodeId row);
+extern void reset_bits(BitsMatrix *bits);
+
+
+#endif
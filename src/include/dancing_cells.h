@@ -0,0 +1,53 @@
+#pragma once
+
+#ifndef DANCING_CELLS_H
+#define DANCING_CELLS_H
+
+#include "dancing.h"
+
+
+/*
+ * A matrix compiled into sparse sets (after Knuth's "dancing cells").  Each item (column) has a
+ * set of cells, one for each option (row) it appears in, stored in a permuted array whose active
+ * part is a prefix.  Covering an item swaps the cells of its options out of the other items'
+ * active prefixes, and uncovering just grows the prefixes back.  Coloured secondary items are
+ * purified instead of covered, as in the linked search.
+ */
+typedef struct CellsMatrix {
+    Matrix *matrix;
+
+    int num_items;
+    int num_primary;
+    int num_active;          /* Primary items still to be covered, at the front of item. */
+    int *item;               /* Primary items, active ones first. */
+    int *item_pos;           /* Position of each primary item in item. */
+    int *set_start;          /* Start of each item's set in set. */
+    int *size;               /* Length of the active prefix of each item's set. */
+
+    int num_cells;
+    int *set;                /* Cells of each item, grouped by item. */
+    int *cell_item;          /* Item of each cell. */
+    int *cell_pos;           /* Position of each cell in set. */
+    int *cell_option;        /* Option of each cell. */
+    int *cell_color;         /* Colour of each cell, or -1 while its item is purified to it. */
+    int has_colors;          /* Whether any cell has a colour, so cell_color needs checking. */
+    NodeId *cell_node;       /* Node in the original matrix for each cell. */
+
+    int num_options;
+    int *option_start;       /* Start of each option's cells (with one extra for the end). */
+
+    int *node_cell;          /* Cell of each node in the original matrix, or -1 (INDEX_NODES only). */
+    int num_chosen;
+    int *chosen;             /* Cell by which each option taken with choose_cells_row was chosen. */
+} CellsMatrix;
+
+
+extern CellsMatrix *compile_cells(Matrix *matrix);
+extern void destroy_cells(CellsMatrix *cells);
+extern int search_cells(CellsMatrix *cells);
+extern int choose_cells_row(CellsMatrix *cells, NodeId row);
+extern void unchoose_cells_row(CellsMatrix *cells);
+extern void reset_cells(CellsMatrix *cells);
+
+
+#endif
@@ -0,0 +1,22 @@
+#pragma once
+
+#ifndef DANCING_DLX_H
+#define DANCING_DLX_H
+
+#include <stdio.h>
+
+#include "dancing.h"
+
+
+/* Names of the colours in a matrix read by read_dlx_matrix; colour c is names[c - 1]. */
+typedef struct DlxColors {
+    int num;
+    char **names;
+} DlxColors;
+
+
+extern Matrix *read_dlx_matrix(FILE *file, DlxColors *colors);
+extern void free_dlx_colors(DlxColors *colors);
+
+
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+
+#ifndef DANCING_FILE_H
+#define DANCING_FILE_H
+
+#include <stdint.h>
+
+#include "dancing.h"
+
+
+/* Bumped whenever the layout of the file changes. */
+#define MATRIX_FILE_VERSION 2
+
+/*
+ * A matrix file is this header followed by sections at the given offsets: the node, header and
+ * size arrays (and column links, with COMPACT_NODES, and colours, if any node has one) exactly as
+ * they are in memory, then the chosen rows, then the column names.  In the saved headers each name is replaced by its offset
+ * in the names section plus one (0 for none).  The sizes of the structs and the options they
+ * were compiled with are recorded, and a file that doesn't match them is refused.
+ */
+typedef struct MatrixFileHeader {
+    char magic[4];           /* "DLXM" */
+    uint32_t version;
+    uint32_t byte_order;     /* 0x01020304, as written by this machine. */
+    uint32_t node_size;
+    uint32_t header_size;
+    uint32_t flags;          /* Which of COMPACT_NODES and SIZE_BUCKETS were used. */
+
+    int32_t num_columns;
+    int32_t num_rows;
+    int32_t num_nodes;
+    int32_t multiplicities;
+
+    int32_t nodes_num;
+    int32_t headers_num;
+    int32_t solution_num;
+    int32_t colors_num;      /* 0 if no node has a colour, and nodes_num otherwise. */
+
+    uint64_t nodes_offset;
+    uint64_t headers_offset;
+    uint64_t sizes_offset;
+    uint64_t links_offset;
+    uint64_t colors_offset;
+    uint64_t solution_offset;
+    uint64_t names_offset;
+    uint64_t names_size;
+} MatrixFileHeader;
+
+
+extern int save_matrix(Matrix *matrix, const char *filename);
+extern Matrix *load_matrix(const char *filename);
+extern void unmap_matrix(Matrix *matrix);
+
+
+#endif
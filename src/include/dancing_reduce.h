@@ -0,0 +1,24 @@
+#pragma once
+
+#ifndef DANCING_REDUCE_H
+#define DANCING_REDUCE_H
+
+#include "dancing.h"
+
+
+/* Also remove dominated rows, which loses solutions (but never all of them); see reduce_matrix. */
+#define REDUCE_DOMINATED 1
+
+typedef struct ReduceStats {
+    int num_passes;
+    long int forced_rows;        /* Chosen because they were the only row in a column. */
+    long int clashing_rows;      /* Clashing with every row in some column. */
+    long int secondary_rows;     /* With no primary columns, so never chosen. */
+    long int dominated_rows;
+} ReduceStats;
+
+
+extern int reduce_matrix(Matrix *matrix, int flags, ReduceStats *stats);
+
+
+#endif
@@ -0,0 +1,61 @@
+#pragma once
+
+#ifndef DANCING_STREAM_H
+#define DANCING_STREAM_H
+
+#include <stdio.h>
+
+#include "dancing.h"
+
+
+/*
+ * A solution stream starts with "DLXS", a version byte, an encoding byte and two zero bytes.  Each
+ * solution then lists the numbers of its rows (counted from 0 in the order they were created) in
+ * the order they were chosen:
+ *
+ *   - Plain: the number of rows and then each row, as 32-bit little-endian integers.
+ *   - Compressed: as varints, the number of rows shared with the start of the previous solution,
+ *     the number of rows after them, and those rows.  The first of them is zigzag-encoded as the
+ *     difference from the previous solution's row at the same place (or from 0), since a depth
+ *     first search usually moves on to a later row in the same column.
+ */
+#define SOLUTION_STREAM_VERSION 1
+
+typedef enum {
+    STREAM_PLAIN,
+    STREAM_COMPRESSED
+} StreamEncoding;
+
+typedef struct SolutionWriter {
+    FILE *file;
+    StreamEncoding encoding;
+    int *row_numbers;        /* Row number of each node. */
+    EXTARRAY(unsigned int) previous;
+    unsigned char *buffer;
+    size_t buffer_size;
+    size_t buffer_used;
+    long int bytes_written;
+    int failed;
+} SolutionWriter;
+
+typedef struct SolutionReader {
+    FILE *file;
+    StreamEncoding encoding;
+    unsigned char *buffer;
+    size_t buffer_used;
+    size_t buffer_position;
+    /* The rows of the last solution read. */
+    EXTARRAY(unsigned int) rows;
+} SolutionReader;
+
+
+extern SolutionWriter *create_solution_writer(Matrix *matrix, FILE *file, StreamEncoding encoding);
+extern int write_solution(Matrix *matrix, SolutionWriter *writer);
+extern int destroy_solution_writer(SolutionWriter *writer);
+
+extern SolutionReader *create_solution_reader(FILE *file);
+extern int read_solution(SolutionReader *reader);
+extern void destroy_solution_reader(SolutionReader *reader);
+
+
+#endif
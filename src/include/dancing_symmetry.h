@@ -0,0 +1,46 @@
+#pragma once
+
+#ifndef DANCING_SYMMETRY_H
+#define DANCING_SYMMETRY_H
+
+#include "dancing.h"
+
+
+/*
+ * A symmetry of a matrix is a permutation of its columns, together with a permutation of its
+ * rows, that maps every row to a row with the images of its columns (in the same colours).  It
+ * maps solutions to solutions, so once the symmetries of a problem are declared, a search need
+ * only find one solution of each set of symmetric ones; see break_symmetry.
+ *
+ * Columns are given by position (creation order), and rows by number (see matrix_row_numbers).
+ * Symmetries need INDEX_NODES.
+ */
+typedef struct Symmetry {
+    int num_columns;
+    int num_rows;
+    int *row_numbers;        /* Row number of each node. */
+    NodeId *row_starts;      /* First node of each row. */
+
+    /* Each generator and group element is the column images followed by the row images. */
+    int num_generators;
+    int **generators;
+    int group_size;          /* Set by break_symmetry. */
+    int **elements;
+
+    NodeId breaker;          /* Column whose rows were cut down by break_symmetry, or 0. */
+    char *removed;           /* Whether each row was removed by break_symmetry. */
+    int breaker_rows;
+    int kept_rows;
+} Symmetry;
+
+
+extern int add_symmetry(Matrix *matrix, const int *column_images, const int *row_images);
+extern int break_symmetry(Matrix *matrix, NodeId column);
+extern int canonical_solution(Matrix *matrix);
+extern void destroy_symmetry(Symmetry *symmetry);
+#if INDEX_NODES
+extern void renumber_symmetry(Symmetry *symmetry, const NodeId *remap, int num_nodes);
+#endif
+
+
+#endif
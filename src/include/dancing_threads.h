@@ -5,6 +5,9 @@
 
 #include "dancing.h"
 
+/* A depth_cutoff which has each branch shared or not by an estimate of its size. */
+#define ADAPTIVE_DEPTH -1
+
 extern int search_with_threads(Matrix *matrix, int depth_cutoff, int num_threads);
 
 #endif
@@ -29,6 +29,14 @@ static inline void extarray_ensure(ExtArray *array, int wanted, size_t size) {
     }
 }
 
+/* Make room for exactly wanted elements, for an array whose final size is known. */
+static inline void extarray_reserve(ExtArray *array, int wanted, size_t size) {
+    if (wanted > array->max) {
+        array->data = realloc(array->data, wanted * size);
+        array->max = wanted;
+    }
+}
+
 static inline void *extarray_alloc(ExtArray *array, size_t size) {
     extarray_ensure(array, array->num + 1, size);
     void *ptr = array->data + array->num * size;
@@ -44,6 +52,8 @@ static inline void extarray_copy(ExtArray *dest_array, ExtArray *array, size_t s
 
 #define EXTARRAY_ENSURE(array, wanted) extarray_ensure((ExtArray *) &array, wanted, sizeof(array.data[0]))
 
+#define EXTARRAY_RESERVE(array, wanted) extarray_reserve((ExtArray *) &array, wanted, sizeof(array.data[0]))
+
 #define EXTARRAY_ALLOC(array) extarray_alloc((ExtArray *) &array, sizeof(array.data[0]))
 
 #define EXTARRAY_FREE(array) free(array.data)
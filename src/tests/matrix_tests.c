@@ -4,6 +4,13 @@
 #include <check.h>
 
 #include "dancing.h"
+#include "dancing_bits.h"
+#include "dancing_cells.h"
+#include "dancing_dlx.h"
+#include "dancing_file.h"
+#include "dancing_reduce.h"
+#include "dancing_stream.h"
+#include "dancing_symmetry.h"
 
 
 START_TEST(test_create_and_destroy)
@@ -40,10 +47,1006 @@ START_TEST(test_add_stuff)
     ck_assert_int_eq(NODE(x).down, a);
     ck_assert_int_eq(NODE(y).down, c);
 
-    ck_assert_int_eq(NODE(x).left, y);
-    ck_assert_int_eq(NODE(x).right, y);
-    ck_assert_int_eq(NODE(y).left, x);
-    ck_assert_int_eq(NODE(y).right, x);
+    ck_assert_int_eq(LEFT(x), y);
+    ck_assert_int_eq(RIGHT(x), y);
+    ck_assert_int_eq(LEFT(y), x);
+    ck_assert_int_eq(RIGHT(y), x);
+
+#if COMPACT_NODES
+    /* Once another row is started, the first can't be added to. */
+    create_node(matrix, 0, b);
+    ck_assert_int_eq(create_node(matrix, y, b), 0);
+    ck_assert_int_eq(matrix->num_nodes, 3);
+    ck_assert_int_eq(RIGHT(y), x);
+#endif
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_find_column)
+{
+    Matrix *matrix = create_matrix();
+
+    NodeId columns[300];
+    int i;
+    for (i = 0; i < 300; i++)
+        columns[i] = create_column(matrix, i % 2, "C%d", i);
+
+    ck_assert_int_eq(find_column(matrix, "C%d", 0), columns[0]);
+    ck_assert_int_eq(find_column(matrix, "C%d", 299), columns[299]);
+    ck_assert_int_eq(find_column(matrix, "C%d", 300), 0);
+    ck_assert_int_eq(lookup_column(matrix, "C150", column_name_hash("C150")), columns[150]);
+
+    /* Covered columns are still found, and clones share the index. */
+    NodeId x = create_node(matrix, 0, columns[1]);
+    choose_row(matrix, x);
+    ck_assert_int_eq(find_column(matrix, "C1"), columns[1]);
+
+    Matrix *clone = clone_matrix(matrix);
+    ck_assert_ptr_eq(clone->column_index, matrix->column_index);
+    {
+        Matrix *matrix = clone;
+        NodeId c = find_column(clone, "C%d", 257);
+        ck_assert(HEADER(c).name == HEADER(columns[257]).name);
+        ck_assert_int_eq(HEADER(c).index, 258);
+    }
+    destroy_matrix(clone);
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_find_row)
+{
+    Matrix *matrix = create_matrix();
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId c = create_column(matrix, 1, "C");
+    NodeId d = create_column(matrix, 1, "D");
+
+    NodeId x = create_node(matrix, 0, a);
+    NodeId x2 = create_node(matrix, x, b);
+    NodeId x3 = create_node(matrix, x2, c);
+    NodeId y = create_node(matrix, 0, c);
+    NodeId y2 = create_node(matrix, y, b);
+    NodeId y3 = create_node(matrix, y2, d);
+
+    /* The first row with all of the columns, in any order, giving its node in the first one. */
+    NodeId columns[3] = { b, c, a };
+    ck_assert_int_eq(find_row(matrix, columns, 3), x2);
+    ck_assert_int_eq(find_row(matrix, columns, 2), x2);
+    ck_assert_int_eq(find_row(matrix, &columns[1], 1), x3);
+    columns[2] = d;
+    ck_assert_int_eq(find_row(matrix, columns, 3), y2);
+    ck_assert_int_eq(find_row(matrix, &columns[2], 1), y3);
+
+    /* Rows hidden by a chosen row are still found. */
+    choose_row(matrix, x);
+    columns[0] = d;
+    columns[1] = b;
+    ck_assert_int_eq(find_row(matrix, columns, 2), y3);
+    ck_assert_int_eq(find_row(matrix, columns, 1), y3);
+
+    /* Adding nodes rebuilds the index. */
+    columns[0] = a;
+    columns[1] = d;
+    ck_assert_int_eq(find_row(matrix, columns, 2), 0);
+    NodeId z = create_node(matrix, 0, a);
+    create_node(matrix, z, d);
+    ck_assert_int_eq(find_row(matrix, columns, 2), z);
+    ck_assert_int_eq(find_row(matrix, columns, 1), x);
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+static int null_callback(Matrix *matrix, void *baton) {
+    return 0;
+}
+
+
+START_TEST(test_clone)
+{
+    Matrix *matrix = create_matrix();
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId c = create_column(matrix, 1, "C");
+
+    NodeId x = create_node(matrix, 0, a);
+    create_node(matrix, x, b);
+    NodeId y = create_node(matrix, 0, c);
+    create_node(matrix, 0, b);
+
+    choose_row(matrix, y);
+    matrix->solution_callback = null_callback;
+
+    Matrix *clone = clone_matrix(matrix);
+
+    ck_assert_int_eq(clone->num_columns, 3);
+    ck_assert_int_eq(clone->num_rows, 3);
+    ck_assert_int_eq(clone->num_nodes, 4);
+    ck_assert_int_eq(clone->solution.num, 1);
+
+    /* Column names are shared, and column C is covered in the clone too. */
+    NodeId clone_a, clone_b;
+    char *clone_name;
+    {
+        Matrix *matrix = clone;
+        clone_a = COLUMN_RIGHT(ROOT);
+        clone_b = COLUMN_RIGHT(clone_a);
+        ck_assert_int_eq(COLUMN_RIGHT(clone_b), ROOT);
+        clone_name = HEADER(clone_a).name;
+        ck_assert_int_eq(SIZE(clone_b), 2);
+    }
+    ck_assert(clone_name == HEADER(a).name);
+
+    /* The clone's chosen row maps back to the original's. */
+    NodeMap *map = create_node_map(clone, matrix);
+    NodeId row = clone->solution.data[0];
+    map_nodes(map, &row, 1);
+    ck_assert(row == y);
+    destroy_node_map(map);
+
+    /* Searching the clone must leave the original untouched. */
+    search_matrix(clone, 0);
+    ck_assert_int_eq(clone->num_solutions, 1);
+    ck_assert_int_eq(matrix->num_solutions, 0);
+    ck_assert_int_eq(SIZE(a), 1);
+    ck_assert_int_eq(SIZE(b), 2);
+
+    destroy_matrix(clone);
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_cursor)
+{
+    Matrix *matrix = create_matrix();
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+
+    NodeId x = create_node(matrix, 0, a);
+    NodeId y = create_node(matrix, 0, b);
+    NodeId z = create_node(matrix, 0, a);
+    create_node(matrix, z, b);
+
+    SearchCursor *cursor = search_begin(matrix);
+
+    ck_assert(search_next(cursor));
+    ck_assert_int_eq(matrix->solution.num, 2);
+    ck_assert_int_eq(matrix->solution.data[0], x);
+    ck_assert_int_eq(matrix->solution.data[1], y);
+
+    ck_assert(search_next(cursor));
+    ck_assert_int_eq(matrix->solution.num, 1);
+    ck_assert_int_eq(matrix->solution.data[0], z);
+
+    ck_assert(!search_next(cursor));
+    ck_assert_int_eq(matrix->num_solutions, 2);
+    search_end(cursor);
+
+    /* Abandoning a search part way through restores the matrix. */
+    cursor = search_begin(matrix);
+    ck_assert(search_next(cursor));
+    search_end(cursor);
+
+    ck_assert_int_eq(matrix->solution.num, 0);
+    ck_assert_int_eq(COLUMN_RIGHT(ROOT), a);
+    ck_assert_int_eq(SIZE(a), 2);
+    ck_assert_int_eq(SIZE(b), 2);
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_buckets)
+{
+    Matrix *matrix = create_matrix();
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId c = create_column(matrix, 1, "C");
+
+    NodeId x = create_node(matrix, 0, a);
+    create_node(matrix, create_node(matrix, 0, a), b);
+    NodeId z = create_node(matrix, 0, b);
+    create_node(matrix, z, c);
+    create_node(matrix, 0, b);
+
+    /* Each column is in the bucket for its size, A with 2 rows, B with 3 and C with 1. */
+    ck_assert_int_eq(SIZE(a), 2);
+    ck_assert_int_eq(SIZE(b), 3);
+    ck_assert_int_eq(SIZE(c), 1);
+#if SIZE_BUCKETS
+    ck_assert_int_eq(matrix->bucket_count, 3);
+    ck_assert_int_eq(matrix->buckets.data[1], c);
+    ck_assert_int_eq(matrix->buckets.data[2], a);
+    ck_assert_int_eq(matrix->buckets.data[3], b);
+#endif
+
+    /* Choosing x covers A and hides the row it shares with B, which moves down a bucket. */
+    choose_row(matrix, x);
+    ck_assert_int_eq(SIZE(b), 2);
+#if SIZE_BUCKETS
+    ck_assert_int_eq(matrix->bucket_count, 2);
+    ck_assert_int_eq(matrix->buckets.data[2], b);
+    ck_assert_int_eq(HEADER(b).bucket_next, 0);
+    ck_assert_int_eq(matrix->buckets.data[3], 0);
+#endif
+
+    unchoose_row(matrix);
+    ck_assert_int_eq(SIZE(b), 3);
+#if SIZE_BUCKETS
+    ck_assert_int_eq(matrix->bucket_count, 3);
+    ck_assert_int_eq(matrix->buckets.data[2], a);
+    ck_assert_int_eq(HEADER(a).bucket_next, 0);
+    ck_assert_int_eq(matrix->buckets.data[3], b);
+#endif
+
+    /* Removing z empties C, which becomes the smallest column. */
+    remove_row(matrix, z);
+    ck_assert_int_eq(SIZE(c), 0);
+#if SIZE_BUCKETS
+    ck_assert_int_eq(matrix->bucket_min, 0);
+    ck_assert_int_eq(matrix->buckets.data[0], c);
+    ck_assert_int_eq(matrix->buckets.data[1], 0);
+#endif
+
+    restore_row(matrix, z);
+    ck_assert_int_eq(SIZE(c), 1);
+#if SIZE_BUCKETS
+    ck_assert_int_eq(matrix->buckets.data[0], 0);
+    ck_assert_int_eq(matrix->buckets.data[1], c);
+#endif
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_split_search)
+{
+    Matrix *matrix = create_matrix();
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+
+    NodeId x = create_node(matrix, 0, a);
+    NodeId y = create_node(matrix, 0, b);
+    NodeId z = create_node(matrix, 0, a);
+    create_node(matrix, z, b);
+    NodeId w = create_node(matrix, 0, b);
+
+    matrix->solution_callback = null_callback;
+    Matrix *clone = clone_matrix(matrix);
+    atomic_int interrupt = 0;
+    SearchCursor *cursor = search_begin(matrix);
+    cursor->interrupt = &interrupt;
+
+    ck_assert_int_eq(search_advance(cursor), CURSOR_SOLUTION);
+    ck_assert_int_eq(matrix->solution.data[1], y);
+
+    /* Row z, the second in column A, is handed over; the cursor keeps row w. */
+    atomic_store(&interrupt, 1);
+    ck_assert_int_eq(search_advance(cursor), CURSOR_INTERRUPTED);
+    SearchStep steps[3];
+    ck_assert_int_eq(split_search(cursor, steps), 1);
+    ck_assert_int_eq(steps[0].column, 0);
+    ck_assert_int_eq(steps[0].row, 2);
+    ck_assert_int_eq(split_search(cursor, steps), 0);
+
+    atomic_store(&interrupt, 0);
+    ck_assert_int_eq(search_advance(cursor), CURSOR_SOLUTION);
+    ck_assert_int_eq(matrix->solution.data[0], x);
+    ck_assert_int_eq(matrix->solution.data[1], w);
+    ck_assert_int_eq(search_advance(cursor), CURSOR_DONE);
+    search_end(cursor);
+
+    choose_steps(clone, steps, 1);
+    ck_assert_int_eq(clone->solution.num, 1);
+    search_matrix(clone, 0);
+    ck_assert_int_eq(clone->num_solutions, 1);
+
+    destroy_matrix(clone);
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_estimate_search)
+{
+    Matrix *matrix = create_matrix();
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+
+    int i;
+    for (i = 0; i < 2; i++)
+        create_node(matrix, 0, a);
+    for (i = 0; i < 3; i++)
+        create_node(matrix, 0, b);
+
+    /* Every path through the tree is alike, so every probe finds all 1 + 2 + 6 nodes. */
+    unsigned int seed = 1;
+    ck_assert(estimate_search(matrix, 5, 0, &seed) == 9.0);
+    ck_assert(estimate_search(matrix, 1, 2, &seed) == 3.0);
+    ck_assert_int_eq(matrix->solution.num, 0);
+    ck_assert_int_eq(SIZE(a), 2);
+    ck_assert_int_eq(SIZE(b), 3);
+
+    /* Going on below every cutoff stops at each node once. */
+    SearchCursor *cursor = search_begin(matrix);
+    cursor->max_depth = 0;
+    int num_cutoffs = 0;
+    int num_solutions = 0;
+    CursorState state;
+    while ((state = search_advance(cursor)) != CURSOR_DONE) {
+        if (state == CURSOR_CUTOFF) {
+            num_cutoffs++;
+            search_descend(cursor);
+        } else if (state == CURSOR_SOLUTION) {
+            num_solutions++;
+        }
+    }
+    ck_assert_int_eq(num_cutoffs, 9);
+    ck_assert_int_eq(num_solutions, 6);
+    search_end(cursor);
+
+    /* Column bounds can't be estimated. */
+    set_column_bounds(matrix, a, 1, 2);
+    ck_assert(estimate_search(matrix, 1, 0, &seed) == -1.0);
+    ck_assert(search_begin(matrix) == NULL);
+    ck_assert_int_eq(matrix->solution.num, 0);
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_count)
+{
+    Matrix *matrix = create_matrix();
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId c = create_column(matrix, 1, "C");
+    NodeId s = create_column(matrix, 0, "S");
+
+    NodeId n = create_node(matrix, 0, a);
+    create_node(matrix, n, s);
+    n = create_node(matrix, 0, b);
+    create_node(matrix, n, s);
+    n = create_node(matrix, 0, a);
+    create_node(matrix, n, b);
+    create_node(matrix, 0, c);
+    create_node(matrix, 0, c);
+
+    /* {AB, C} twice; {A, B, C} is ruled out by the secondary column. */
+    ck_assert_int_eq(count_solutions(matrix), 2);
+    ck_assert_int_eq(matrix->num_solutions, 2);
+    ck_assert_int_eq(SIZE(a), 2);
+    ck_assert_int_eq(SIZE(s), 2);
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_build_csr)
+{
+    /* The matrix of test_count: A S, B S, A B, C, C, with S secondary. */
+    int row_offsets[] = { 0, 2, 4, 6, 7, 8 };
+    int column_indices[] = { 0, 3, 1, 3, 0, 1, 2, 2 };
+    Matrix *matrix = build_matrix_csr(4, 3, 5, row_offsets, column_indices);
+
+    ck_assert_int_eq(matrix->num_columns, 4);
+    ck_assert_int_eq(matrix->num_rows, 5);
+    ck_assert_int_eq(matrix->num_nodes, 8);
+
+    NodeId a = matrix_column(matrix, 0);
+    NodeId s = matrix_column(matrix, 3);
+    ck_assert_int_eq(COLUMN_RIGHT(ROOT), a);
+    ck_assert_int_eq(COLUMN_RIGHT(SECONDARY_ROOT), s);
+    ck_assert_int_eq(SIZE(a), 2);
+    ck_assert_int_eq(SIZE(s), 2);
+    ck_assert_int_eq(NODE(RIGHT(NODE(a).down)).column, s);
+
+    ck_assert_int_eq(count_solutions(matrix), 2);
+
+    name_column(matrix, s, "S");
+    ck_assert_int_eq(find_column(matrix, "S"), s);
+    ck_assert_int_eq(find_column(matrix, "A"), 0);
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_read_dlx)
+{
+    char text[] =
+        "| Knuth's example with colours\n"
+        "A B C | X Y\n"
+        "A B X:0 Y:0\n"
+        "A C X:1 Y:1\n"
+        "\n"
+        "C X:0\n"
+        "B X:1\n"
+        "C Y:1";
+    FILE *file = fmemopen(text, sizeof(text) - 1, "r");
+    DlxColors colors;
+    Matrix *matrix = read_dlx_matrix(file, &colors);
+    fclose(file);
+    ck_assert_ptr_ne(matrix, NULL);
+
+    ck_assert_int_eq(matrix->num_columns, 5);
+    ck_assert_int_eq(matrix->num_rows, 5);
+    ck_assert_int_eq(matrix->num_nodes, 14);
+    ck_assert_int_eq(HEADER(find_column(matrix, "C")).primary, 1);
+    ck_assert_int_eq(HEADER(find_column(matrix, "X")).primary, 0);
+    ck_assert_int_eq(colors.num, 2);
+    ck_assert_str_eq(colors.names[0], "0");
+    ck_assert_int_eq(count_solutions(matrix), 2);
+
+    free_dlx_colors(&colors);
+    destroy_matrix(matrix);
+
+    /* Bounds on primary items. */
+    char bounds_text[] = "0:2|A 2|B\nA B\nA\nB\n";
+    file = fmemopen(bounds_text, sizeof(bounds_text) - 1, "r");
+    matrix = read_dlx_matrix(file, NULL);
+    fclose(file);
+    ck_assert_ptr_ne(matrix, NULL);
+    ck_assert_int_eq(matrix->multiplicities, 1);
+    ck_assert_int_eq(count_solutions(matrix), 2);
+    destroy_matrix(matrix);
+
+    /* An item repeated in an option. */
+    char bad_text[] = "A B\nA B A\n";
+    file = fmemopen(bad_text, sizeof(bad_text) - 1, "r");
+    ck_assert_ptr_eq(read_dlx_matrix(file, NULL), NULL);
+    fclose(file);
+}
+END_TEST
+
+START_TEST(test_solution_stream)
+{
+    Matrix *matrix = create_matrix();
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId c = create_column(matrix, 1, "C");
+
+    /* Rows 0 to 5: A, B, C, AB, BC, ABC. */
+    create_node(matrix, 0, a);
+    create_node(matrix, 0, b);
+    create_node(matrix, 0, c);
+    create_node(matrix, create_node(matrix, 0, a), b);
+    create_node(matrix, create_node(matrix, 0, b), c);
+    create_node(matrix, create_node(matrix, create_node(matrix, 0, a), b), c);
+
+    StreamEncoding encoding;
+    for (encoding = STREAM_PLAIN; encoding <= STREAM_COMPRESSED; encoding++) {
+        FILE *file = tmpfile();
+        SolutionWriter *writer = create_solution_writer(matrix, file, encoding);
+#if INDEX_NODES
+        ck_assert_ptr_ne(writer, NULL);
+        matrix->solution_callback = (Callback) write_solution;
+        matrix->solution_baton = writer;
+        matrix->num_solutions = 0;
+        search_matrix(matrix, 0);
+        ck_assert_int_eq(matrix->num_solutions, 4);
+        ck_assert(destroy_solution_writer(writer));
+
+        /* Each solution read back as a set of rows: {0, 1, 2}, {0, 4}, {2, 3} and {5}. */
+        rewind(file);
+        SolutionReader *reader = create_solution_reader(file);
+        ck_assert_ptr_ne(reader, NULL);
+        int num_read = 0;
+        int total = 0;
+        while (read_solution(reader) == 1) {
+            int set = 0;
+            int i;
+            for (i = 0; i < reader->rows.num; i++)
+                set |= 1 << reader->rows.data[i];
+            ck_assert(set == 7 || set == 17 || set == 12 || set == 32);
+            total += set;
+            num_read++;
+        }
+        ck_assert_int_eq(num_read, 4);
+        ck_assert_int_eq(total, 7 + 17 + 12 + 32);
+        destroy_solution_reader(reader);
+#else
+        ck_assert_ptr_eq(writer, NULL);
+#endif
+        fclose(file);
+    }
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_symmetry)
+{
+    Matrix *matrix = create_matrix();
+    matrix->solution_callback = null_callback;
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId c = create_column(matrix, 1, "C");
+
+    /* Rows 0 to 5: A, B, C, AB, BC, CA. */
+    create_node(matrix, 0, a);
+    create_node(matrix, 0, b);
+    create_node(matrix, 0, c);
+    create_node(matrix, create_node(matrix, 0, a), b);
+    create_node(matrix, create_node(matrix, 0, b), c);
+    create_node(matrix, create_node(matrix, 0, c), a);
+
+    int rotation[] = { 1, 2, 0 };
+#if INDEX_NODES
+    int reflection[] = { 1, 0, 2 };
+    int reflection_rows[] = { 1, 0, 2, 3, 5, 4 };
+    int not_a_permutation[] = { 0, 0, 1 };
+    int wrong_rows[] = { 1, 0, 2, 3, 4, 5 };
+    ck_assert(add_symmetry(matrix, rotation, NULL));
+    ck_assert(!add_symmetry(matrix, not_a_permutation, NULL));
+    ck_assert(!add_symmetry(matrix, reflection, wrong_rows));
+    ck_assert(add_symmetry(matrix, reflection, reflection_rows));
+
+    /* The six permutations of A, B and C; only rows A and AB are kept of those with A. */
+    ck_assert_int_eq(break_symmetry(matrix, 0), 6);
+    ck_assert(matrix->symmetry->breaker == a);
+    ck_assert_int_eq(matrix->symmetry->kept_rows, 2);
+    ck_assert_int_eq(matrix->symmetry->breaker_rows, 3);
+
+    /* Of the solutions {A, B, C}, {AB, C}, {BC, A} and {CA, B}, only two aren't symmetric. */
+    search_matrix(matrix, 0);
+    ck_assert_int_eq(matrix->num_solutions, 2);
+    ck_assert_int_eq(matrix->num_symmetric_solutions, 4);
+    ck_assert_int_eq(count_solutions(matrix), 2);
+    matrix->engine = ENGINE_COUNT;
+    search_matrix(matrix, 0);
+    ck_assert_int_eq(matrix->num_solutions, 2);
+    matrix->engine = ENGINE_AUTO;
+
+    SearchCursor *cursor = search_begin(matrix);
+    int num_found = 0;
+    while (search_next(cursor))
+        num_found++;
+    search_end(cursor);
+    ck_assert_int_eq(num_found, 2);
+#else
+    ck_assert(!add_symmetry(matrix, rotation, NULL));
+#endif
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_reduce)
+{
+    int flags;
+    for (flags = 0; flags <= REDUCE_DOMINATED; flags += REDUCE_DOMINATED) {
+        Matrix *matrix = create_matrix();
+        matrix->solution_callback = null_callback;
+
+        NodeId a = create_column(matrix, 1, "A");
+        NodeId b = create_column(matrix, 1, "B");
+        NodeId d = create_column(matrix, 1, "D");
+        NodeId s = create_column(matrix, 0, "S");
+
+        /* Rows: AB, DA, DAS, B, S, AS.  Every row with D has A, so AB and AS can't be chosen. */
+        create_node(matrix, create_node(matrix, 0, a), b);
+        create_node(matrix, create_node(matrix, 0, d), a);
+        create_node(matrix, create_node(matrix, create_node(matrix, 0, d), a), s);
+        NodeId only_b = create_node(matrix, 0, b);
+        create_node(matrix, 0, s);
+        create_node(matrix, create_node(matrix, 0, a), s);
+
+        ReduceStats stats;
+        ck_assert(reduce_matrix(matrix, flags, &stats));
+        ck_assert_int_eq(stats.clashing_rows, 2);
+        ck_assert_int_eq(stats.secondary_rows, 1);
+        ck_assert_int_eq(stats.dominated_rows, flags ? 1 : 0);
+
+        /* B is forced, and then DA too once DAS is dominated by it. */
+        ck_assert_int_eq(stats.forced_rows, flags ? 2 : 1);
+        ck_assert_int_eq(matrix->solution.num, flags ? 2 : 1);
+        ck_assert(matrix->solution.data[0] == only_b || matrix->solution.data[1] == only_b);
+
+        search_matrix(matrix, 0);
+        ck_assert_int_eq(matrix->num_solutions, flags ? 1 : 2);
+
+        destroy_matrix(matrix);
+    }
+
+    /* C has only BC, which leaves nothing for A. */
+    Matrix *matrix = create_matrix();
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId c = create_column(matrix, 1, "C");
+    create_node(matrix, create_node(matrix, 0, a), b);
+    create_node(matrix, create_node(matrix, 0, b), c);
+    ck_assert(!reduce_matrix(matrix, 0, NULL));
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_renumber)
+{
+#if INDEX_NODES
+    Matrix *matrix = create_matrix();
+    matrix->solution_callback = null_callback;
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId c = create_column(matrix, 1, "C");
+
+    /* Rows: AB, C, A, BC, B. */
+    NodeId ab = create_node(matrix, 0, a);
+    create_node(matrix, ab, b);
+    NodeId only_c = create_node(matrix, 0, c);
+    create_node(matrix, 0, a);
+    create_node(matrix, create_node(matrix, 0, b), c);
+    create_node(matrix, 0, b);
+    choose_row(matrix, only_c);
+
+    NodeId *remap = renumber_nodes(matrix);
+#if COMPACT_NODES
+    ck_assert(remap == NULL);
+#else
+    ck_assert(remap != NULL);
+    ck_assert_int_eq(remap[a], a);
+    ck_assert_int_eq(remap[c], c);
+
+    /* AB and then A come first, each row's nodes following one another. */
+    ck_assert_int_eq(remap[ab], matrix->headers.num);
+    ck_assert_int_eq(NODE(a).down, remap[ab]);
+    ck_assert_int_eq(RIGHT(remap[ab]), remap[ab] + 1);
+    ck_assert_int_eq(NODE(remap[ab] + 1).column, b);
+    ck_assert_int_eq(NODE(remap[ab]).down, remap[ab] + 2);
+    ck_assert_int_eq(matrix->solution.data[0], remap[only_c]);
+    free(remap);
+
+    /* With C chosen, AB is left or A and B; without it, A and BC too. */
+    search_matrix(matrix, 0);
+    ck_assert_int_eq(matrix->num_solutions, 2);
+    unchoose_row(matrix);
+    search_matrix(matrix, 0);
+    ck_assert_int_eq(matrix->num_solutions, 3);
+#endif
+
+    destroy_matrix(matrix);
+#endif
+}
+END_TEST
+
+START_TEST(test_save_and_load)
+{
+    Matrix *matrix = create_matrix();
+    matrix->solution_callback = null_callback;
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId c = create_column(matrix, 1, "C");
+    NodeId s = create_column(matrix, 0, "S");
+
+    NodeId n = create_node(matrix, 0, a);
+    create_node(matrix, n, s);
+    n = create_node(matrix, 0, b);
+    create_node(matrix, n, s);
+    n = create_node(matrix, 0, a);
+    create_node(matrix, n, b);
+    NodeId x = create_node(matrix, 0, c);
+    create_node(matrix, 0, c);
+    choose_row(matrix, x);
+
+#if INDEX_NODES
+    ck_assert(save_matrix(matrix, "test_matrix.dlxm"));
+    Matrix *loaded = load_matrix("test_matrix.dlxm");
+    remove("test_matrix.dlxm");
+    ck_assert_ptr_ne(loaded, NULL);
+
+    /* The same matrix, with the same row chosen. */
+    ck_assert_int_eq(loaded->num_columns, 4);
+    ck_assert_int_eq(loaded->num_nodes, 8);
+    ck_assert_int_eq(loaded->solution.num, 1);
+    ck_assert_int_eq(loaded->solution.data[0], x);
+    ck_assert_int_eq(find_column(loaded, "S"), s);
+
+    loaded->solution_callback = null_callback;
+    search_matrix(loaded, 0);
+    ck_assert_int_eq(loaded->num_solutions, 1);
+
+    Matrix *clone = clone_matrix(loaded);
+    search_matrix(clone, 0);
+    ck_assert_int_eq(clone->num_solutions, 1);
+    destroy_matrix(clone);
+
+    matrix_rollback(loaded, 0);
+    ck_assert_int_eq(count_solutions(loaded), 2);
+    destroy_matrix(loaded);
+#else
+    ck_assert(!save_matrix(matrix, "test_matrix.dlxm"));
+#endif
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_rollback)
+{
+    Matrix *matrix = create_matrix();
+    matrix->solution_callback = null_callback;
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId c = create_column(matrix, 1, "C");
+
+    NodeId x = create_node(matrix, 0, a);
+    create_node(matrix, x, b);
+    NodeId y = create_node(matrix, 0, c);
+    NodeId z = create_node(matrix, 0, a);
+    NodeId w = create_node(matrix, 0, b);
+    create_node(matrix, w, c);
+
+    int mark = matrix_mark(matrix);
+    choose_row(matrix, x);
+    choose_row(matrix, y);
+    ck_assert_int_eq(COLUMN_RIGHT(ROOT), ROOT);
+
+    ck_assert_int_eq(unchoose_row(matrix), y);
+    ck_assert_int_eq(COLUMN_RIGHT(ROOT), c);
+    ck_assert_int_eq(SIZE(c), 1);
+
+    /* Rolling back leaves the matrix as it was, ready for other rows. */
+    matrix_rollback(matrix, mark);
+    ck_assert_int_eq(matrix->solution.num, 0);
+    ck_assert_int_eq(unchoose_row(matrix), 0);
+    ck_assert_int_eq(SIZE(a), 2);
+    ck_assert_int_eq(SIZE(b), 2);
+    ck_assert_int_eq(SIZE(c), 2);
+
+    choose_row(matrix, z);
+    search_matrix(matrix, 0);
+    ck_assert_int_eq(matrix->num_solutions, 1);
+    matrix_rollback(matrix, mark);
+
+    search_matrix(matrix, 0);
+    ck_assert_int_eq(matrix->num_solutions, 2);
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_cells)
+{
+    Matrix *matrix = create_matrix();
+    matrix->solution_callback = null_callback;
+    matrix->engine = ENGINE_CELLS;
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId c = create_column(matrix, 1, "C");
+    NodeId s = create_column(matrix, 0, "S");
+
+    NodeId as = create_node(matrix, 0, a);
+    create_node(matrix, as, s);
+    NodeId n = create_node(matrix, 0, b);
+    create_node(matrix, n, s);
+    NodeId ab = create_node(matrix, 0, a);
+    create_node(matrix, ab, b);
+    create_node(matrix, 0, c);
+    create_node(matrix, 0, c);
+
+    CellsMatrix *cells = compile_cells(matrix);
+    ck_assert_int_eq(cells->num_items, 4);
+    ck_assert_int_eq(cells->num_primary, 3);
+    ck_assert_int_eq(cells->num_options, 5);
+    ck_assert_int_eq(cells->num_cells, 8);
+    destroy_cells(cells);
+
+    search_matrix(matrix, 0);
+    ck_assert_int_eq(matrix->num_solutions, 2);
+    ck_assert_int_eq(matrix->solution.num, 0);
+
+#if INDEX_NODES
+    /* Rows can be chosen before searching, and reset for the next branch. */
+    cells = compile_cells(matrix);
+    matrix->num_solutions = 0;
+    ck_assert_int_eq(choose_cells_row(cells, as), 1);
+    ck_assert_int_eq(choose_cells_row(cells, n), 0);
+    ck_assert_int_eq(choose_cells_row(cells, ab), 0);
+    search_cells(cells);
+    ck_assert_int_eq(matrix->num_solutions, 0);
+
+    reset_cells(cells);
+    ck_assert_int_eq(choose_cells_row(cells, ab), 1);
+    search_cells(cells);
+    ck_assert_int_eq(matrix->num_solutions, 2);
+
+    reset_cells(cells);
+    ck_assert_int_eq(cells->num_active, 3);
+    ck_assert_int_eq(cells->size[0], 2);
+    search_cells(cells);
+    ck_assert_int_eq(matrix->num_solutions, 4);
+    destroy_cells(cells);
+#endif
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_colors)
+{
+    Matrix *matrix = create_matrix();
+    matrix->solution_callback = null_callback;
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId s = create_column(matrix, 0, "S");
+
+    NodeId n = create_node(matrix, 0, a);
+    NodeId red = create_colored_node(matrix, n, s, 1);
+    n = create_node(matrix, 0, a);
+    create_colored_node(matrix, n, s, 2);
+    n = create_node(matrix, 0, b);
+    create_colored_node(matrix, n, s, 1);
+    n = create_node(matrix, 0, b);
+    create_colored_node(matrix, n, s, 2);
+    n = create_node(matrix, 0, b);
+    create_node(matrix, n, s);
+
+    /* Only rows agreeing on the colour of S can go together, and the uncoloured one agrees with none. */
+    SearchEngine engines[] = { ENGINE_RECURSIVE, ENGINE_ITERATIVE, ENGINE_COUNT, ENGINE_CELLS };
+    int i;
+    for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        matrix->engine = engines[i];
+        search_matrix(matrix, 0);
+        ck_assert_int_eq(matrix->num_solutions, 2);
+        ck_assert_int_eq(SIZE(s), 5);
+        ck_assert_int_eq(COLOR(red), 1);
+    }
+
+    /* The colours go with the nodes into clones and files. */
+    Matrix *clone = clone_matrix(matrix);
+    search_matrix(clone, 0);
+    ck_assert_int_eq(clone->num_solutions, 2);
+    destroy_matrix(clone);
+#if INDEX_NODES
+    ck_assert(save_matrix(matrix, "test_matrix.dlxm"));
+    Matrix *loaded = load_matrix("test_matrix.dlxm");
+    remove("test_matrix.dlxm");
+    ck_assert_ptr_ne(loaded, NULL);
+    loaded->solution_callback = null_callback;
+    search_matrix(loaded, 0);
+    ck_assert_int_eq(loaded->num_solutions, 2);
+    destroy_matrix(loaded);
+#endif
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+START_TEST(test_multiplicities)
+{
+    Matrix *matrix = create_matrix();
+    matrix->solution_callback = null_callback;
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    set_column_bounds(matrix, a, 2, 3);
+
+    create_node(matrix, 0, a);
+    create_node(matrix, 0, a);
+    NodeId n = create_node(matrix, 0, a);
+    create_node(matrix, n, b);
+    create_node(matrix, 0, b);
+
+    /* With AB: A once or twice more (3 ways); with B: A twice more (1 way). */
+    SearchEngine engines[] = { ENGINE_RECURSIVE, ENGINE_COUNT, ENGINE_CELLS };
+    int i;
+    for (i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+        matrix->engine = engines[i];
+        search_matrix(matrix, 0);
+        ck_assert_int_eq(matrix->num_solutions, 4);
+        ck_assert_int_eq(SIZE(a), 3);
+        ck_assert_int_eq(HEADER(a).bound, 3);
+    }
+    ck_assert_int_eq(count_solutions(matrix), 4);
+    ck_assert_int_eq(HEADER(a).bound, 3);
+
+    /* Choosing AB leaves A once or twice more; rolling back restores the bound. */
+    matrix->engine = ENGINE_RECURSIVE;
+    int mark = matrix_mark(matrix);
+    choose_row(matrix, n);
+    search_matrix(matrix, 0);
+    ck_assert_int_eq(matrix->num_solutions, 3);
+    matrix_rollback(matrix, mark);
+    ck_assert_int_eq(SIZE(a), 3);
+    ck_assert_int_eq(HEADER(a).bound, 3);
+    search_matrix(matrix, 0);
+    ck_assert_int_eq(matrix->num_solutions, 4);
+
+    destroy_matrix(matrix);
+}
+END_TEST
+
+static int record_callback(Matrix *matrix, void *baton) {
+    NodeId *rows = baton;
+    int i;
+    for (i = 0; i < matrix->solution.num; i++)
+        *rows++ = matrix->solution.data[i];
+    return 0;
+}
+
+START_TEST(test_bits)
+{
+    Matrix *matrix = create_matrix();
+    matrix->solution_callback = record_callback;
+
+    NodeId a = create_column(matrix, 1, "A");
+    NodeId b = create_column(matrix, 1, "B");
+    NodeId s = create_column(matrix, 0, "S");
+
+    create_node(matrix, 0, a);
+    NodeId y = create_node(matrix, 0, b);
+    create_node(matrix, y, s);
+    NodeId z = create_node(matrix, 0, b);
+    NodeId w = create_node(matrix, 0, a);
+    create_node(matrix, w, s);
+
+#if INDEX_NODES
+    BitsMatrix *bits = compile_bits(matrix);
+    ck_assert_ptr_ne(bits, NULL);
+    ck_assert_int_eq(bits->num_rows, 4);
+    ck_assert_int_eq(bits->num_primary, 2);
+    destroy_bits(bits);
+#endif
+
+    /* The same solutions in the same order as the recursive engine, the last one being w + z. */
+    NodeId recursive[2];
+    NodeId bitwise[2];
+    matrix->engine = ENGINE_RECURSIVE;
+    matrix->solution_baton = recursive;
+    search_matrix(matrix, 0);
+    ck_assert_int_eq(matrix->num_solutions, 3);
+    long int calls = matrix->search_calls;
+
+    matrix->engine = ENGINE_BITS;
+    matrix->solution_baton = bitwise;
+    search_matrix(matrix, 0);
+    ck_assert_int_eq(matrix->num_solutions, 3);
+    ck_assert_int_eq(matrix->search_calls, calls);
+#if !SIZE_BUCKETS
+    /* The buckets break ties between columns differently from the scan the bits engine uses. */
+    ck_assert_int_eq(bitwise[0], recursive[0]);
+    ck_assert_int_eq(bitwise[1], recursive[1]);
+#endif
+    ck_assert(bitwise[0] == w || bitwise[1] == w);
+    ck_assert(bitwise[0] == z || bitwise[1] == z);
+
+#if INDEX_NODES
+    /* Rows can be chosen before searching, and reset for the next problem. */
+    bits = compile_bits(matrix);
+    matrix->num_solutions = 0;
+    ck_assert_int_eq(choose_bits_row(bits, w), 1);
+    ck_assert_int_eq(choose_bits_row(bits, y), 0);
+    search_bits(bits);
+    ck_assert_int_eq(matrix->num_solutions, 1);
+    ck_assert_int_eq(bitwise[0], z);
+
+    reset_bits(bits);
+    matrix->num_solutions = 0;
+    search_bits(bits);
+    ck_assert_int_eq(matrix->num_solutions, 3);
+    destroy_bits(bits);
+#endif
+
+    /* Colours don't fit in bitsets. */
+    NodeId n = create_node(matrix, 0, a);
+    create_colored_node(matrix, n, s, 1);
+    ck_assert_ptr_eq(compile_bits(matrix), NULL);
 
     destroy_matrix(matrix);
 }
@@ -60,6 +1063,26 @@ Suite *matrix_suite(void) {
 
     tcase_add_test(tc_core, test_create_and_destroy);
     tcase_add_test(tc_core, test_add_stuff);
+    tcase_add_test(tc_core, test_find_column);
+    tcase_add_test(tc_core, test_find_row);
+    tcase_add_test(tc_core, test_clone);
+    tcase_add_test(tc_core, test_cursor);
+    tcase_add_test(tc_core, test_buckets);
+    tcase_add_test(tc_core, test_split_search);
+    tcase_add_test(tc_core, test_estimate_search);
+    tcase_add_test(tc_core, test_count);
+    tcase_add_test(tc_core, test_build_csr);
+    tcase_add_test(tc_core, test_read_dlx);
+    tcase_add_test(tc_core, test_save_and_load);
+    tcase_add_test(tc_core, test_solution_stream);
+    tcase_add_test(tc_core, test_symmetry);
+    tcase_add_test(tc_core, test_reduce);
+    tcase_add_test(tc_core, test_renumber);
+    tcase_add_test(tc_core, test_rollback);
+    tcase_add_test(tc_core, test_cells);
+    tcase_add_test(tc_core, test_colors);
+    tcase_add_test(tc_core, test_multiplicities);
+    tcase_add_test(tc_core, test_bits);
     suite_add_tcase(s, tc_core);
 
     return s;